@@ -1,6 +1,17 @@
 from ctypes import *
 
 MAGIC = 0x30303635
+JOURNAL_MAGIC = 0x4c4e524a
+JOURNAL_OP_BLOCKS = 12
+
+FEAT_JOURNAL = 0x1
+FEAT_LOG = 0x2
+FEAT_COW = 0x4
+
+MAX_IMAP_BLOCKS = 32
+MAX_SNAPSHOTS = 16
+
+PTR_UNWRITTEN = 0x80000000
 
 class dirent(Structure):
     _fields_ = [("valid", c_uint, 1),
@@ -10,7 +21,48 @@ class dirent(Structure):
 class super(Structure):
     _fields_ = [("magic", c_uint),
                 ("disk_sz", c_uint),
-                ("_pad", c_char * 4088)]
+                ("features", c_uint),
+                ("journal_start", c_uint),
+                ("journal_len", c_uint),
+                ("imap_start", c_uint),
+                ("imap_len", c_uint),
+                ("owner_start", c_uint),
+                ("owner_len", c_uint),
+                ("seg_size", c_uint),
+                ("birth_start", c_uint),
+                ("birth_len", c_uint),
+                ("snap_root", c_uint),
+                ("refs_start", c_uint),
+                ("refs_len", c_uint),
+                ("orphans", c_uint),
+                ("_pad", c_char * 4032)]
+
+MAX_ORPHANS = 511
+
+class orphan(Structure):
+    _fields_ = [("inum", c_uint),
+                ("next", c_uint)]
+
+class orphans(Structure):
+    _fields_ = [("count", c_uint),
+                ("_pad", c_uint),
+                ("list", orphan * MAX_ORPHANS)]
+
+class owner(Structure):
+    _fields_ = [("inum", c_uint),
+                ("index", c_int)]
+
+class snapshot(Structure):
+    _fields_ = [("epoch", c_uint),
+                ("ctime", c_uint),
+                ("imap", c_uint * MAX_IMAP_BLOCKS)]
+
+class snap_root(Structure):
+    _fields_ = [("epoch", c_uint),
+                ("imap", c_uint * MAX_IMAP_BLOCKS),
+                ("snaps", snapshot * MAX_SNAPSHOTS),
+                ("_pad", c_char * (4096 - 4 * (1 + MAX_IMAP_BLOCKS) -
+                                   MAX_SNAPSHOTS * 136))]
 
 class inode(Structure):
     _fields_ = [("uid", c_ushort),
@@ -45,3 +97,29 @@ def S_ISREG(mode):
 
 def S_ISDIR(mode):
     return (mode & S_IFMT) == S_IFDIR
+
+TRACE_MAGIC = 0x45435254
+TRACE_OP = 1
+TRACE_IO = 2
+TRACE_NOOP = 255
+TRACE_KINDS = ['meta_rd', 'meta_wr', 'data_rd', 'data_wr']
+
+class trace_hdr(Structure):
+    _fields_ = [("magic", c_uint),
+                ("rec_size", c_uint),
+                ("nrecs", c_uint),
+                ("nops", c_uint),
+                ("ops", (c_char * 12) * 32)]
+
+class trace_rec(Structure):
+    _fields_ = [("time", c_ulonglong),
+                ("offset", c_ulonglong),
+                ("latency", c_uint),
+                ("len", c_uint),
+                ("inum", c_uint),
+                ("result", c_int),
+                ("thread", c_uint),
+                ("type", c_ubyte),
+                ("op", c_ubyte),
+                ("kind", c_ubyte),
+                ("_pad", c_ubyte)]
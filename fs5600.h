@@ -24,14 +24,74 @@ struct fs_dirent {
     char name[28];              /* with trailing NUL */
 };
 
+/* Optional features, recorded in the superblock when the image is
+ * created. Images without a flag set behave exactly as before.
+ */
+#define FS_FEAT_JOURNAL 0x1     /* metadata redo journal */
+#define FS_FEAT_LOG     0x2     /* log-structured: all writes appended */
+#define FS_FEAT_COW     0x4     /* copy-on-write, with snapshots */
+
 /* Superblock - holds file system parameters. 
  */
 struct fs_super {
     uint32_t magic;
     uint32_t disk_size;         /* in blocks */
+    uint32_t features;          /* FS_FEAT_* */
+    uint32_t journal_start;     /* first block of the journal region */
+    uint32_t journal_len;       /* in blocks, 0 if no journal */
+    uint32_t imap_start;        /* FS_FEAT_LOG: inode map, */
+    uint32_t imap_len;          /*   one uint32_t per inode number */
+    uint32_t owner_start;       /* FS_FEAT_LOG: block owners, */
+    uint32_t owner_len;         /*   one struct fs_owner per block */
+    uint32_t seg_size;          /* FS_FEAT_LOG: blocks per segment */
+    uint32_t birth_start;       /* FS_FEAT_COW: epoch each block was */
+    uint32_t birth_len;         /*   allocated in, one uint32_t per block */
+    uint32_t snap_root;         /* FS_FEAT_COW: struct fs_snap_root */
+    uint32_t refs_start;        /* FS_FEAT_COW: number of extra files */
+    uint32_t refs_len;          /*   sharing each block (clones) */
+    uint32_t orphans;           /* FS_FEAT_JOURNAL: struct fs_orphans */
     
     /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 2 * sizeof(uint32_t)]; 
+    char pad[FS_BLOCK_SIZE - 16 * sizeof(uint32_t)]; 
+};
+
+/* Orphan list - files that have been removed (or truncated) whose
+ * blocks are still being freed in the background. Blocks 'next' and
+ * up of each inode are already free; the rest, and then the inode
+ * itself, are freed at mount if a crash interrupts the job.
+ */
+struct fs_orphan {
+    uint32_t inum;
+    uint32_t next;
+};
+
+#define FS_MAX_ORPHANS (FS_BLOCK_SIZE/8 - 1)
+
+struct fs_orphans {
+    uint32_t count;
+    uint32_t pad;
+    struct fs_orphan list[FS_MAX_ORPHANS];
+};
+
+/* Journal header - first block of the journal region. A committed
+ * transaction is the header followed by 'nblocks' logged blocks,
+ * written in one sequential write; 'crc' covers the logged blocks so
+ * a torn write is detected and ignored at replay.
+ */
+#define FS_JOURNAL_MAGIC 0x4c4e524a
+
+/* blocks the journal holds besides the header, at least: enough for
+ * any one operation's directory, inode and bitmap blocks, plus the
+ * whole of the imap, owner, birth and refs tables
+ */
+#define FS_JOURNAL_OP_BLOCKS 12
+
+struct fs_journal_hdr {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t nblocks;           /* 0 = journal is clean */
+    uint32_t crc;               /* of this block with crc 0, then the data */
+    uint32_t blocks[FS_BLOCK_SIZE/4 - 4]; /* home location of each block */
 };
 
 struct fs_inode {
@@ -44,4 +104,148 @@ struct fs_inode {
     uint32_t ptrs[FS_BLOCK_SIZE/4 - 5]; /* inode = 4096 bytes */
 };
 
+/* block pointer flag: the block was reserved by fallocate but never
+ * written, so it reads as zeros.
+ */
+#define FS_PTR_UNWRITTEN 0x80000000
+
+/* Log-structured images: which file block each disk block holds, so
+ * the segment cleaner can find the pointer to update when it moves a
+ * block. index -1 is the inode itself; inum 0 means the block can't be
+ * moved (superblock, bitmap, tables, journal).
+ */
+struct fs_owner {
+    uint32_t inum;
+    int32_t  index;
+};
+
+/* Copy-on-write images: the superblock is never rewritten, so the
+ * inode map is found through the snapshot root block instead. It
+ * lists the blocks of the live inode map and, for each snapshot, of
+ * the inode map as it was when the snapshot was taken. Blocks
+ * allocated in an epoch no later than the newest snapshot's may be
+ * shared with a snapshot, and are never modified or freed.
+ */
+#define FS_MAX_IMAP_BLOCKS 32   /* enough for 32768 blocks, all one bitmap covers */
+#define FS_MAX_SNAPSHOTS   16
+
+struct fs_snapshot {
+    uint32_t epoch;             /* 0 = unused slot */
+    uint32_t ctime;
+    uint32_t imap[FS_MAX_IMAP_BLOCKS];
+};
+
+struct fs_snap_root {
+    uint32_t epoch;             /* current epoch, starts at 1 */
+    uint32_t imap[FS_MAX_IMAP_BLOCKS];
+    struct fs_snapshot snaps[FS_MAX_SNAPSHOTS];
+    char pad[FS_BLOCK_SIZE - (1 + FS_MAX_IMAP_BLOCKS) * sizeof(uint32_t) -
+             FS_MAX_SNAPSHOTS * sizeof(struct fs_snapshot)];
+};
+
+/* ioctl on any file in an FS_FEAT_COW file system (needs
+ * <sys/ioctl.h>): snapshot the whole file system, and return the
+ * snapshot number, which 'hw3fuse -snapshot N' mounts.
+ */
+#define FS_IOC_SNAPSHOT _IOR('T', 1, uint32_t)
+
+/* ioctl on any file in an FS_FEAT_COW file system: delete the
+ * snapshot numbered in the argument, freeing the blocks no other
+ * snapshot (or the live file system) uses.
+ */
+#define FS_IOC_SNAPDEL _IOW('T', 3, uint32_t)
+
+/* ioctl on a regular file in an FS_FEAT_COW file system: replace its
+ * contents with those of the file at 'src' (a path from the root of
+ * the file system), sharing its blocks copy-on-write. This is FICLONE,
+ * which FUSE doesn't pass on, with the source named by path since a
+ * file descriptor means nothing on this side of FUSE.
+ */
+struct fs_clone_args {
+    char src[1024];
+};
+#define FS_IOC_CLONE _IOW('T', 2, struct fs_clone_args)
+
+/* memory held by a mounted file system, from fs_mem_stats() (not on
+ * disk)
+ */
+struct fs_mem_stats {
+    uint64_t slab_bytes;        /* slab chunks (cache entries etc.) */
+    uint64_t slab_objects;      /* slab objects in use */
+    uint64_t scratch_bytes;     /* per-operation scratch, all threads */
+    uint64_t scratch_peak;      /* high-water mark of scratch_bytes */
+    uint64_t budget;            /* fs_set_mem_budget(), 0 = no limit */
+    uint64_t total;             /* everything charged against it */
+    uint64_t reclaimed;         /* bytes given back to stay within it */
+};
+
+/* block I/O done by one kind of operation, from fs_io_profile() (not
+ * on disk). Histograms count calls by blocks of I/O they did: 0, 1, 2,
+ * 3-4, 5-8, ... 129-256, more.
+ */
+#define FS_IO_BUCKETS 11
+
+struct fs_io_profile {
+    uint64_t calls;
+    uint64_t meta_reads, meta_writes;   /* blocks */
+    uint64_t data_reads, data_writes;
+    uint64_t meta_hist[FS_IO_BUCKETS];
+    uint64_t data_hist[FS_IO_BUCKETS];
+};
+
+/* Trace files, written by fs_trace_dump() (not on disk): a header,
+ * then records in time order. A record is either one fs_ops call,
+ * logged when it returns, or one block read or write.
+ */
+#define FS_TRACE_MAGIC 0x45435254       /* "TRCE" */
+#define FS_TRACE_OP 1
+#define FS_TRACE_IO 2
+#define FS_TRACE_NOOP 255               /* I/O outside any call */
+
+struct fs_trace_hdr {
+    uint32_t magic;
+    uint32_t rec_size;          /* sizeof(struct fs_trace_rec) */
+    uint32_t nrecs;
+    uint32_t nops;
+    char     ops[32][12];       /* names of fs_trace_rec.op values */
+};
+
+struct fs_trace_rec {
+    uint64_t time;              /* start, ns (CLOCK_MONOTONIC) */
+    uint64_t offset;            /* call: file offset; I/O: block number */
+    uint32_t latency;           /* ns, at most 0xffffffff */
+    uint32_t len;               /* call: bytes; I/O: blocks */
+    uint32_t inum;              /* call: inode of its path, 0 if none */
+    int32_t  result;
+    uint32_t thread;            /* small number per thread */
+    uint8_t  type;              /* FS_TRACE_OP or FS_TRACE_IO */
+    uint8_t  op;                /* the call, or the one doing the I/O */
+    uint8_t  kind;              /* I/O: 0 metadata read, 1 metadata write,
+                                 * 2 data read, 3 data write */
+    uint8_t  pad;
+};
+
+/* A recording of fs_ops calls (fs_record(), hw3fuse -record) is a
+ * struct fs_trace_hdr with magic FS_RECORD_MAGIC and nrecs 0, then a
+ * struct fs_record per call to the end of the file, each followed by
+ * its path names (not nul-terminated). replay.c plays it back.
+ */
+#define FS_RECORD_MAGIC 0x44434552      /* "RECD" */
+
+struct fs_record {
+    uint64_t time;              /* start, ns after recording began */
+    uint64_t offset;            /* read, write, fallocate: offset;
+                                 * truncate: length; utime: mtime */
+    uint32_t len;               /* read, write, fallocate: bytes */
+    uint32_t mode;              /* create, mkdir, chmod: mode;
+                                 * fallocate: flags; ioctl: cmd */
+    uint32_t latency;           /* ns */
+    int32_t  result;
+    uint16_t thread;
+    uint8_t  op;                /* index into fs_trace_hdr.ops */
+    uint8_t  pad;
+    uint16_t path_len;
+    uint16_t path2_len;         /* rename: destination; clone: source */
+};
+
 #endif
@@ -0,0 +1,261 @@
+/*
+ * file:        fsbench.c
+ * description: microbenchmarks for the fs_ops calls, made directly on
+ *              a freshly generated image as the unit tests do
+ *
+ *  usage: ./fsbench [-n N] [-- gen-disk options]
+ *      -n N  scale every benchmark's call count by N (default 1)
+ *
+ * e.g. './fsbench -- -j 16' benchmarks a journaled image. Prints one
+ * CSV line per benchmark: its name, calls made, calls per second, and
+ * the 50th, 90th and 99th percentile and maximum latency in
+ * microseconds.
+ */
+#define FUSE_USE_VERSION 27
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fuse.h>
+
+#include "fs5600.h"
+
+extern struct fuse_operations fs_ops;
+extern void block_init(char *file);
+extern void fs_set_image(const char *file);
+
+struct fuse_context ctx = { .uid = 500, .gid = 500 };
+struct fuse_context *fuse_get_context(void)
+{
+    return &ctx;
+}
+
+#define FILE_SIZE (512 * 1024)  /* for the read and write benchmarks */
+#define DIR_FULL  128           /* entries in a directory block */
+
+static int scale = 1;
+static char buf[FILE_SIZE];
+
+/* the latencies of one benchmark's calls */
+struct run {
+    uint64_t *lat;
+    int n, max;
+    uint64_t ns;                /* total */
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* every call a benchmark makes has to work */
+static void check(int ret, int want, const char *what)
+{
+    if (ret != want) {
+        fprintf(stderr, "fsbench: %s: %d (%s)\n", what, ret,
+                ret < 0 ? strerror(-ret) : "short");
+        exit(1);
+    }
+}
+
+static void add_lat(struct run *r, uint64_t ns)
+{
+    if (r->n == r->max) {
+        r->max = r->max ? r->max * 2 : 65536;
+        r->lat = realloc(r->lat, r->max * sizeof(*r->lat));
+    }
+    r->lat[r->n++] = ns;
+    r->ns += ns;
+}
+
+/* make a call, timing it as part of run 'r' */
+#define TIMED(r, want, call) do {                               \
+        uint64_t t0_ = now_ns();                                \
+        int ret_ = (call);                                      \
+        add_lat(r, now_ns() - t0_);                             \
+        check(ret_, want, #call);                               \
+    } while (0)
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* print run 'r' and empty it */
+static void report(struct run *r, const char *fmt, ...)
+{
+    char name[64];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(name, sizeof(name), fmt, args);
+    va_end(args);
+    qsort(r->lat, r->n, sizeof(*r->lat), cmp_u64);
+    printf("%s,%d,%.0f,%.2f,%.2f,%.2f,%.2f\n", name, r->n, r->n / (r->ns / 1e9),
+           r->lat[r->n / 2] / 1000.0, r->lat[(int)(r->n * 0.9)] / 1000.0,
+           r->lat[(int)(r->n * 0.99)] / 1000.0, r->lat[r->n - 1] / 1000.0);
+    fflush(stdout);
+    free(r->lat);
+    memset(r, 0, sizeof(*r));
+}
+
+/* stat a file 'depth' directories down */
+static void bench_getattr(int depth)
+{
+    struct run r = { 0 };
+    struct stat sb;
+    char path[1024] = "";
+    for (int i = 0; i < depth; i++) {
+        strcat(path, "/d");
+        check(fs_ops.mkdir(path, 0755), 0, "mkdir");
+    }
+    strcat(path, "/f");
+    check(fs_ops.create(path, 0100644, NULL), 0, "create");
+    for (int i = 0; i < 20000 * scale; i++)
+        TIMED(&r, 0, fs_ops.getattr(path, &sb));
+    report(&r, "getattr_depth%d", depth);
+
+    check(fs_ops.unlink(path), 0, "unlink");
+    for (int i = depth; i > 0; i--) {
+        path[2 * i] = '\0';
+        check(fs_ops.rmdir(path), 0, "rmdir");
+    }
+}
+
+static int count_filler(void *ptr, const char *name, const struct stat *sb, off_t off)
+{
+    (*(int *)ptr)++;
+    return 0;
+}
+
+/* list a full directory */
+static void bench_readdir(void)
+{
+    struct run r = { 0 };
+    char path[64];
+    check(fs_ops.mkdir("/full", 0755), 0, "mkdir");
+    for (int i = 0; i < DIR_FULL; i++) {
+        sprintf(path, "/full/file-%d", i);
+        check(fs_ops.create(path, 0100644, NULL), 0, "create");
+    }
+    for (int i = 0; i < 2000 * scale; i++) {
+        int n = 0;
+        TIMED(&r, 0, fs_ops.readdir("/full", &n, count_filler, 0, NULL));
+        check(n, DIR_FULL, "readdir count");
+    }
+    report(&r, "readdir_full");
+    for (int i = 0; i < DIR_FULL; i++) {
+        sprintf(path, "/full/file-%d", i);
+        check(fs_ops.unlink(path), 0, "unlink");
+    }
+    check(fs_ops.rmdir("/full"), 0, "rmdir");
+}
+
+/* fill a directory with empty files and empty it again, over and over */
+static void bench_create_unlink(void)
+{
+    struct run cr = { 0 }, un = { 0 };
+    char path[64];
+    check(fs_ops.mkdir("/storm", 0755), 0, "mkdir");
+    for (int round = 0; round < 20 * scale; round++) {
+        for (int i = 0; i < 100; i++) {
+            sprintf(path, "/storm/f%d", i);
+            TIMED(&cr, 0, fs_ops.create(path, 0100644, NULL));
+        }
+        for (int i = 0; i < 100; i++) {
+            sprintf(path, "/storm/f%d", i);
+            TIMED(&un, 0, fs_ops.unlink(path));
+        }
+    }
+    report(&cr, "create");
+    report(&un, "unlink");
+    check(fs_ops.rmdir("/storm"), 0, "rmdir");
+}
+
+/* write and read FILE_SIZE bytes of a file in 'size' pieces, in order
+ * and at random, each 16MB in all
+ */
+static void bench_rw(int size)
+{
+    struct run r = { 0 };
+    int n = FILE_SIZE / size, rounds = 16 * 1024 * 1024 / FILE_SIZE * scale;
+    check(fs_ops.create("/rw", 0100644, NULL), 0, "create");
+    check(fs_ops.write("/rw", buf, FILE_SIZE, 0, NULL), FILE_SIZE, "write");
+    check(fs_ops.fsync("/rw", 0, NULL), 0, "fsync");
+
+    for (int random = 0; random < 2; random++) {
+        const char *how = random ? "rand" : "seq";
+        for (int k = 0; k < rounds * n; k++) {
+            off_t off = (off_t)(random ? rand() % n : k % n) * size;
+            TIMED(&r, size, fs_ops.write("/rw", buf, size, off, NULL));
+        }
+        TIMED(&r, 0, fs_ops.fsync("/rw", 0, NULL));  /* to count the block writes */
+        report(&r, "%s_write_%dk", how, size / 1024);
+
+        for (int k = 0; k < rounds * n; k++) {
+            off_t off = (off_t)(random ? rand() % n : k % n) * size;
+            TIMED(&r, size, fs_ops.read("/rw", buf, size, off, NULL));
+        }
+        report(&r, "%s_read_%dk", how, size / 1024);
+    }
+    check(fs_ops.unlink("/rw"), 0, "unlink");
+}
+
+static void bench_statfs(void)
+{
+    struct run r = { 0 };
+    struct statvfs sv;
+    for (int i = 0; i < 20000 * scale; i++)
+        TIMED(&r, 0, fs_ops.statfs("/", &sv));
+    report(&r, "statfs");
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            scale = atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-n N] [-- gen-disk options]\n", argv[0]);
+            exit(1);
+        }
+    }
+    char cmd[1024] = "python gen-disk.py -q";
+    for (int i = optind; i < argc; i++)
+        snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), " %s", argv[i]);
+    strncat(cmd, " disk2.in bench.img", sizeof(cmd) - strlen(cmd) - 1);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "fsbench: %s failed\n", cmd);
+        exit(1);
+    }
+    block_init("bench.img");
+    fs_set_image("bench.img");
+    fs_ops.init(NULL);
+    srand(5600);
+    for (int i = 0; i < FILE_SIZE; i++)
+        buf[i] = 'A' + i % 26;
+
+    printf("bench,calls,calls_per_sec,p50_us,p90_us,p99_us,max_us\n");
+    bench_getattr(1);
+    bench_getattr(4);
+    bench_getattr(16);
+    bench_readdir();
+    bench_create_unlink();
+    bench_rw(4096);
+    bench_rw(65536);
+    bench_rw(262144);
+    bench_statfs();
+    fs_ops.destroy(NULL);
+    unlink("bench.img");
+    return 0;
+}
@@ -0,0 +1,367 @@
+/*
+ * file:        fsload.c
+ * description: multi-threaded workloads, made of fs_ops calls on a
+ *              freshly generated image as the unit tests do, to see
+ *              how throughput and tail latency change with the number
+ *              of threads
+ *
+ *  usage: ./fsload [-p personality] [-t 1,2,4,8] [-s secs] [-f files]
+ *                  [-z theta] [-- gen-disk options]
+ *      -p  fileserver (default), varmail, webserver or logappend
+ *      -t  thread counts to run with, each on a new image
+ *      -s  seconds per run (default 2)
+ *      -f  files in the shared file set (default 256)
+ *      -z  Zipf exponent for picking files from it (default 0.9; 0
+ *          picks them uniformly)
+ *
+ * The personalities, loosely after filebench's:
+ *   fileserver  create and write a new file, append to a file, read a
+ *               whole file, stat one, delete the new file
+ *   varmail     create, append to and fsync a new message; read a
+ *               message, append to and fsync it; read one; delete the
+ *               oldest new one
+ *   webserver   read ten whole files, append to a shared log
+ *   logappend   append small records to a file, fsync every 16th
+ *
+ * Prints a CSV line per thread count: calls made, errors, calls per
+ * second, and the 50th, 99th and 99.9th percentile and maximum latency
+ * of a call in microseconds.
+ */
+#define FUSE_USE_VERSION 27
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse.h>
+
+#include "fs5600.h"
+
+extern struct fuse_operations fs_ops;
+extern void block_init(char *file);
+extern void fs_set_image(const char *file);
+
+struct fuse_context ctx = { .uid = 500, .gid = 500 };
+struct fuse_context *fuse_get_context(void)
+{
+    return &ctx;
+}
+
+#define IMAGE_BLOCKS 16384      /* 64MB */
+#define DIRS         16         /* the file set is spread over these */
+#define MAX_SIZE     (64 * 1024) /* files appended past this are cut back */
+#define IO_MAX       (64 * 1024)
+
+enum { FILESERVER, VARMAIL, WEBSERVER, LOGAPPEND, NPERSONALITIES };
+static const char *personalities[NPERSONALITIES] = {
+    "fileserver", "varmail", "webserver", "logappend" };
+
+static int personality, nfiles = 256, seconds = 2;
+static double theta = 0.9;
+static double *zipf_cdf;        /* P(file <= i) */
+static char wbuf[IO_MAX];
+static volatile int stop;
+
+/* one worker's state and results */
+struct worker {
+    pthread_t tid;
+    int id;
+    uint64_t rng;
+    uint64_t *lat;
+    int n, max, errors;
+    int seq, oldest;            /* its own new files, for deletes */
+    char *rbuf;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t rnd(struct worker *w)
+{
+    w->rng ^= w->rng << 13;     /* xorshift64 */
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+/* pick a file from the set, the popular ones most often */
+static int zipf(struct worker *w)
+{
+    double u = (rnd(w) >> 11) * (1.0 / (1ULL << 53));
+    int lo = 0, hi = nfiles - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void zipf_init(void)
+{
+    double sum = 0;
+    zipf_cdf = malloc(nfiles * sizeof(*zipf_cdf));
+    for (int i = 0; i < nfiles; i++)
+        zipf_cdf[i] = sum += 1 / pow(i + 1, theta);
+    for (int i = 0; i < nfiles; i++)
+        zipf_cdf[i] /= sum;
+}
+
+static void file_path(char *path, int i)
+{
+    sprintf(path, "/d%d/f%d", i % DIRS, i);
+}
+
+/* make a call, timing it and counting it if it fails */
+#define TIMED(w, call) ({                                       \
+        uint64_t t0_ = now_ns();                                \
+        int ret_ = (call);                                      \
+        add_lat(w, now_ns() - t0_, ret_);                       \
+        ret_;                                                   \
+    })
+
+static void add_lat(struct worker *w, uint64_t ns, int ret)
+{
+    if (w->n == w->max) {
+        w->max = w->max ? w->max * 2 : 65536;
+        w->lat = realloc(w->lat, w->max * sizeof(*w->lat));
+    }
+    w->lat[w->n++] = ns;
+    w->errors += ret < 0;
+}
+
+static int file_size(struct worker *w, const char *path)
+{
+    struct stat sb;
+    int ret = TIMED(w, fs_ops.getattr(path, &sb));
+    return ret < 0 ? ret : sb.st_size;
+}
+
+/* read a whole file, IO_MAX at a time */
+static void read_file(struct worker *w, const char *path)
+{
+    int size = file_size(w, path);
+    for (int off = 0; off < size; off += IO_MAX)
+        TIMED(w, fs_ops.read(path, w->rbuf, IO_MAX, off, NULL));
+}
+
+/* add 'len' bytes to the end of a file, cutting it back first if it
+ * has got too big
+ */
+static void append(struct worker *w, const char *path, int len)
+{
+    int size = file_size(w, path);
+    if (size < 0)
+        return;
+    if (size + len > MAX_SIZE) {
+        TIMED(w, fs_ops.truncate(path, MAX_SIZE / 4));
+        size = MAX_SIZE / 4;
+    }
+    TIMED(w, fs_ops.write(path, wbuf, len, size, NULL));
+}
+
+/* a 4K-32K size, as file sets tend to have */
+static int new_size(struct worker *w)
+{
+    return 4096 * (1 + rnd(w) % 8);
+}
+
+static void make_file(struct worker *w, const char *path, int size)
+{
+    if (TIMED(w, fs_ops.create(path, 0100644, NULL)) == 0)
+        TIMED(w, fs_ops.write(path, wbuf, size, 0, NULL));
+}
+
+/* one pass of the personality's flow */
+static void flow(struct worker *w)
+{
+    char path[64], mine[64];
+    file_path(path, zipf(w));
+    sprintf(mine, "/w%d/n%d", w->id, w->seq);
+
+    switch (personality) {
+    case FILESERVER:
+        make_file(w, mine, new_size(w));
+        append(w, path, 4096);
+        file_path(path, zipf(w));
+        read_file(w, path);
+        file_path(path, zipf(w));
+        file_size(w, path);
+        TIMED(w, fs_ops.unlink(mine));
+        break;
+    case VARMAIL:
+        if (w->seq - w->oldest >= 16) {
+            sprintf(mine, "/w%d/n%d", w->id, w->oldest++);
+            TIMED(w, fs_ops.unlink(mine));
+            sprintf(mine, "/w%d/n%d", w->id, w->seq);
+        }
+        make_file(w, mine, new_size(w) / 2);
+        TIMED(w, fs_ops.fsync(mine, 0, NULL));
+        w->seq++;
+        read_file(w, path);
+        append(w, path, 2048);
+        TIMED(w, fs_ops.fsync(path, 0, NULL));
+        file_path(path, zipf(w));
+        read_file(w, path);
+        break;
+    case WEBSERVER:
+        for (int i = 0; i < 10; i++) {
+            file_path(path, zipf(w));
+            read_file(w, path);
+        }
+        append(w, "/log", 512);
+        break;
+    case LOGAPPEND:
+        append(w, path, 128 + rnd(w) % 3968);
+        if (++w->seq % 16 == 0)
+            TIMED(w, fs_ops.fsync(path, 0, NULL));
+        break;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    char path[64];
+    sprintf(path, "/w%d", w->id);
+    fs_ops.mkdir(path, 0755);
+    while (!stop)
+        flow(w);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* a new image with the file set on it */
+static void setup(char *gen_args)
+{
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "python gen-disk.py -q -b %d %s disk2.in load.img",
+             IMAGE_BLOCKS, gen_args);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "fsload: %s failed\n", cmd);
+        exit(1);
+    }
+    block_init("load.img");
+    fs_set_image("load.img");
+    fs_ops.init(NULL);
+
+    struct worker w = { .rng = 5600, .rbuf = malloc(IO_MAX) };
+    char path[64];
+    for (int i = 0; i < DIRS; i++) {
+        sprintf(path, "/d%d", i);
+        fs_ops.mkdir(path, 0755);
+    }
+    for (int i = 0; i < nfiles; i++) {
+        file_path(path, i);
+        make_file(&w, path, new_size(&w));
+    }
+    make_file(&w, "/log", 0);
+    if (w.errors > 0) {
+        fprintf(stderr, "fsload: %d errors creating the file set\n", w.errors);
+        exit(1);
+    }
+    free(w.lat);
+    free(w.rbuf);
+}
+
+static void run(int nthreads, char *gen_args)
+{
+    setup(gen_args);
+    struct worker *w = calloc(nthreads, sizeof(*w));
+    stop = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+        w[i].id = i;
+        w[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        w[i].rbuf = malloc(IO_MAX);
+        pthread_create(&w[i].tid, NULL, worker_main, &w[i]);
+    }
+    sleep(seconds);
+    stop = 1;
+    int n = 0, errors = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(w[i].tid, NULL);
+        n += w[i].n;
+        errors += w[i].errors;
+    }
+    double secs = (now_ns() - start) / 1e9;
+    fs_ops.destroy(NULL);
+
+    uint64_t *lat = malloc(n * sizeof(*lat));
+    for (int i = 0, k = 0; i < nthreads; i++) {
+        memcpy(lat + k, w[i].lat, w[i].n * sizeof(*lat));
+        k += w[i].n;
+        free(w[i].lat);
+        free(w[i].rbuf);
+    }
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    printf("%s,%d,%d,%d,%.0f,%.2f,%.2f,%.2f,%.2f\n", personalities[personality],
+           nthreads, n, errors, n / secs, lat[n / 2] / 1000.0,
+           lat[(int)(n * 0.99)] / 1000.0, lat[(int)(n * 0.999)] / 1000.0,
+           lat[n - 1] / 1000.0);
+    fflush(stdout);
+    free(lat);
+    free(w);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-p personality] [-t 1,2,4,8] [-s secs] [-f files]"
+            " [-z theta] [-- gen-disk options]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char threads[256] = "1,2,4,8";
+    int opt;
+    while ((opt = getopt(argc, argv, "p:t:s:f:z:")) != -1) {
+        switch (opt) {
+        case 'p':
+            for (personality = 0; personality < NPERSONALITIES; personality++)
+                if (strcmp(optarg, personalities[personality]) == 0)
+                    break;
+            if (personality == NPERSONALITIES)
+                usage(argv[0]);
+            break;
+        case 't': snprintf(threads, sizeof(threads), "%s", optarg); break;
+        case 's': seconds = atoi(optarg); break;
+        case 'f': nfiles = atoi(optarg); break;
+        case 'z': theta = atof(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (nfiles < 1 || nfiles > DIRS * 127 || seconds < 1)
+        usage(argv[0]);
+    char gen_args[512] = "";
+    for (int i = optind; i < argc; i++)
+        snprintf(gen_args + strlen(gen_args), sizeof(gen_args) - strlen(gen_args),
+                 " %s", argv[i]);
+    zipf_init();
+    for (int i = 0; i < IO_MAX; i++)
+        wbuf[i] = 'A' + i % 26;
+
+    printf("personality,threads,calls,errors,calls_per_sec,p50_us,p99_us,p999_us,max_us\n");
+    for (char *t = strtok(threads, ","); t != NULL; t = strtok(NULL, ","))
+        if (atoi(t) > 0)
+            run(atoi(t), gen_args);
+    unlink("load.img");
+    return 0;
+}
@@ -1,17 +1,44 @@
 #!/usr/bin/python
 #
-# usage: gen-disk.py input output.img
+# usage: gen-disk.py [-q] [-b N] [-j N] [-l N | -s] input output.img
+#
+#   -q    quiet
+#   -b N  make the image N blocks (at least the input's 'size')
+#   -j N  reserve an N-block metadata journal (or as many as one
+#         operation may need, if that's more)
+#   -l N  log-structured image with N-block segments
+#   -s    copy-on-write image, with snapshots
 #
 # see comments in disk1.in for file format
 
 import sys
 import diskfmt as fs
 import random as rnd
+from ctypes import c_uint
 
 quiet = False
-if sys.argv[1] == '-q':
-    quiet = True
-    sys.argv.pop(1)
+journal_len = 0
+seg_size = 0
+cow = False
+min_blocks = 0
+while sys.argv[1][0] == '-':
+    opt = sys.argv.pop(1)
+    if opt == '-q':
+        quiet = True
+    elif opt == '-b':
+        min_blocks = int(sys.argv.pop(1))
+    elif opt == '-j':
+        journal_len = int(sys.argv.pop(1))
+    elif opt == '-l':
+        seg_size = int(sys.argv.pop(1))
+    elif opt == '-s':
+        cow = True
+    else:
+        print('unknown option', opt)
+        sys.exit(1)
+if seg_size > 0 and cow:
+    print('-l and -s are exclusive')
+    sys.exit(1)
 
 chars = 'abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ'
 
@@ -110,11 +137,16 @@ for line in open(sys.argv[1],'r'):
     if fields[0] == 'dir':
         dirs.append(dir(fields[1:]))
 
+nblocks = max(nblocks, min_blocks)
+if nblocks > 4096 * 8:
+    print('ERROR: at most', 4096 * 8, 'blocks')
+    sys.exit(1)
+
 blockmap = fs.bitmap()
 blockmap.set(0,True)                      # superblock
 blockmap.set(1,True)                      # bitmap
 
-blocks = [None] * 400
+blocks = [None] * nblocks
 
 for f in files + dirs:
     blocks[f.inum] = [f]
@@ -127,15 +159,89 @@ for f in files + dirs:
         blocks[b] = [f,i]
         i += 1
 
+# reserve a contiguous run of free blocks, as high up the disk as
+# possible so it stays out of the way of the allocator
+def reserve(n):
+    run = 0
+    for i in range(nblocks-1, 1, -1):
+        run = 0 if blockmap.get(i) else run + 1
+        if run == n:
+            for b in range(i, i+n):
+                blockmap.set(b, True)
+            return i
+    print('ERROR: no room for', n, 'reserved blocks')
+    sys.exit(1)
+
+# every operation has to fit in the journal in one transaction, and
+# the biggest can touch all of the tables
+if journal_len > 0:
+    tables_len = 0
+    if seg_size > 0 or cow:
+        tables_len += (nblocks * 4 + 4095) // 4096         # imap
+    if seg_size > 0:
+        tables_len += (nblocks * 8 + 4095) // 4096         # owners
+    if cow:
+        tables_len += 2 * ((nblocks * 4 + 4095) // 4096)   # births, refs
+    need = 1 + fs.JOURNAL_OP_BLOCKS + tables_len
+    if journal_len < need:
+        if not quiet:
+            print('journal needs', need, 'blocks')
+        journal_len = need
+
 sb = fs.super()
 sb.magic, sb.disk_sz = magic, nblocks
+if journal_len > 0:
+    sb.features |= fs.FEAT_JOURNAL
+    sb.journal_start, sb.journal_len = reserve(journal_len), journal_len
+    sb.orphans = reserve(1)               # empty orphan list
+
+# log-structured and copy-on-write images: the inode map starts out
+# as the identity (inode numbers in disk.in are block numbers). Log
+# images record every file block in the owner table; on COW images
+# every block starts out in epoch 0 and unshared, and the snapshot
+# root lists the inode map blocks.
+tables = dict()
+if seg_size > 0 or cow:
+    sb.imap_len = (nblocks * 4 + 4095) // 4096
+    sb.imap_start = reserve(sb.imap_len)
+    imap = (c_uint * (sb.imap_len * 1024))()
+    for f in files + dirs:
+        imap[f.inum] = f.inum
+    for i in range(sb.imap_len):
+        tables[sb.imap_start + i] = bytearray(imap)[i*4096:(i+1)*4096]
+if seg_size > 0:
+    sb.features |= fs.FEAT_LOG
+    sb.seg_size = seg_size
+    sb.owner_len = (nblocks * 8 + 4095) // 4096
+    sb.owner_start = reserve(sb.owner_len)
+    owners = (fs.owner * (sb.owner_len * 512))()
+    for f in files + dirs:
+        owners[f.inum].inum, owners[f.inum].index = f.inum, -1
+        for i, b in enumerate(f.blocks):
+            owners[b].inum, owners[b].index = f.inum, i
+    for i in range(sb.owner_len):
+        tables[sb.owner_start + i] = bytearray(owners)[i*4096:(i+1)*4096]
+if cow:
+    sb.features |= fs.FEAT_COW
+    sb.birth_len = (nblocks * 4 + 4095) // 4096
+    sb.birth_start = reserve(sb.birth_len)
+    sb.refs_len = (nblocks * 4 + 4095) // 4096
+    sb.refs_start = reserve(sb.refs_len)
+    sb.snap_root = reserve(1)
+    root = fs.snap_root()
+    root.epoch = 1
+    for i in range(sb.imap_len):
+        root.imap[i] = sb.imap_start + i
+    tables[sb.snap_root] = bytearray(root)
 zeros = bytearray(4096)
 
 fp = open(sys.argv[2], 'wb')
 fp.write(bytearray(sb))
 fp.write(bytearray(blockmap))
 for i in range(2,nblocks):
-    if not blocks[i]:
+    if i in tables:
+        fp.write(tables[i])
+    elif not blocks[i]:
         fp.write(zeros)
     elif len(blocks[i]) == 1:
         filedir = blocks[i][0]
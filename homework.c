@@ -7,64 +7,2853 @@
 
  #define FUSE_USE_VERSION 27
  #define _FILE_OFFSET_BITS 64
- #define MAX_PATH_COMPONENTS 10
  #define MAX_NAME_LEN 27
  
  #include <stdlib.h>
+ #include <limits.h>
  #include <stddef.h>
  #include <unistd.h>
  #include <fuse.h>
  #include <fcntl.h>
  #include <string.h>
  #include <stdio.h>
+ #include <stdarg.h>
  #include <errno.h>
  #include <assert.h>
  #include <time.h>
- #include <libgen.h>
  #include <sys/stat.h>
  #include <sys/statvfs.h>
+ #include <sys/ioctl.h>
+ #include <linux/falloc.h>
  #include <utime.h>
+ #include <pthread.h>
+ #include <zlib.h>
  
  #include "fs5600.h"
+ 
+ #define MAX_FILE_BLOCKS (FS_BLOCK_SIZE/4 - 5)   /* entries in fs_inode.ptrs */
 
  extern int block_read(void *buf, int lba, int nblks);
  extern int block_write(void *buf, int lba, int nblks);
  
- static char superblock[FS_BLOCK_SIZE];
- static unsigned char bitmap[FS_BLOCK_SIZE];  
+ /* Runtime statistics: calls, errors and latency of each fs_ops entry,
+  * block I/O and cache hits, served as /.terrafs/stats. Each thread
+  * counts into its own 'struct counters', linked into 'all_counters'
+  * the first time it counts, so counting takes no lock and shares no
+  * cache lines; reading the stats adds them all up. When a thread
+  * exits, its counts are added to 'retired' and its counters freed.
+  */
+ enum { OP_GETATTR, OP_READDIR, OP_CREATE, OP_MKDIR, OP_UNLINK, OP_RMDIR,
+        OP_RENAME, OP_CHMOD, OP_UTIME, OP_TRUNCATE, OP_READ, OP_WRITE,
+        OP_STATFS, OP_FSYNC, OP_FALLOCATE, OP_IOCTL, OP_COUNT };
+ static const char *op_names[OP_COUNT] = {
+     "getattr", "readdir", "create", "mkdir", "unlink", "rmdir",
+     "rename", "chmod", "utime", "truncate", "read", "write",
+     "statfs", "fsync", "fallocate", "ioctl" };
+ 
+ /* latency buckets: < 1us, < 4us, < 16us ... < 1s (x4 each), >= 1s */
+ #define LAT_BUCKETS 12
+ 
+ /* I/O amplification: blocks read and written by each kind of call,
+  * metadata and file data counted apart. Blocks are charged to the
+  * fs_ops call running on the thread that does the I/O (so a journal
+  * commit goes to the call that ran it); I/O from the background
+  * thread is charged to none. Each call's total is also put in a
+  * histogram: 0, 1, 2, 3-4, 5-8 ... 129-256, more blocks.
+  */
+ enum { IO_META_READ, IO_META_WRITE, IO_DATA_READ, IO_DATA_WRITE, IO_KINDS };
+ #define IO_BUCKETS FS_IO_BUCKETS
+ 
+ struct counters {
+     uint64_t calls[OP_COUNT], errors[OP_COUNT], ns[OP_COUNT];
+     uint64_t lat[OP_COUNT][LAT_BUCKETS];
+     uint64_t reads, read_blocks, writes, write_blocks;
+     uint64_t cache_hits, cache_misses;
+     uint64_t io[OP_COUNT + 1][IO_KINDS];           /* blocks; [OP_COUNT] = background */
+     uint64_t io_hist[OP_COUNT][2][IO_BUCKETS];     /* calls by meta, data blocks */
+     struct counters *next;
+ };
+ 
+ static __thread struct counters *my_counters;
+ static __thread int cur_op = -1;               /* fs_ops entry running, if any */
+ static __thread uint64_t cur_io[2];            /* its metadata, data blocks so far */
+ static __thread uint64_t op_off, op_len;       /* its arguments and inode, for */
+ static __thread uint32_t op_inum, op_mode;     /* tracing and recording */
+ static __thread const char *op_path, *op_path2;
+ 
+ static int trace_on;
+ static void trace_add(int type, int op, int kind, uint32_t inum, uint64_t offset,
+                       uint64_t len, uint64_t start, int result);
+ static FILE *record_fp;
+ static void record_add(int op, uint64_t start, int result);
+ static struct counters *all_counters;
+ static struct counters retired;
+ static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_key_t counters_key;
+ static pthread_once_t counters_once = PTHREAD_ONCE_INIT;
+ 
+ #define COUNTERS_N (offsetof(struct counters, next) / sizeof(uint64_t))
+ 
+ static void counters_add(struct counters *sum, struct counters *c)
+ {
+     uint64_t *dst = (uint64_t *)sum, *src = (uint64_t *)c;
+     for (int i = 0; i < COUNTERS_N; i++)
+         dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+ }
+ 
+ /* pthread key destructor: the thread is exiting */
+ static void counters_retire(void *arg)
+ {
+     struct counters *c = arg, **pp;
+     pthread_mutex_lock(&counters_lock);
+     counters_add(&retired, c);
+     for (pp = &all_counters; *pp != c; pp = &(*pp)->next)
+         ;
+     *pp = c->next;
+     pthread_mutex_unlock(&counters_lock);
+     free(c);
+     my_counters = NULL;
+ }
+ 
+ static void counters_key_create(void)
+ {
+     pthread_key_create(&counters_key, counters_retire);
+ }
+ 
+ static struct counters *counters(void)
+ {
+     if (my_counters == NULL) {
+         struct counters *c = calloc(1, sizeof(*c));
+         if (c == NULL)
+             abort();
+         pthread_once(&counters_once, counters_key_create);
+         pthread_mutex_lock(&counters_lock);
+         c->next = all_counters;
+         all_counters = c;
+         pthread_mutex_unlock(&counters_lock);
+         pthread_setspecific(counters_key, c);
+         my_counters = c;
+     }
+     return my_counters;
+ }
+ 
+ /* only the owning thread writes a counter, so no read-modify-write
+  * atomics are needed: just make the store and the readers' loads whole
+  */
+ static void count(uint64_t *c, uint64_t n)
+ {
+     __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+ }
+ 
+ static uint64_t now_ns(void)
+ {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+ }
+ 
+ /* a small number for the calling thread, in trace and recording files */
+ static int thread_id(void)
+ {
+     static int nthreads;
+     static __thread int my_id;
+     if (my_id == 0)
+         my_id = __atomic_add_fetch(&nthreads, 1, __ATOMIC_RELAXED);
+     return my_id;
+ }
+ 
+ static uint64_t op_begin(int op, const char *path)
+ {
+     cur_op = op;
+     cur_io[0] = cur_io[1] = 0;
+     op_off = op_len = op_inum = op_mode = 0;
+     op_path = path;
+     op_path2 = NULL;
+     return now_ns();
+ }
+ 
+ /* note the running call's arguments, for tracing and recording */
+ static void op_args(off_t offset, uint64_t len, uint32_t mode)
+ {
+     op_off = offset;
+     op_len = len;
+     op_mode = mode;
+ }
+ 
+ static int io_bucket(uint64_t n)
+ {
+     int b = 0;
+     for (uint64_t lim = 0; b < IO_BUCKETS - 1 && n > lim; lim = lim ? lim * 2 : 1)
+         b++;
+     return b;
+ }
+ 
+ /* charge 'nblks' blocks of I/O to the running call */
+ static void io_count(int kind, int nblks)
+ {
+     struct counters *c = counters();
+     count(&c->io[cur_op < 0 ? OP_COUNT : cur_op][kind], nblks);
+     cur_io[kind >= IO_DATA_READ] += nblks;
+ }
+ 
+ static int op_end(int op, uint64_t start, int ret)
+ {
+     struct counters *c = counters();
+     uint64_t ns = now_ns() - start;
+     int b = 0;
+     for (uint64_t lim = 1000; b < LAT_BUCKETS - 1 && ns >= lim; lim *= 4)
+         b++;
+     count(&c->calls[op], 1);
+     count(&c->errors[op], ret < 0);
+     count(&c->ns[op], ns);
+     count(&c->lat[op][b], 1);
+     count(&c->io_hist[op][0][io_bucket(cur_io[0])], 1);
+     count(&c->io_hist[op][1][io_bucket(cur_io[1])], 1);
+     if (trace_on)
+         trace_add(FS_TRACE_OP, op, 0, op_inum, op_off, op_len, start, ret);
+     if (__atomic_load_n(&record_fp, __ATOMIC_RELAXED) != NULL)
+         record_add(op, start, ret);
+     cur_op = -1;
+     return ret;
+ }
+ 
+ /* add up every thread's counters, and those of the threads gone */
+ static void counters_sum(struct counters *sum)
+ {
+     memset(sum, 0, sizeof(*sum));
+     pthread_mutex_lock(&counters_lock);
+     counters_add(sum, &retired);
+     for (struct counters *c = all_counters; c != NULL; c = c->next)
+         counters_add(sum, c);
+     pthread_mutex_unlock(&counters_lock);
+ }
+
+ /* block I/O done by fs_ops calls of kind 'op' ("mkdir", "write", ...,
+  * or "background" for I/O outside any call): for tests and tools
+  */
+ int fs_io_profile(const char *op, struct fs_io_profile *p)
+ {
+     int i = 0;
+     while (i < OP_COUNT && strcmp(op, op_names[i]) != 0)
+         i++;
+     if (i == OP_COUNT && strcmp(op, "background") != 0)
+         return -ENOENT;
+     struct counters c;
+     counters_sum(&c);
+     memset(p, 0, sizeof(*p));
+     p->meta_reads = c.io[i][IO_META_READ];
+     p->meta_writes = c.io[i][IO_META_WRITE];
+     p->data_reads = c.io[i][IO_DATA_READ];
+     p->data_writes = c.io[i][IO_DATA_WRITE];
+     if (i < OP_COUNT) {
+         p->calls = c.calls[i];
+         memcpy(p->meta_hist, c.io_hist[i][0], sizeof(p->meta_hist));
+         memcpy(p->data_hist, c.io_hist[i][1], sizeof(p->data_hist));
+     }
+     return 0;
+ }
+
+ /* Tracing: when on, every fs_ops call and block read or write is
+  * logged as a struct fs_trace_rec in a ring buffer per thread, which
+  * keeps the latest trace_size records. Only the owning thread writes a
+  * ring; it publishes each record by advancing 'head', and a reader
+  * copying the ring checks 'head' again afterwards and drops whatever
+  * might have been overwritten meanwhile. When off, the cost is one
+  * test of 'trace_on' per call and per I/O. A ring outlives its thread:
+  * it goes on 'free_rings', records and all, for the next new thread.
+  */
+ struct trace_ring {
+     uint64_t head;              /* records ever written */
+     uint32_t size, thread;
+     struct trace_ring *next;
+     struct trace_ring *next_free;
+     struct fs_trace_rec recs[];
+ };
+ 
+ static int trace_size = 65536;
+ static __thread struct trace_ring *my_ring;
+ static struct trace_ring *all_rings, *free_rings;
+ static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_key_t ring_key;
+ static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+ 
+ /* give up a ring (the thread is exiting, or tracing changed size).
+  * Called with trace_lock.
+  */
+ static void ring_put(struct trace_ring *r)
+ {
+     r->next_free = free_rings;
+     free_rings = r;
+ }
+ 
+ /* pthread key destructor */
+ static void ring_retire(void *arg)
+ {
+     pthread_mutex_lock(&trace_lock);
+     ring_put(arg);
+     pthread_mutex_unlock(&trace_lock);
+     my_ring = NULL;
+ }
+ 
+ static void ring_key_create(void)
+ {
+     pthread_key_create(&ring_key, ring_retire);
+ }
+ 
+ /* a ring of the current size for this thread: a free one, or new */
+ static struct trace_ring *ring_get(void)
+ {
+     pthread_once(&ring_once, ring_key_create);
+     pthread_mutex_lock(&trace_lock);
+     if (my_ring != NULL)
+         ring_put(my_ring);
+     struct trace_ring *r, **pp = &free_rings;
+     while ((r = *pp) != NULL && r->size != trace_size)
+         pp = &r->next_free;
+     if (r != NULL) {
+         *pp = r->next_free;
+     } else if ((r = calloc(1, sizeof(*r) + trace_size * sizeof(struct fs_trace_rec)))) {
+         r->size = trace_size;
+         r->next = all_rings;
+         all_rings = r;
+     }
+     if (r != NULL)
+         r->thread = thread_id();
+     pthread_mutex_unlock(&trace_lock);
+     pthread_setspecific(ring_key, r);
+     return my_ring = r;
+ }
+ 
+ /* start (with 'nrecs' records per thread) or stop tracing. Records
+  * are kept until exit; a new size starts new rings.
+  */
+ void fs_trace_enable(int nrecs)
+ {
+     pthread_mutex_lock(&trace_lock);
+     if (nrecs > 0)
+         trace_size = nrecs;
+     __atomic_store_n(&trace_on, nrecs > 0, __ATOMIC_RELAXED);
+     pthread_mutex_unlock(&trace_lock);
+ }
+ 
+ static void trace_add(int type, int op, int kind, uint32_t inum, uint64_t offset,
+                       uint64_t len, uint64_t start, int result)
+ {
+     struct trace_ring *r = my_ring;
+     if ((r == NULL || r->size != trace_size) && (r = ring_get()) == NULL)
+         return;
+     uint64_t ns = now_ns() - start;
+     struct fs_trace_rec *t = &r->recs[r->head % r->size];
+     t->time = start;
+     t->offset = offset;
+     t->latency = ns > UINT32_MAX ? UINT32_MAX : ns;
+     t->len = len;
+     t->inum = inum;
+     t->result = result;
+     t->thread = r->thread;
+     t->type = type;
+     t->op = op;
+     t->kind = kind;
+     __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+ }
+ 
+ static int cmp_trace(const void *a, const void *b)
+ {
+     const struct fs_trace_rec *x = a, *y = b;
+     return x->time < y->time ? -1 : x->time > y->time;
+ }
+ 
+ /* size of a trace file, from its header */
+ static size_t trace_len(const char *buf)
+ {
+     const struct fs_trace_hdr *h = (const struct fs_trace_hdr *)buf;
+     return sizeof(*h) + (size_t)h->nrecs * h->rec_size;
+ }
+ 
+ /* a trace file's worth of everything in the rings, in time order;
+  * returns it in a new buffer, or NULL
+  */
+ static char *trace_snapshot(void)
+ {
+     pthread_mutex_lock(&trace_lock);
+     size_t max = 0;
+     for (struct trace_ring *r = all_rings; r != NULL; r = r->next)
+         max += r->size;
+     char *buf = malloc(sizeof(struct fs_trace_hdr) + max * sizeof(struct fs_trace_rec));
+     if (buf == NULL) {
+         pthread_mutex_unlock(&trace_lock);
+         return NULL;
+     }
+     struct fs_trace_hdr *h = (struct fs_trace_hdr *)buf;
+     struct fs_trace_rec *recs = (struct fs_trace_rec *)(h + 1);
+     memset(h, 0, sizeof(*h));
+     h->magic = FS_TRACE_MAGIC;
+     h->rec_size = sizeof(struct fs_trace_rec);
+     h->nops = OP_COUNT;
+     for (int i = 0; i < OP_COUNT; i++)
+         strncpy(h->ops[i], op_names[i], sizeof(h->ops[i]) - 1);
+     for (struct trace_ring *r = all_rings; r != NULL; r = r->next) {
+         uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+         uint64_t first = head > r->size ? head - r->size : 0;
+         int n = 0;
+         for (uint64_t i = first; i < head; i++)
+             recs[h->nrecs + n++] = r->recs[i % r->size];
+         /* drop what was overwritten while copying, counting the
+          * record the writer may be half way through
+          */
+         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+         uint64_t now = __atomic_load_n(&r->head, __ATOMIC_RELAXED) + 1;
+         uint64_t lost = now > first + r->size ? now - first - r->size : 0;
+         if (lost > n)
+             lost = n;
+         memmove(&recs[h->nrecs], &recs[h->nrecs + lost], (n - lost) * sizeof(*recs));
+         h->nrecs += n - lost;
+     }
+     pthread_mutex_unlock(&trace_lock);
+     qsort(recs, h->nrecs, sizeof(*recs), cmp_trace);
+     return buf;
+ }
+ 
+ /* write the trace to 'fp' (at unmount, say); returns records written
+  * or -1
+  */
+ int fs_trace_dump(FILE *fp)
+ {
+     char *buf = trace_snapshot();
+     if (buf == NULL)
+         return -1;
+     int n = ((struct fs_trace_hdr *)buf)->nrecs;
+     if (fwrite(buf, trace_len(buf), 1, fp) != 1)
+         n = -1;
+     free(buf);
+     return n;
+ }
+
+ /* Recording: when on, every fs_ops call is appended to a file as a
+  * struct fs_record and its path names, for replay.c to play back.
+  * Records are written as calls finish, so each thread's are in order.
+  */
+ static uint64_t record_start;
+ static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+ 
+ /* start recording to 'fp' (NULL to stop); returns 0 or -1 */
+ int fs_record(FILE *fp)
+ {
+     pthread_mutex_lock(&record_lock);
+     int ret = 0;
+     if (record_fp != NULL)
+         ret = fflush(record_fp);
+     if (fp != NULL) {
+         struct fs_trace_hdr h = { .magic = FS_RECORD_MAGIC,
+                                   .rec_size = sizeof(struct fs_record),
+                                   .nops = OP_COUNT };
+         for (int i = 0; i < OP_COUNT; i++)
+             strncpy(h.ops[i], op_names[i], sizeof(h.ops[i]) - 1);
+         if (fwrite(&h, sizeof(h), 1, fp) != 1)
+             ret = -1;
+         record_start = now_ns();
+     }
+     __atomic_store_n(&record_fp, ret == 0 ? fp : NULL, __ATOMIC_RELAXED);
+     pthread_mutex_unlock(&record_lock);
+     return ret;
+ }
+ 
+ static void record_add(int op, uint64_t start, int result)
+ {
+     struct fs_record r = {
+         .offset = op_off, .len = op_len, .mode = op_mode,
+         .latency = now_ns() - start, .result = result,
+         .thread = thread_id(), .op = op,
+         .path_len = op_path ? strlen(op_path) : 0,
+         .path2_len = op_path2 ? strlen(op_path2) : 0 };
+     pthread_mutex_lock(&record_lock);
+     if (record_fp != NULL) {
+         r.time = start > record_start ? start - record_start : 0;
+         fwrite(&r, sizeof(r), 1, record_fp);
+         fwrite(op_path, 1, r.path_len, record_fp);
+         if (op_path2 != NULL)
+             fwrite(op_path2, 1, r.path2_len, record_fp);
+     }
+     pthread_mutex_unlock(&record_lock);
+ }
+ 
+ /* block_read and block_write seek and then read or write the image's
+  * one file descriptor, so callers have to take turns: readers run
+  * concurrently, and journal commits run outside fs_lock.
+  */
+ static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+ 
+ static int block_io(int kind, void *buf, int lba, int nblks)
+ {
+     int write = kind == IO_META_WRITE || kind == IO_DATA_WRITE;
+     uint64_t start = trace_on ? now_ns() : 0;
+     pthread_mutex_lock(&io_lock);
+     int ret = write ? block_write(buf, lba, nblks) : block_read(buf, lba, nblks);
+     pthread_mutex_unlock(&io_lock);
+     struct counters *c = counters();
+     count(write ? &c->writes : &c->reads, 1);
+     count(write ? &c->write_blocks : &c->read_blocks, nblks);
+     io_count(kind, nblks);
+     if (trace_on)
+         trace_add(FS_TRACE_IO, cur_op < 0 ? FS_TRACE_NOOP : cur_op, kind, 0, lba, nblks,
+                   start, ret);
+     return ret;
+ }
+ 
+ /* misc.c keeps the image's file descriptor to itself, so to flush it
+  * we open the image again: fs_set_image gives its name (the one passed
+  * to block_init), and fs_init opens it.
+  */
+ static char *image_file;
+ static int image_fd = -1;
+ 
+ void fs_set_image(const char *file)
+ {
+     free(image_file);
+     image_file = strdup(file);
+ }
+ 
+ static int block_flush_init(void)
+ {
+     if (image_fd >= 0)
+         close(image_fd);
+     image_fd = image_file != NULL ? open(image_file, O_RDWR) : -1;
+     return image_fd < 0 ? -1 : 0;
+ }
+ 
+ /* wait until the writes so far are on disk, so none of the ones after
+  * can get there first
+  */
+ static int block_flush(void)
+ {
+     return fdatasync(image_fd) < 0 ? -EIO : 0;
+ }
+ 
+ /* metadata (and anything that isn't file contents) */
+ static int disk_read(void *buf, int lba, int nblks)
+ {
+     return block_io(IO_META_READ, buf, lba, nblks);
+ }
+ 
+ static int disk_write(void *buf, int lba, int nblks)
+ {
+     return block_io(IO_META_WRITE, buf, lba, nblks);
+ }
+ 
+ /* file contents */
+ static int data_read(void *buf, int lba, int nblks)
+ {
+     return block_io(IO_DATA_READ, buf, lba, nblks);
+ }
+ 
+ static int data_write(void *buf, int lba, int nblks)
+ {
+     return block_io(IO_DATA_WRITE, buf, lba, nblks);
+ }
+
+ /* Memory accounting. Everything that holds a varying amount of memory
+  * (cache entries, journal buffers, scratch) charges it to a mem_user,
+  * and the total is held to 'mem_budget' (0 = no limit), set at mount
+  * time. Users that can give memory back have a shrink function; when
+  * the budget is exceeded the one used least recently is shrunk first,
+  * then the next, until the total fits again. Reclaiming is done at
+  * the end of an operation, with no locks held.
+  */
+ struct mem_user {
+     const char *name;
+     size_t bytes;
+     size_t (*shrink)(size_t want);     /* returns bytes freed */
+     unsigned long last_use;
+     int listed;                         /* in 'mem_users' */
+     struct mem_user *next;
+ };
+ 
+ static size_t mem_budget, mem_total, mem_reclaimed;
+ static unsigned long mem_clock;
+ static struct mem_user *mem_users;
+ static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+ 
+ static void mem_charge(struct mem_user *u, long delta)
+ {
+     pthread_mutex_lock(&mem_lock);
+     if (!u->listed) {
+         u->next = mem_users;
+         mem_users = u;
+         u->listed = 1;
+     }
+     u->bytes += delta;
+     mem_total += delta;
+     pthread_mutex_unlock(&mem_lock);
+ }
+ 
+ /* note a use of 'u', for picking the coldest user to shrink */
+ static void mem_touch(struct mem_user *u)
+ {
+     u->last_use = __atomic_add_fetch(&mem_clock, 1, __ATOMIC_RELAXED);
+ }
+ 
+ /* is there room for 'n' more bytes? */
+ static int mem_room(size_t n)
+ {
+     pthread_mutex_lock(&mem_lock);
+     int ok = mem_budget == 0 || mem_total + n <= mem_budget;
+     pthread_mutex_unlock(&mem_lock);
+     return ok;
+ }
+ 
+ /* shrink users, coldest first, until the total is within budget */
+ static void mem_reclaim(void)
+ {
+     struct mem_user *done[8];
+     int ndone = 0;
+     for (;;) {
+         pthread_mutex_lock(&mem_lock);
+         size_t over = mem_budget && mem_total > mem_budget ? mem_total - mem_budget : 0;
+         struct mem_user *coldest = NULL;
+         for (struct mem_user *u = mem_users; over && u != NULL; u = u->next) {
+             int skip = u->shrink == NULL || u->bytes == 0;
+             for (int i = 0; i < ndone; i++)
+                 skip |= done[i] == u;
+             if (!skip && (coldest == NULL || u->last_use < coldest->last_use))
+                 coldest = u;
+         }
+         pthread_mutex_unlock(&mem_lock);
+         if (coldest == NULL || ndone == 8)
+             return;
+         done[ndone++] = coldest;
+         size_t freed = coldest->shrink(over);
+         pthread_mutex_lock(&mem_lock);
+         mem_reclaimed += freed;
+         pthread_mutex_unlock(&mem_lock);
+     }
+ }
+ 
+ static int mem_over(void)
+ {
+     pthread_mutex_lock(&mem_lock);
+     int over = mem_budget != 0 && mem_total > mem_budget;
+     pthread_mutex_unlock(&mem_lock);
+     return over;
+ }
+ 
+ /* cap the memory the file system keeps, in bytes (0 = no limit) */
+ void fs_set_mem_budget(size_t bytes)
+ {
+     pthread_mutex_lock(&mem_lock);
+     mem_budget = bytes;
+     pthread_mutex_unlock(&mem_lock);
+ }
+ 
+ /* Slab allocator for fixed-size objects that come and go often (cache
+  * entries). Objects are carved from SLAB_CHUNK-byte chunks and kept on
+  * a free list when released, so steady-state use never calls malloc;
+  * slab_trim hands chunks with nothing in use back. A slab links itself
+  * into 'slabs' the first time it grows, for fs_mem_stats, and charges
+  * its chunks to its mem_user.
+  */
+ #define SLAB_CHUNK (64 * 1024)
+ 
+ struct slab_chunk {
+     struct slab_chunk *next;
+ };
+ 
+ struct slab {
+     const char *name;
+     size_t size;                /* object size */
+     void *free;                 /* free objects, linked through their first word */
+     struct slab_chunk *chunks;
+     int nchunks, inuse;
+     int listed;                 /* in 'slabs' */
+     struct slab *next;
+     struct mem_user *mem;
+     pthread_mutex_t lock;
+ };
+ #define SLAB_INIT(n, sz, m) { .name = (n), .size = ((sz) + 15) & ~15, .mem = (m), \
+                              .lock = PTHREAD_MUTEX_INITIALIZER }
+ 
+ static struct slab *slabs;
+ static pthread_mutex_t slabs_lock = PTHREAD_MUTEX_INITIALIZER;
+ 
+ /* objects per chunk, after the chunk header (rounded up to 16 bytes) */
+ static int slab_per_chunk(struct slab *s)
+ {
+     return (SLAB_CHUNK - 16) / s->size;
+ }
+ 
+ /* add a chunk's worth of objects to the free list. Called with s->lock */
+ static int slab_grow(struct slab *s)
+ {
+     struct slab_chunk *c = malloc(SLAB_CHUNK);
+     if (c == NULL)
+         return -ENOMEM;
+     if (!s->listed) {
+         pthread_mutex_lock(&slabs_lock);
+         s->next = slabs;
+         slabs = s;
+         s->listed = 1;
+         pthread_mutex_unlock(&slabs_lock);
+     }
+     c->next = s->chunks;
+     s->chunks = c;
+     s->nchunks++;
+     mem_charge(s->mem, SLAB_CHUNK);
+     char *obj = (char *)c + 16;
+     for (int i = 0; i < slab_per_chunk(s); i++, obj += s->size) {
+         *(void **)obj = s->free;
+         s->free = obj;
+     }
+     return 0;
+ }
+ 
+ static void *slab_alloc(struct slab *s)
+ {
+     pthread_mutex_lock(&s->lock);
+     void *obj = NULL;
+     if (s->free != NULL || slab_grow(s) == 0) {
+         obj = s->free;
+         s->free = *(void **)obj;
+         s->inuse++;
+     }
+     pthread_mutex_unlock(&s->lock);
+     return obj;
+ }
+ 
+ static void slab_free(struct slab *s, void *obj)
+ {
+     pthread_mutex_lock(&s->lock);
+     *(void **)obj = s->free;
+     s->free = obj;
+     s->inuse--;
+     pthread_mutex_unlock(&s->lock);
+ }
+ 
+ /* release chunks with no objects in use; returns bytes released */
+ static size_t slab_trim(struct slab *s)
+ {
+     pthread_mutex_lock(&s->lock);
+     size_t span = slab_per_chunk(s) * s->size, released = 0;
+     struct slab_chunk **pc = &s->chunks;
+     while (*pc != NULL) {
+         char *lo = (char *)*pc + 16, *hi = lo + span;
+         int nfree = 0;
+         for (void *o = s->free; o != NULL; o = *(void **)o)
+             nfree += (char *)o >= lo && (char *)o < hi;
+         if (nfree < slab_per_chunk(s)) {
+             pc = &(*pc)->next;
+             continue;
+         }
+         void **po = &s->free;          /* unlink its objects, then free it */
+         while (*po != NULL)
+             if ((char *)*po >= lo && (char *)*po < hi)
+                 *po = *(void **)*po;
+             else
+                 po = (void **)*po;
+         struct slab_chunk *c = *pc;
+         *pc = c->next;
+         free(c);
+         s->nchunks--;
+         released += SLAB_CHUNK;
+     }
+     pthread_mutex_unlock(&s->lock);
+     if (released > 0)
+         mem_charge(s->mem, -(long)released);
+     return released;
+ }
+ 
+ /* Per-operation scratch memory: a bump allocator per thread, emptied
+  * in one go when the operation ends (fs_end_read/fs_end_write, or a
+  * round of background work). One small chunk is kept between
+  * operations; bigger ones go back to malloc.
+  */
+ #define ARENA_CHUNK (64 * 1024)
+ 
+ struct arena_chunk {
+     struct arena_chunk *next;
+     size_t size, used;
+     char data[] __attribute__((aligned(16)));
+ };
+ 
+ static __thread struct arena_chunk *scratch;
+ static struct mem_user scratch_mem = { .name = "scratch" };
+ static size_t scratch_peak;                    /* all threads */
+ 
+ static void scratch_account(long delta)
+ {
+     mem_charge(&scratch_mem, delta);
+     pthread_mutex_lock(&mem_lock);
+     if (scratch_mem.bytes > scratch_peak)
+         scratch_peak = scratch_mem.bytes;
+     pthread_mutex_unlock(&mem_lock);
+ }
+ 
+ /* 'n' bytes of scratch, valid until the current operation ends */
+ static void *scratch_alloc(size_t n)
+ {
+     n = (n + 15) & ~(size_t)15;
+     struct arena_chunk *c = scratch;
+     if (c == NULL || c->size - c->used < n) {
+         size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+         if ((c = malloc(sizeof(*c) + size)) == NULL)
+             return NULL;
+         c->size = size;
+         c->used = 0;
+         c->next = scratch;
+         scratch = c;
+         scratch_account(size);
+     }
+     void *p = c->data + c->used;
+     c->used += n;
+     return p;
+ }
+ 
+ static void scratch_reset(void)
+ {
+     while (scratch != NULL) {
+         struct arena_chunk *c = scratch;
+         if (c->next == NULL && c->size == ARENA_CHUNK) {
+             c->used = 0;
+             break;
+         }
+         scratch = c->next;
+         scratch_account(-(long)c->size);
+         free(c);
+     }
+ }
+ 
+ /* memory held by the slabs and scratch arenas, and the budget */
+ void fs_mem_stats(struct fs_mem_stats *st)
+ {
+     memset(st, 0, sizeof(*st));
+     pthread_mutex_lock(&slabs_lock);
+     for (struct slab *s = slabs; s != NULL; s = s->next) {
+         pthread_mutex_lock(&s->lock);
+         st->slab_bytes += (uint64_t)s->nchunks * SLAB_CHUNK;
+         st->slab_objects += s->inuse;
+         pthread_mutex_unlock(&s->lock);
+     }
+     pthread_mutex_unlock(&slabs_lock);
+     pthread_mutex_lock(&mem_lock);
+     st->scratch_bytes = scratch_mem.bytes;
+     st->scratch_peak = scratch_peak;
+     st->budget = mem_budget;
+     st->total = mem_total;
+     st->reclaimed = mem_reclaimed;
+     pthread_mutex_unlock(&mem_lock);
+ }
+ 
+ /* The stats file: /.terrafs/stats, read-only and regenerated on every
+  * getattr and read, so its size is that of the latest text. It is
+  * not in the root directory's listing. Next to it, /.terrafs/trace
+  * holds the trace as of when it was opened (see fs_trace_dump).
+  */
+ #define STATS_DIR  "/.terrafs"
+ #define STATS_FILE "/.terrafs/stats"
+ #define TRACE_FILE "/.terrafs/trace"
+ #define STATS_MAX  16384
+ 
+ /* append to the 'size' bytes at 'buf', which hold 'n' so far, and
+  * update 'n'; what doesn't fit is cut off
+  */
+ static void text_add(char *buf, int size, int *n, const char *fmt, ...)
+ {
+     va_list args;
+     va_start(args, fmt);
+     *n += vsnprintf(buf + *n, size - *n, fmt, args);
+     va_end(args);
+     if (*n >= size)
+         *n = size - 1;
+ }
+ 
+ static int stats_text(char *buf, int size)
+ {
+     static const char *lat_names[LAT_BUCKETS] = {
+         "<1us", "<4us", "<16us", "<64us", "<256us", "<1ms",
+         "<4ms", "<16ms", "<64ms", "<256ms", "<1s", ">=1s" };
+     struct counters c;
+     struct fs_mem_stats m;
+     counters_sum(&c);
+     fs_mem_stats(&m);
+     int n = 0;
+     text_add(buf, size, &n, "%-10s %10s %8s %10s", "op", "calls", "errors", "avg_us");
+     for (int b = 0; b < LAT_BUCKETS; b++)
+         text_add(buf, size, &n, " %8s", lat_names[b]);
+     text_add(buf, size, &n, "\n");
+     for (int op = 0; op < OP_COUNT; op++) {
+         text_add(buf, size, &n, "%-10s %10llu %8llu %10llu", op_names[op],
+                  (unsigned long long)c.calls[op], (unsigned long long)c.errors[op],
+                  (unsigned long long)(c.calls[op] ? c.ns[op] / c.calls[op] / 1000 : 0));
+         for (int b = 0; b < LAT_BUCKETS; b++)
+             text_add(buf, size, &n, " %8llu", (unsigned long long)c.lat[op][b]);
+         text_add(buf, size, &n, "\n");
+     }
+     static const char *io_names[IO_BUCKETS] = {
+         "0", "1", "2", "<=4", "<=8", "<=16", "<=32", "<=64", "<=128", "<=256", ">256" };
+     text_add(buf, size, &n, "%-10s %8s %8s %8s %8s\n", "io/call",
+              "meta_rd", "meta_wr", "data_rd", "data_wr");
+     for (int op = 0; op < OP_COUNT; op++) {
+         double calls = c.calls[op] ? c.calls[op] : 1;
+         text_add(buf, size, &n, "%-10s %8.1f %8.1f %8.1f %8.1f\n", op_names[op],
+                  c.io[op][IO_META_READ] / calls, c.io[op][IO_META_WRITE] / calls,
+                  c.io[op][IO_DATA_READ] / calls, c.io[op][IO_DATA_WRITE] / calls);
+     }
+     uint64_t *bg = c.io[OP_COUNT];
+     text_add(buf, size, &n, "background blocks %llu %llu %llu %llu\n",
+              (unsigned long long)bg[IO_META_READ], (unsigned long long)bg[IO_META_WRITE],
+              (unsigned long long)bg[IO_DATA_READ], (unsigned long long)bg[IO_DATA_WRITE]);
+     for (int k = 0; k < 2; k++) {
+         text_add(buf, size, &n, "%-10s", k ? "data/call" : "meta/call");
+         for (int b = 0; b < IO_BUCKETS; b++)
+             text_add(buf, size, &n, " %8s", io_names[b]);
+         text_add(buf, size, &n, "\n");
+         for (int op = 0; op < OP_COUNT; op++) {
+             text_add(buf, size, &n, "%-10s", op_names[op]);
+             for (int b = 0; b < IO_BUCKETS; b++)
+                 text_add(buf, size, &n, " %8llu",
+                          (unsigned long long)c.io_hist[op][k][b]);
+             text_add(buf, size, &n, "\n");
+         }
+     }
+     uint64_t lookups = c.cache_hits + c.cache_misses;
+     text_add(buf, size, &n,
+              "block reads %llu (%llu blocks) writes %llu (%llu blocks)\n"
+              "cache hits %llu misses %llu ratio %.3f\n"
+              "memory budget %llu total %llu reclaimed %llu\n",
+              (unsigned long long)c.reads, (unsigned long long)c.read_blocks,
+              (unsigned long long)c.writes, (unsigned long long)c.write_blocks,
+              (unsigned long long)c.cache_hits, (unsigned long long)c.cache_misses,
+              lookups ? (double)c.cache_hits / lookups : 0.0,
+              (unsigned long long)m.budget, (unsigned long long)m.total,
+              (unsigned long long)m.reclaimed);
+     pthread_mutex_lock(&mem_lock);
+     for (struct mem_user *u = mem_users; u != NULL; u = u->next)
+         text_add(buf, size, &n, "memory %s %zu\n", u->name, u->bytes);
+     pthread_mutex_unlock(&mem_lock);
+     pthread_mutex_lock(&slabs_lock);
+     for (struct slab *sl = slabs; sl != NULL; sl = sl->next)
+         text_add(buf, size, &n, "slab %s objects %d chunks %d\n",
+                  sl->name, sl->inuse, sl->nchunks);
+     pthread_mutex_unlock(&slabs_lock);
+     text_add(buf, size, &n, "scratch bytes %llu peak %llu\n",
+              (unsigned long long)m.scratch_bytes, (unsigned long long)m.scratch_peak);
+     return n;
+ }
+ 
+ /* is 'path' the stats directory or something in it? */
+ static int stats_path(const char *path)
+ {
+     return strcmp(path, STATS_DIR) == 0 ||
+         strncmp(path, STATS_DIR "/", strlen(STATS_DIR) + 1) == 0;
+ }
+ 
+ static int stats_getattr(const char *path, struct stat *sb)
+ {
+     memset(sb, 0, sizeof(*sb));
+     sb->st_uid = getuid();
+     sb->st_gid = getgid();
+     sb->st_mtime = sb->st_ctime = sb->st_atime = time(NULL);
+     sb->st_nlink = 1;
+     if (strcmp(path, STATS_DIR) == 0) {
+         sb->st_mode = S_IFDIR | 0555;
+         sb->st_size = FS_BLOCK_SIZE;
+     } else if (strcmp(path, STATS_FILE) == 0) {
+         char buf[STATS_MAX];
+         sb->st_mode = S_IFREG | 0444;
+         sb->st_size = stats_text(buf, sizeof(buf));
+     } else if (strcmp(path, TRACE_FILE) == 0) {
+         sb->st_mode = S_IFREG | 0444;  /* size unknown until opened */
+     } else {
+         return -ENOENT;
+     }
+     return 0;
+ }
+ 
+ /* the text can grow between getattr and read, so bypass the page
+  * cache (which would stop at the old size). The trace is copied once
+  * at open, into fi->fh, so that reads of it are consistent.
+  */
+ static int stats_open(const char *path, struct fuse_file_info *fi)
+ {
+     if ((fi->flags & O_ACCMODE) != O_RDONLY)
+         return -EACCES;
+     fi->direct_io = 1;
+     if (strcmp(path, TRACE_FILE) == 0) {
+         char *snap = trace_snapshot();
+         if (snap == NULL)
+             return -ENOMEM;
+         fi->fh = (uintptr_t)snap;
+     }
+     return 0;
+ }
+ 
+ static int stats_release(const char *path, struct fuse_file_info *fi)
+ {
+     if (strcmp(path, TRACE_FILE) == 0)
+         free((char *)(uintptr_t)fi->fh);
+     fi->fh = 0;
+     return 0;
+ }
+ 
+ static int stats_read(const char *path, char *buf, size_t len, off_t offset,
+                       struct fuse_file_info *fi)
+ {
+     char text[STATS_MAX], *snap = NULL;
+     const char *data = text;
+     size_t n;
+     if (strcmp(path, STATS_FILE) == 0) {
+         n = stats_text(text, sizeof(text));
+     } else if (strcmp(path, TRACE_FILE) == 0) {
+         if (fi != NULL && fi->fh != 0)
+             data = (char *)(uintptr_t)fi->fh;
+         else if ((data = snap = trace_snapshot()) == NULL)
+             return -ENOMEM;
+         n = trace_len(data);
+     } else {
+         return strcmp(path, STATS_DIR) == 0 ? -EISDIR : -ENOENT;
+     }
+     if (offset >= n)
+         len = 0;
+     else if (len > n - offset)
+         len = n - offset;
+     memcpy(buf, data + offset, len);
+     free(snap);
+     return len;
+ }
+ 
+ /* Buffer cache for file data blocks, filled by fs_read and by
+  * readahead. Entries are keyed by block number, so a block has to be
+  * dropped whenever it's rewritten or freed. They come from a slab as
+  * the cache fills, up to CACHE_BLOCKS or the memory budget; after that
+  * the least recently used one is recycled.
+  */
+ #define CACHE_BLOCKS 1024
+ #define CACHE_HASH   2048
+ 
+ struct cbuf {
+     int blkno;
+     struct cbuf *hnext;         /* hash chain */
+     struct cbuf *prev, *next;   /* LRU list, most recent first */
+     char data[FS_BLOCK_SIZE];
+ };
+ static size_t cache_shrink(size_t want);
+ static struct mem_user cache_mem = { .name = "block cache", .shrink = cache_shrink };
+ static struct slab cbuf_slab = SLAB_INIT("block cache", sizeof(struct cbuf), &cache_mem);
+ static struct cbuf *cache_hash[CACHE_HASH];
+ static struct cbuf *cache_lru, *cache_mru;
+ static int cache_count;
+ static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+ 
+ static void lru_unlink(struct cbuf *c)
+ {
+     if (c->prev != NULL)
+         c->prev->next = c->next;
+     else
+         cache_mru = c->next;
+     if (c->next != NULL)
+         c->next->prev = c->prev;
+     else
+         cache_lru = c->prev;
+ }
+ 
+ static void lru_push(struct cbuf *c)
+ {
+     c->prev = NULL;
+     c->next = cache_mru;
+     if (cache_mru != NULL)
+         cache_mru->prev = c;
+     cache_mru = c;
+     if (cache_lru == NULL)
+         cache_lru = c;
+ }
+ 
+ /* remove entry 'c' from its hash chain */
+ static void hash_unlink(struct cbuf *c)
+ {
+     struct cbuf **p = &cache_hash[c->blkno % CACHE_HASH];
+     while (*p != c)
+         p = &(*p)->hnext;
+     *p = c->hnext;
+ }
+ 
+ static struct cbuf *cache_find(int blkno)
+ {
+     struct cbuf *c = cache_hash[blkno % CACHE_HASH];
+     while (c != NULL && c->blkno != blkno)
+         c = c->hnext;
+     return c;
+ }
+ 
+ /* drop everything */
+ static void cache_clear(void)
+ {
+     pthread_mutex_lock(&cache_lock);
+     while (cache_mru != NULL) {
+         struct cbuf *c = cache_mru;
+         cache_mru = c->next;
+         slab_free(&cbuf_slab, c);
+     }
+     memset(cache_hash, 0, sizeof(cache_hash));
+     cache_lru = NULL;
+     cache_count = 0;
+     pthread_mutex_unlock(&cache_lock);
+     slab_trim(&cbuf_slab);
+ }
+ 
+ /* copy block 'blkno' into 'buf' if it's cached; returns 1 if so */
+ static int cache_get(int blkno, void *buf)
+ {
+     pthread_mutex_lock(&cache_lock);
+     struct cbuf *c = cache_find(blkno);
+     mem_touch(&cache_mem);
+     if (c != NULL) {
+         memcpy(buf, c->data, FS_BLOCK_SIZE);
+         lru_unlink(c);
+         lru_push(c);
+     }
+     pthread_mutex_unlock(&cache_lock);
+     count(c != NULL ? &counters()->cache_hits : &counters()->cache_misses, 1);
+     return c != NULL;
+ }
+ 
+ static int cache_has(int blkno)
+ {
+     pthread_mutex_lock(&cache_lock);
+     int ret = cache_find(blkno) != NULL;
+     pthread_mutex_unlock(&cache_lock);
+     return ret;
+ }
+ 
+ /* cache a copy of block 'blkno', replacing the least recently used
+  * once the cache is full
+  */
+ static void cache_put(int blkno, const void *buf)
+ {
+     pthread_mutex_lock(&cache_lock);
+     struct cbuf *c = cache_find(blkno);
+     mem_touch(&cache_mem);
+     if (c != NULL) {
+         lru_unlink(c);
+     } else {
+         if (cache_count < CACHE_BLOCKS && mem_room(cbuf_slab.size) &&
+             (c = slab_alloc(&cbuf_slab)) != NULL) {
+             cache_count++;
+         } else if ((c = cache_lru) != NULL) {
+             hash_unlink(c);
+             lru_unlink(c);
+         } else {
+             pthread_mutex_unlock(&cache_lock);
+             return;
+         }
+         c->blkno = blkno;
+         c->hnext = cache_hash[blkno % CACHE_HASH];
+         cache_hash[blkno % CACHE_HASH] = c;
+     }
+     memcpy(c->data, buf, FS_BLOCK_SIZE);
+     lru_push(c);
+     pthread_mutex_unlock(&cache_lock);
+ }
+ 
+ static void cache_drop(int blkno)
+ {
+     pthread_mutex_lock(&cache_lock);
+     struct cbuf *c = cache_find(blkno);
+     if (c != NULL) {
+         hash_unlink(c);
+         lru_unlink(c);
+         slab_free(&cbuf_slab, c);
+         cache_count--;
+     }
+     pthread_mutex_unlock(&cache_lock);
+ }
+
+ /* drop least recently used entries until about 'want' bytes of slab
+  * can be released
+  */
+ static size_t cache_shrink(size_t want)
+ {
+     size_t freed = 0;
+     while (freed < want) {
+         pthread_mutex_lock(&cache_lock);
+         size_t n = (want - freed + cbuf_slab.size - 1) / cbuf_slab.size;
+         for (; n > 0 && cache_lru != NULL; n--) {
+             struct cbuf *c = cache_lru;
+             hash_unlink(c);
+             lru_unlink(c);
+             slab_free(&cbuf_slab, c);
+             cache_count--;
+         }
+         int empty = cache_lru == NULL;
+         pthread_mutex_unlock(&cache_lock);
+         freed += slab_trim(&cbuf_slab);
+         if (empty)
+             break;
+     }
+     return freed;
+ }
+ 
+ static char superblock[FS_BLOCK_SIZE];
+ static unsigned char bitmap[FS_BLOCK_SIZE];  
+ 
+ static int translate(const char *path);
+ static int lookup_parent(const char *path, int *parent_inum, char *leaf);
+ static int path_walk(const char *path, int *parent, char *leaf, int avoid);
+ static int allocate_block(int goal);
+ static int allocate_run(int goal, int want, int *got);
+ static int free_blocks(void);
+ static int free_or_reclaimed(void);
+ static void ag_recount(void);
+ static int ag_emptiest(void);
+ static void mark_used(int i);
+ static void unpin(int i);
+ static int file_goal(int inum, struct fs_inode *inode, int index);
+ static int free_block(int block_num);
+ static int release_block(int block_num);
+ 
+ /* Locking: operations that only read take fs_lock shared, operations
+  * that modify the file system take it exclusive.
+  */
+ static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+ 
+ /* Metadata (superblock, bitmap, inodes, directory blocks) is read and
+  * written through meta_read/meta_write. A write operation stages the
+  * blocks it changes in 'handle'; when it finishes they move to the
+  * running transaction, which is committed to the journal in a single
+  * sequential write and then written back in place (checkpointed).
+  * Operations that finish while a commit is in progress are committed
+  * together by the next one (group commit). On images without a
+  * journal, staged blocks are written in place when the operation ends.
+  * If an operation fails its staged blocks are simply dropped.
+  */
+ struct jblock {
+     int  blkno;
+     char data[FS_BLOCK_SIZE];
+ };
+ 
+ struct txn {
+     int n, max;
+     struct jblock *blocks;
+     int nfreed, maxfreed;
+     int *freed;                 /* blocks freed by this transaction */
+ };
+ 
+ static size_t txn_shrink(size_t want);
+ static struct mem_user txn_mem = { .name = "journal buffers", .shrink = txn_shrink };
+ 
+ static struct txn handle;       /* current operation (under fs_lock) */
+ static struct txn running;      /* finished operations, not yet committed */
+ static struct txn committing;   /* being written to the journal */
+ static int committing_active;
+ static uint32_t running_seq, committed_seq;
+ static uint32_t failed_seq;     /* first commit that failed, 0 = none */
+ static int commit_err;          /* ...and why */
+ static pthread_mutex_t j_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t j_cond = PTHREAD_COND_INITIALIZER;
+ 
+ /* blocks freed by an uncommitted transaction may still be referenced
+  * by the on-disk metadata, so they can't be reused until it commits.
+  * The ones that came off the orphan list are also in 'reclaimed':
+  * statfs goes on counting those as free. (Both under j_lock.)
+  */
+ static unsigned char pinned[FS_BLOCK_SIZE];
+ static unsigned char reclaimed[FS_BLOCK_SIZE];
+ static int nreclaimed;
+ 
+ void bit_set(unsigned char *map, int i);
+ void bit_clear(unsigned char *map, int i);
+ int bit_test(unsigned char *map, int i);
+ 
+ static struct fs_super *super(void)
+ {
+     return (struct fs_super *)superblock;
+ }
+ 
+ /* the most blocks one operation's transaction can need: a few
+  * directory, inode and bitmap blocks, and any of the tables (a big
+  * truncate or a snapshot can touch all of them). gen-disk.py makes
+  * the journal at least this big.
+  */
+ static int journal_needed(void)
+ {
+     struct fs_super *sb = super();
+     return FS_JOURNAL_OP_BLOCKS + sb->imap_len + sb->owner_len +
+         sb->birth_len + sb->refs_len;
+ }
+ 
+ /* max number of blocks in one journal transaction */
+ static int journal_capacity(void)
+ {
+     int cap = super()->journal_len - 1;
+     int max = (FS_BLOCK_SIZE - offsetof(struct fs_journal_hdr, blocks)) / 4;
+     if (!(super()->features & FS_FEAT_JOURNAL) || cap <= 0)
+         return 0;
+     return cap < max ? cap : max;
+ }
+ 
+ static struct jblock *txn_find(struct txn *t, int blkno)
+ {
+     for (int i = 0; i < t->n; i++)
+         if (t->blocks[i].blkno == blkno)
+             return &t->blocks[i];
+     return NULL;
+ }
+ 
+ /* make room in 't' for 'n' blocks and 'nfreed' freed ones */
+ static int txn_reserve(struct txn *t, int n, int nfreed)
+ {
+     if (n > t->max) {
+         int max = t->max ? t->max : 8;
+         while (max < n)
+             max *= 2;
+         void *p = realloc(t->blocks, max * sizeof(struct jblock));
+         if (p == NULL)
+             return -ENOMEM;
+         mem_charge(&txn_mem, (long)(max - t->max) * sizeof(struct jblock));
+         t->blocks = p;
+         t->max = max;
+     }
+     if (nfreed > t->maxfreed) {
+         int max = t->maxfreed ? t->maxfreed : 16;
+         while (max < nfreed)
+             max *= 2;
+         int *p = realloc(t->freed, max * sizeof(int));
+         if (p == NULL)
+             return -ENOMEM;
+         mem_charge(&txn_mem, (long)(max - t->maxfreed) * sizeof(int));
+         t->freed = p;
+         t->maxfreed = max;
+     }
+     return 0;
+ }
+ 
+ static int txn_add(struct txn *t, int blkno, const void *data)
+ {
+     struct jblock *jb = txn_find(t, blkno);
+     if (jb == NULL) {
+         if (txn_reserve(t, t->n + 1, 0) < 0)
+             return -ENOMEM;
+         jb = &t->blocks[t->n++];
+         jb->blkno = blkno;
+     }
+     memcpy(jb->data, data, FS_BLOCK_SIZE);
+     return 0;
+ }
+ 
+ static int txn_add_freed(struct txn *t, int blkno)
+ {
+     if (txn_reserve(t, 0, t->nfreed + 1) < 0)
+         return -ENOMEM;
+     t->freed[t->nfreed++] = blkno;
+     return 0;
+ }
+ 
+ static void txn_reset(struct txn *t)
+ {
+     t->n = t->nfreed = 0;
+ }
+ 
+ /* give an empty transaction's buffers back. Called with j_lock */
+ static size_t txn_release(struct txn *t)
+ {
+     if (t->n > 0 || t->nfreed > 0)
+         return 0;
+     size_t bytes = t->max * sizeof(struct jblock) + t->maxfreed * sizeof(int);
+     free(t->blocks);
+     free(t->freed);
+     t->blocks = NULL;
+     t->freed = NULL;
+     t->max = t->maxfreed = 0;
+     return bytes;
+ }
+ 
+ /* shrink function for the transaction buffers: they grow to fit the
+  * biggest operation seen and are kept, so drop the idle ones. The
+  * current operation's only if no operation is running.
+  */
+ static size_t txn_shrink(size_t want)
+ {
+     size_t freed = 0;
+     int idle = pthread_rwlock_trywrlock(&fs_lock) == 0;
+     pthread_mutex_lock(&j_lock);
+     if (idle)
+         freed += txn_release(&handle);
+     freed += txn_release(&running);
+     if (!committing_active)
+         freed += txn_release(&committing);
+     pthread_mutex_unlock(&j_lock);
+     if (idle)
+         pthread_rwlock_unlock(&fs_lock);
+     if (freed > 0)
+         mem_charge(&txn_mem, -(long)freed);
+     return freed;
+ }
+ 
+ static int cmp_jblock(const void *a, const void *b)
+ {
+     return ((struct jblock *)a)->blkno - ((struct jblock *)b)->blkno;
+ }
+ 
+ /* write a transaction's blocks to their home locations, in disk order.
+  * Called without j_lock; the sort takes it, since meta_read may be
+  * looking a block up in 't' (the committing transaction) meanwhile.
+  */
+ static int txn_write_home(struct txn *t)
+ {
+     pthread_mutex_lock(&j_lock);
+     qsort(t->blocks, t->n, sizeof(struct jblock), cmp_jblock);
+     pthread_mutex_unlock(&j_lock);
+     for (int i = 0; i < t->n; i++)
+         if (disk_write(t->blocks[i].data, t->blocks[i].blkno, 1) < 0)
+             return -EIO;
+     return 0;
+ }
+ 
+ /* read a metadata block, seeing changes that haven't reached its home
+  * location yet.
+  */
+ static int meta_read(void *buf, int blkno)
+ {
+     pthread_mutex_lock(&j_lock);
+     struct jblock *jb = txn_find(&handle, blkno);
+     if (jb == NULL)
+         jb = txn_find(&running, blkno);
+     if (jb == NULL)
+         jb = txn_find(&committing, blkno);
+     if (jb != NULL)
+         memcpy(buf, jb->data, FS_BLOCK_SIZE);
+     pthread_mutex_unlock(&j_lock);
+     if (jb != NULL)
+         return 0;
+     return disk_read(buf, blkno, 1) < 0 ? -EIO : 0;
+ }
+ 
+ static int meta_write(void *buf, int blkno)
+ {
+     mem_touch(&txn_mem);
+     pthread_mutex_lock(&j_lock);
+     int ret = txn_add(&handle, blkno, buf);
+     pthread_mutex_unlock(&j_lock);
+     return ret;
+ }
+ 
+ /* checksum of a transaction: its header (with 'crc' zero), so a torn
+  * header can't send good blocks to the wrong places, then its blocks
+  */
+ static uint32_t journal_crc(struct fs_journal_hdr *hdr, char *data)
+ {
+     uint32_t saved = hdr->crc;
+     hdr->crc = 0;
+     uLong crc = crc32(0L, Z_NULL, 0);
+     crc = crc32(crc, (Bytef *)hdr, FS_BLOCK_SIZE);
+     crc = crc32(crc, (Bytef *)data, hdr->nblocks * FS_BLOCK_SIZE);
+     hdr->crc = saved;
+     return crc;
+ }
+ 
+ /* write one transaction to the journal, then checkpoint it and mark
+  * the journal clean, flushing in between so the checkpoint can't reach
+  * the disk before the transaction, nor the clean mark before the
+  * checkpoint. Called without j_lock held.
+  */
+ static int journal_write(struct txn *t, uint32_t seq)
+ {
+     int start = super()->journal_start;
+     char *buf = scratch_alloc((t->n + 1) * FS_BLOCK_SIZE);
+     if (buf == NULL)
+         return -ENOMEM;
+ 
+     struct fs_journal_hdr *hdr = (struct fs_journal_hdr *)buf;
+     memset(hdr, 0, FS_BLOCK_SIZE);
+     hdr->magic = FS_JOURNAL_MAGIC;
+     hdr->seq = seq;
+     hdr->nblocks = t->n;
+     for (int i = 0; i < t->n; i++) {
+         hdr->blocks[i] = t->blocks[i].blkno;
+         memcpy(buf + (i + 1) * FS_BLOCK_SIZE, t->blocks[i].data, FS_BLOCK_SIZE);
+     }
+     hdr->crc = journal_crc(hdr, buf + FS_BLOCK_SIZE);
+ 
+     if (disk_write(buf, start, t->n + 1) < 0 || block_flush() < 0 ||
+         txn_write_home(t) < 0 || block_flush() < 0)
+         return -EIO;
+     hdr->nblocks = 0;
+     if (disk_write(buf, start, 1) < 0)
+         return -EIO;
+     return 0;
+ }
+ 
+ /* commit the running transaction. Called with j_lock held and no
+  * commit in progress; drops j_lock during the I/O. Once a commit has
+  * failed nothing more is written until the next mount, since later
+  * transactions build on it: they all fail the same way.
+  */
+ static int journal_commit_locked(void)
+ {
+     struct txn tmp = committing;
+     committing = running;
+     running = tmp;
+     txn_reset(&running);
+     uint32_t seq = running_seq++;
+     committing_active = 1;
+     pthread_mutex_unlock(&j_lock);
+ 
+     int ret = failed_seq != 0 ? commit_err : 0;
+     if (ret == 0 && committing.n > 0)
+         ret = journal_write(&committing, seq);
+ 
+     pthread_mutex_lock(&j_lock);
+     for (int i = 0; i < committing.nfreed && ret == 0; i++)
+         unpin(committing.freed[i]);
+     txn_reset(&committing);
+     committing_active = 0;
+     committed_seq = seq;
+     if (ret < 0 && failed_seq == 0) {
+         failed_seq = seq;
+         commit_err = ret;
+     }
+     pthread_cond_broadcast(&j_cond);
+     return ret;
+ }
+ 
+ /* wait until transaction 'seq' is on disk, committing it ourselves if
+  * nobody else is.
+  */
+ static int journal_wait(uint32_t seq)
+ {
+     int ret = 0;
+     pthread_mutex_lock(&j_lock);
+     while (committed_seq < seq) {
+         if (committing_active)
+             pthread_cond_wait(&j_cond, &j_lock);
+         else
+             journal_commit_locked();
+     }
+     if (failed_seq != 0 && seq >= failed_seq)
+         ret = commit_err;
+     pthread_mutex_unlock(&j_lock);
+     return ret;
+ }
+ 
+ static void handle_abort(void);
+ 
+ /* move the current operation's blocks into the running transaction,
+  * committing what's there first if they wouldn't fit. Returns the
+  * sequence number of the transaction to wait for (0 = nothing to do).
+  */
+ static int handle_merge(uint32_t *seq)
+ {
+     int ret, cap = journal_capacity();
+     *seq = 0;
+     pthread_mutex_lock(&j_lock);
+     if (failed_seq != 0) {
+         ret = commit_err;
+         pthread_mutex_unlock(&j_lock);
+         handle_abort();
+         return ret;
+     }
+     if (handle.n > cap) {
+         /* can't be committed atomically, so it can't be done: only
+          * a journal smaller than journal_needed() gets here */
+         pthread_mutex_unlock(&j_lock);
+         handle_abort();
+         return -ENOSPC;
+     }
+     if (running.n + handle.n > cap) {
+         while (committing_active)
+             pthread_cond_wait(&j_cond, &j_lock);
+         journal_commit_locked();
+     }
+     /* all or nothing: with the room reserved, the adds can't fail */
+     if (txn_reserve(&running, running.n + handle.n,
+                     running.nfreed + handle.nfreed) < 0) {
+         pthread_mutex_unlock(&j_lock);
+         handle_abort();
+         return -ENOMEM;
+     }
+     for (int i = 0; i < handle.n; i++)
+         txn_add(&running, handle.blocks[i].blkno, handle.blocks[i].data);
+     for (int i = 0; i < handle.nfreed; i++)
+         txn_add_freed(&running, handle.freed[i]);
+     if (handle.n > 0 || handle.nfreed > 0)
+         *seq = running_seq;
+     txn_reset(&handle);
+     pthread_mutex_unlock(&j_lock);
+     return 0;
+ }
+ 
+ static int reload_cached_metadata(void);
+ static int orphan_load(void);
+ 
+ /* drop the current operation's changes, and reload the in-memory
+  * bitmap and tables, which it may have modified.
+  */
+ static void handle_abort(void)
+ {
+     pthread_mutex_lock(&j_lock);
+     int reload = handle.n > 0;
+     for (int i = 0; i < handle.nfreed; i++)
+         unpin(handle.freed[i]);
+     txn_reset(&handle);
+     pthread_mutex_unlock(&j_lock);
+     if (reload)
+         reload_cached_metadata();
+ }
+ 
+ /* without a journal, write what the current operation has changed so
+  * far to disk now, before anything it changes next. (With one, the
+  * whole operation commits atomically anyway.)
+  */
+ static int handle_write_home(void)
+ {
+     if (journal_capacity() > 0)
+         return 0;
+     int ret = txn_write_home(&handle);
+     txn_reset(&handle);
+     return ret;
+ }
+ 
+ /* commit what the current operation has done so far as a transaction
+  * of its own, ahead of the rest of it: for work that comes in pieces
+  * that might not fit in the journal together.
+  */
+ static uint32_t split_seq;     /* the last piece's, for fs_end_write */
+ 
+ static int handle_commit(void)
+ {
+     uint32_t seq;
+     if (journal_capacity() == 0)
+         return handle_write_home();
+     int ret = handle_merge(&seq);
+     if (seq != 0)
+         split_seq = seq;
+     return ret;
+ }
+ 
+ static void fs_begin_read(void)
+ {
+     pthread_rwlock_rdlock(&fs_lock);
+ }
+ 
+ static int fs_end_read(int ret)
+ {
+     pthread_rwlock_unlock(&fs_lock);
+     scratch_reset();
+     if (mem_over())
+         mem_reclaim();
+     return ret;
+ }
+ 
+ static void log_clean_foreground(void);
+ static int log_starved;         /* log ran out of clean segments */
+ static void orphan_foreground(void);
+ 
+ static int snap_view;           /* snapshot mounted (read-only), 0 = live */
+ 
+ /* start a write operation; fails with -EROFS on a snapshot */
+ static int fs_begin_write(void)
+ {
+     if (snap_view > 0)
+         return -EROFS;
+     pthread_rwlock_wrlock(&fs_lock);
+     orphan_foreground();
+     if (log_starved)
+         log_clean_foreground();
+     return 0;
+ }
+ 
+ /* finish a write operation: commit its changes (or drop them if it
+  * failed) and return its result.
+  */
+ static int fs_end_write(int ret)
+ {
+     uint32_t seq = 0;
+     int err = 0;
+     if (ret < 0) {
+         handle_abort();
+     } else if (journal_capacity() == 0) {
+         err = txn_write_home(&handle);
+         txn_reset(&handle);
+     } else {
+         err = handle_merge(&seq);
+     }
+     if (seq == 0)
+         seq = split_seq;        /* pieces committed with handle_commit */
+     split_seq = 0;
+     pthread_rwlock_unlock(&fs_lock);
+     if (err == 0 && seq != 0)
+         err = journal_wait(seq);
+     scratch_reset();
+     if (mem_over())
+         mem_reclaim();
+     return err < 0 ? err : ret;
+ }
+ 
+ /* redo a transaction left in the journal by a crash. A transaction
+  * whose checksum (header and blocks) doesn't match was never fully
+  * written, and is ignored.
+  */
+ static int journal_replay(void)
+ {
+     int start = super()->journal_start, cap = journal_capacity();
+     if (cap == 0)
+         return 0;
+ 
+     struct fs_journal_hdr hdr;
+     if (disk_read(&hdr, start, 1) < 0)
+         return -EIO;
+     if (hdr.magic != FS_JOURNAL_MAGIC || hdr.nblocks == 0 ||
+         hdr.nblocks > cap)
+         return 0;
+ 
+     char *data = scratch_alloc(hdr.nblocks * FS_BLOCK_SIZE);
+     if (data == NULL)
+         return -ENOMEM;
+     if (disk_read(data, start + 1, hdr.nblocks) < 0)
+         return -EIO;
+     if (journal_crc(&hdr, data) == hdr.crc) {
+         for (int i = 0; i < hdr.nblocks; i++)
+             if (disk_write(data + i * FS_BLOCK_SIZE, hdr.blocks[i], 1) < 0)
+                 return -EIO;
+         if (block_flush() < 0)
+             return -EIO;
+     }
+     hdr.nblocks = 0;
+     if (disk_write(&hdr, start, 1) < 0)
+         return -EIO;
+     return 0;
+ }
+ 
+ /* Log-structured mode (FS_FEAT_LOG). Nothing is updated in place:
+  * every new version of a data block, directory block or inode is
+  * appended at the log head, and the old copy freed. Inode numbers are
+  * indexes into the inode map (imap), which gives the block currently
+  * holding each inode. The log is written a segment at a time; the
+  * owner table records which file block each disk block holds, so the
+  * segment cleaner can move the live blocks out of a mostly-empty
+  * segment and hand the log another clean one. imap and owners are
+  * cached in memory and staged like any other metadata.
+  */
+ static uint32_t *imap;
+ static struct fs_owner *owners;
+ static int log_head;
+ 
+ #define LOG_CLEAN_LOW  4        /* start cleaning below this many clean segments */
+ #define LOG_CLEAN_HIGH 8        /* ...and stop at this many */
+ #define LOG_CLEAN_BATCH 4       /* blocks moved per cleaner transaction */
+ 
+ #define BG_CLEAN     0x1        /* background work: segment cleaning, */
+ #define BG_READAHEAD 0x2        /*   readahead */
+ #define BG_FLUSH     0x4        /*   flushing delayed writes */
+ #define BG_RECLAIM   0x8        /*   and freeing orphans' blocks */
+ static void bg_kick(int work);
+ 
+ static int log_mode(void)
+ {
+     return super()->features & FS_FEAT_LOG;
+ }
+ 
+ /* is 'blkno' staged by the current operation? */
+ static int staged(int blkno)
+ {
+     pthread_mutex_lock(&j_lock);
+     int ret = txn_find(&handle, blkno) != NULL;
+     pthread_mutex_unlock(&j_lock);
+     return ret;
+ }
+ 
+ /* load an in-memory table (imap, owners) from its region */
+ static int table_load(void **table, int start, int len)
+ {
+     void *p = realloc(*table, len * FS_BLOCK_SIZE);
+     if (p == NULL)
+         return -ENOMEM;
+     *table = p;
+     for (int i = 0; i < len; i++)
+         if (meta_read((char *)*table + i * FS_BLOCK_SIZE, start + i) < 0)
+             return -EIO;
+     return 0;
+ }
+ 
+ /* stage the block of a table holding the entry at 'offset' bytes */
+ static int table_stage(void *table, int start, int offset)
+ {
+     int i = offset / FS_BLOCK_SIZE;
+     return meta_write((char *)table + i * FS_BLOCK_SIZE, start + i);
+ }
+ 
+ static int cow_imap_stage(int inum);
+ 
+ static int imap_set(int inum, int blkno)
+ {
+     imap[inum] = blkno;
+     if (super()->features & FS_FEAT_COW)
+         return cow_imap_stage(inum);
+     return table_stage(imap, super()->imap_start, inum * sizeof(uint32_t));
+ }
+ 
+ static int owner_set(int blkno, int inum, int index)
+ {
+     owners[blkno].inum = inum;
+     owners[blkno].index = index;
+     return table_stage(owners, super()->owner_start,
+                        blkno * sizeof(struct fs_owner));
+ }
+ 
+ static int seg_count(void)
+ {
+     return DIV_ROUND_UP(super()->disk_size, super()->seg_size);
+ }
+ 
+ /* a segment is clean if none of its blocks are in use (or pinned) */
+ static int seg_clean(int seg)
+ {
+     int first = seg * super()->seg_size, last = first + super()->seg_size;
+     if (last > super()->disk_size)
+         last = super()->disk_size;
+     for (int i = first; i < last; i++)
+         if (bit_test(bitmap, i) || bit_test(pinned, i))
+             return 0;
+     return 1;
+ }
+ 
+ static int seg_clean_count(void)
+ {
+     int n = 0;
+     for (int seg = 0; seg < seg_count(); seg++)
+         n += seg_clean(seg);
+     return n;
+ }
+ 
+ static int log_victim = -1;     /* segment being cleaned */
+ 
+ /* next free block at the log head, moving the head to the next clean
+  * segment when the current one is used up. If there are no clean
+  * segments left, fall back to any free block (outside the segment
+  * being cleaned), and have the next write operation clean one first.
+  */
+ static int log_alloc(void)
+ {
+     int seg_size = super()->seg_size, nsegs = seg_count();
+     for (int tries = 0; tries <= nsegs; tries++) {
+         int end = (log_head / seg_size + 1) * seg_size;
+         if (end > super()->disk_size)
+             end = super()->disk_size;
+         for (; log_head < end; log_head++) {
+             int i = log_head;
+             if (!bit_test(bitmap, i) && !bit_test(pinned, i)) {
+                 mark_used(i);
+                 log_head++;
+                 if (meta_write(bitmap, 1) < 0)
+                     return -EIO;
+                 return i;
+             }
+         }
+         int seg = log_head / seg_size, found = -1;
+         for (int j = 1; j <= nsegs && found < 0; j++)
+             if (seg_clean((seg + j) % nsegs))
+                 found = (seg + j) % nsegs;
+         if (found < 0)
+             break;
+         log_head = found * seg_size;
+         if (seg_clean_count() < LOG_CLEAN_LOW)
+             bg_kick(BG_CLEAN);
+     }
+     log_starved = 1;
+     bg_kick(BG_CLEAN);
+     for (int i = 2; i < super()->disk_size; i++) {
+         if (bit_test(bitmap, i) || bit_test(pinned, i) ||
+             i / seg_size == log_victim)
+             continue;
+         mark_used(i);
+         if (meta_write(bitmap, 1) < 0)
+             return -EIO;
+         return i;
+     }
+     return -ENOSPC;
+ }
+ 
+ /* Copy-on-write mode (FS_FEAT_COW). Inode numbers go through the
+  * inode map as in log mode, but blocks are updated in place until a
+  * snapshot is taken. Taking one just records the current inode map
+  * blocks in the snapshot root, stamped with the current epoch, and
+  * starts a new epoch. Each block's birth epoch is kept in the birth
+  * table: a block born no later than the newest snapshot may be shared
+  * with it, so it is never modified - a change goes to a new copy,
+  * which updates the pointer to it (inode, inode map or snapshot root)
+  * - and never freed, just dropped from the live file system.
+  *
+  * Files can also share data blocks with each other (clones). The refs
+  * table counts the extra files using each block; those blocks are
+  * copied on write too, and freeing one just drops a reference.
+  */
+ static char snap_root[FS_BLOCK_SIZE];
+ static uint32_t *births;
+ static uint32_t *refs;
+ static uint32_t snap_epoch;     /* epoch of the newest snapshot, 0 = none */
+ 
+ static int cow_mode(void)
+ {
+     return super()->features & FS_FEAT_COW;
+ }
+ 
+ static struct fs_snap_root *root(void)
+ {
+     return (struct fs_snap_root *)snap_root;
+ }
+ 
+ /* may a snapshot be using block 'blkno'? */
+ static int snap_shared(int blkno)
+ {
+     return cow_mode() && snap_epoch != 0 && births[blkno] <= snap_epoch;
+ }
+ 
+ /* is block 'blkno' shared by more than one file? */
+ static int cloned(int blkno)
+ {
+     return cow_mode() && refs[blkno] > 0;
+ }
+ 
+ static int ref_add(int blkno, int delta)
+ {
+     refs[blkno] += delta;
+     return table_stage(refs, super()->refs_start, blkno * sizeof(uint32_t));
+ }
+ 
+ static int birth_set(int blkno)
+ {
+     births[blkno] = root()->epoch;
+     return table_stage(births, super()->birth_start,
+                        blkno * sizeof(uint32_t));
+ }
+ 
+ /* stage the inode map block holding entry 'inum', copying it first if
+  * a snapshot shares it
+  */
+ static int cow_imap_stage(int inum)
+ {
+     int i = inum * sizeof(uint32_t) / FS_BLOCK_SIZE;
+     int blkno = root()->imap[i];
+     if (snap_shared(blkno)) {
+         int new_blkno = allocate_block(blkno);
+         if (new_blkno < 0)
+             return new_blkno;
+         if (free_block(blkno) < 0)
+             return -EIO;
+         root()->imap[i] = blkno = new_blkno;
+         if (meta_write(snap_root, super()->snap_root) < 0)
+             return -EIO;
+     }
+     return meta_write((char *)imap + i * FS_BLOCK_SIZE, blkno);
+ }
+ 
+ /* load the inode map of the live file system, or of the mounted
+  * snapshot
+  */
+ static int cow_imap_load(void)
+ {
+     uint32_t *ptrs = root()->imap;
+     if (snap_view > 0) {
+         if (snap_view > FS_MAX_SNAPSHOTS ||
+             root()->snaps[snap_view - 1].epoch == 0)
+             return -ENOENT;
+         ptrs = root()->snaps[snap_view - 1].imap;
+     }
+     int len = super()->imap_len;
+     uint32_t *p = realloc(imap, len * FS_BLOCK_SIZE);
+     if (p == NULL)
+         return -ENOMEM;
+     imap = p;
+     for (int i = 0; i < len; i++)
+         if (meta_read((char *)imap + i * FS_BLOCK_SIZE, ptrs[i]) < 0)
+             return -EIO;
+     return 0;
+ }
+ 
+ /* take a snapshot; returns its number (1..FS_MAX_SNAPSHOTS) */
+ static int snapshot_create(void)
+ {
+     struct fs_snap_root *r = root();
+     for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+         if (r->snaps[i].epoch != 0)
+             continue;
+         r->snaps[i].epoch = snap_epoch = r->epoch++;
+         r->snaps[i].ctime = time(NULL);
+         memcpy(r->snaps[i].imap, r->imap, sizeof(r->imap));
+         if (meta_write(snap_root, super()->snap_root) < 0)
+             return -EIO;
+         return i + 1;
+     }
+     return -ENOSPC;
+ }
+ 
+ /* mount snapshot 'id' read-only instead of the live file system (0
+  * for the live one again). Takes effect at the next fs_init.
+  */
+ void fs_mount_snapshot(int id)
+ {
+     snap_view = id;
+ }
+ 
+ /* a block pointer may be flagged as reserved but never written */
+ static int unwritten(uint32_t ptr)
+ {
+     return (ptr & FS_PTR_UNWRITTEN) != 0;
+ }
+ 
+ static int ptr_block(uint32_t ptr)
+ {
+     return ptr & ~FS_PTR_UNWRITTEN;
+ }
+ 
+ /* can a new version of 'blkno' be written in place? Not in log mode
+  * (unless this operation already put it at the log head), nor if a
+  * snapshot or another file may share it.
+  */
+ static int must_relocate(int blkno)
+ {
+     if (log_mode())
+         return !staged(blkno);
+     return snap_shared(blkno) || cloned(blkno);
+ }
+ 
+ /* block holding inode 'inum' */
+ static int inode_block(int inum)
+ {
+     if (!log_mode() && !cow_mode())
+         return inum;
+     if (inum <= 0 || inum >= super()->disk_size || imap[inum] == 0)
+         return -ENOENT;
+     return imap[inum];
+ }
+ 
+ /* allocate a block for block 'index' of file 'inum' (-1 for the
+  * inode), near 'goal' if it's not in log mode
+  */
+ static int alloc_file_block(int inum, int index, int goal)
+ {
+     if (!log_mode())
+         return allocate_block(goal);
+     int blkno = log_alloc();
+     if (blkno < 0)
+         return blkno;
+     if (owner_set(blkno, inum, index) < 0)
+         return -EIO;
+     return blkno;
+ }
+ 
+ /* allocate an inode number for a new file or directory in 'parent'.
+  * With an inode map this also allocates a block for the (empty) inode
+  * - at the log head in log mode. The inode goes next to its parent's,
+  * or for a directory in the emptiest allocation group.
+  */
+ static int alloc_inode(int parent, int is_dir)
+ {
+     int goal = is_dir ? ag_emptiest() : inode_block(parent);
+     if (!log_mode() && !cow_mode())
+         return allocate_block(goal);
+     for (int inum = 3; inum < super()->disk_size; inum++) {
+         if (imap[inum] != 0)
+             continue;
+         int blkno = alloc_file_block(inum, -1, goal);
+         if (blkno < 0)
+             return blkno;
+         struct fs_inode empty;
+         memset(&empty, 0, sizeof(empty));
+         if (meta_write(&empty, blkno) < 0 || imap_set(inum, blkno) < 0)
+             return -EIO;
+         return inum;
+     }
+     return -ENOSPC;
+ }
+ 
+ static int free_inode(int inum)
+ {
+     if (!log_mode() && !cow_mode())
+         return free_block(inum);
+     int blkno = inode_block(inum);
+     if (blkno < 0)
+         return blkno;
+     if (imap_set(inum, 0) < 0)
+         return -EIO;
+     return free_block(blkno);
+ }
  
- static int translate(const char *path);
- static int lookup_parent(const char *path, int *parent_inum, char **leaf);
- static int allocate_block(void);
- static int free_block(int block_num);
+ /* (re)load the metadata we keep in memory: bitmap and, in log mode,
+  * the inode map and owner table, or in COW mode the snapshot root,
+  * birth and refs tables and inode map
+  */
+ static int reload_cached_metadata(void)
+ {
+     if (meta_read(bitmap, 1) < 0)
+         return -EIO;
+     ag_recount();
+     if (log_mode()) {
+         if (table_load((void **)&imap, super()->imap_start,
+                        super()->imap_len) < 0)
+             return -EIO;
+         if (table_load((void **)&owners, super()->owner_start,
+                        super()->owner_len) < 0)
+             return -EIO;
+     }
+     if (cow_mode()) {
+         if (meta_read(snap_root, super()->snap_root) < 0)
+             return -EIO;
+         if (table_load((void **)&births, super()->birth_start,
+                        super()->birth_len) < 0 ||
+             table_load((void **)&refs, super()->refs_start,
+                        super()->refs_len) < 0 || cow_imap_load() < 0)
+             return -EIO;
+         snap_epoch = 0;
+         for (int i = 0; i < FS_MAX_SNAPSHOTS; i++)
+             if (root()->snaps[i].epoch > snap_epoch)
+                 snap_epoch = root()->snaps[i].epoch;
+     }
+     return orphan_load();
+ }
  
  /* A helper for caching the superblock and bitmap */ 
  static int load_fs_metadata() {
-     if (block_read(superblock, 0, 1) < 0)
+     if (disk_read(superblock, 0, 1) < 0)
          return -EIO;
-     if (block_read((char*)bitmap, 1, 1) < 0)
+     if (journal_replay() < 0)
          return -EIO;
-     return 0;
+     return reload_cached_metadata();
  }
  
- /* Helper function to read an inode given its block number (inode number) */ 
+ /* Helper function to read an inode given its inode number */ 
  static int read_inode(int inum, struct fs_inode *inode) {
-     if (inum < 0)
+     int blkno = inode_block(inum);
+     if (blkno < 0)
          return -ENOENT;
-     if (block_read((char *)inode, inum, 1) < 0)
+     if (meta_read(inode, blkno) < 0)
          return -EIO;
      return 0;
  }
  
- /* Helper to write back a modified inode to disk */
+ /* move inode 'inum' to a new block (at the log head in log mode) */
+ static int inode_move(int inum)
+ {
+     int blkno = imap[inum], new_blkno = alloc_file_block(inum, -1, blkno);
+     if (new_blkno < 0)
+         return new_blkno;
+     if (imap_set(inum, new_blkno) < 0 || free_block(blkno) < 0)
+         return -EIO;
+     return new_blkno;
+ }
+ 
+ /* Helper to write back a modified inode to disk. It moves to a new
+  * block if it can't be written in place (see must_relocate).
+  */
  static int write_inode(int inum, struct fs_inode *inode) {
-     if (inum < 0)
+     int blkno = inode_block(inum);
+     if (blkno < 0)
          return -ENOENT;
-     if (block_write((char *)inode, inum, 1) < 0)
+     if (must_relocate(blkno) && (blkno = inode_move(inum)) < 0)
+         return blkno;
+     if (meta_write(inode, blkno) < 0)
+         return -EIO;
+     return 0;
+ }
+ 
+ /* write back the (single) block of directory 'inum'. If it can't be
+  * written in place it moves, which updates the directory inode too.
+  */
+ static int write_dir_block(int inum, struct fs_inode *dir, void *buf)
+ {
+     int blkno = dir->ptrs[0];
+     if (must_relocate(blkno)) {
+         int new_blkno = alloc_file_block(inum, 0, blkno);
+         if (new_blkno < 0)
+             return new_blkno;
+         if (free_block(blkno) < 0)
+             return -EIO;
+         dir->ptrs[0] = blkno = new_blkno;
+         if (write_inode(inum, dir) < 0)
+             return -EIO;
+     }
+     if (meta_write(buf, blkno) < 0)
+         return -EIO;
+     return 0;
+ }
+ 
+ /* Segment cleaner. Moves up to LOG_CLEAN_BATCH live blocks out of
+  * segment 'seg'; returns the number moved, so 0 means it's clean.
+  */
+ static int log_clean_segment(int seg)
+ {
+     int first = seg * super()->seg_size, last = first + super()->seg_size;
+     if (last > super()->disk_size)
+         last = super()->disk_size;
+ 
+     int moved = 0;
+     for (int b = first; b < last && moved < LOG_CLEAN_BATCH; b++) {
+         if (!bit_test(bitmap, b))
+             continue;
+         int inum = owners[b].inum, index = owners[b].index;
+         struct fs_inode inode;
+         if (read_inode(inum, &inode) < 0)
+             continue;
+         if (index < 0) {
+             if (imap[inum] != b)
+                 continue;
+             int new_blkno = inode_move(inum);
+             if (new_blkno < 0)
+                 return new_blkno;
+             if (meta_write(&inode, new_blkno) < 0)
+                 return -EIO;
+         } else {
+             if (ptr_block(inode.ptrs[index]) != b)
+                 continue;
+             char data[FS_BLOCK_SIZE];
+             int new_blkno = alloc_file_block(inum, index, 0);
+             if (new_blkno < 0)
+                 return new_blkno;
+             if (unwritten(inode.ptrs[index])) {
+                 /* reserved by fallocate: nothing to copy */
+             } else if (S_ISDIR(inode.mode)) {
+                 if (meta_read(data, b) < 0 || meta_write(data, new_blkno) < 0)
+                     return -EIO;
+             } else {
+                 if (data_read(data, b, 1) < 0 ||
+                     data_write(data, new_blkno, 1) < 0)
+                     return -EIO;
+             }
+             inode.ptrs[index] = new_blkno | (inode.ptrs[index] & FS_PTR_UNWRITTEN);
+             if (free_block(b) < 0 || write_inode(inum, &inode) < 0)
+                 return -EIO;
+         }
+         moved++;
+     }
+     return moved;
+ }
+ 
+ /* pick the segment with the fewest live blocks, skipping the one the
+  * log is writing to and any holding blocks that can't be moved.
+  */
+ static int log_pick_victim(void)
+ {
+     int best = -1, best_live = super()->seg_size * 3 / 4;
+     for (int seg = 0; seg < seg_count(); seg++) {
+         if (seg == log_head / super()->seg_size)
+             continue;
+         int first = seg * super()->seg_size, live = 0;
+         for (int b = first; b < first + super()->seg_size &&
+                  b < super()->disk_size; b++) {
+             if (!bit_test(bitmap, b))
+                 continue;
+             if (owners[b].inum == 0) {
+                 live = INT32_MAX;
+                 break;
+             }
+             live++;
+         }
+         if (live > 0 && live <= best_live) {
+             best = seg;
+             best_live = live;
+         }
+     }
+     return best;
+ }
+ 
+ /* Background cleaning: clean segments, a batch per transaction,
+  * until there are enough clean ones or nothing more can be done.
+  */
+ static void log_clean(void)
+ {
+     for (;;) {
+         pthread_rwlock_wrlock(&fs_lock);
+         int seg = -1, moved = 0;
+         if (log_mode() && seg_clean_count() < LOG_CLEAN_HIGH)
+             seg = log_pick_victim();
+         if (seg >= 0) {
+             log_victim = seg;
+             moved = log_clean_segment(seg);
+             log_victim = -1;
+         }
+         if (fs_end_write(moved < 0 ? moved : 0) < 0 || moved <= 0)
+             return;
+     }
+ }
+ 
+ /* Foreground cleaning: the log ran out of clean segments, so before
+  * the next write operation looks at anything, clean a whole segment,
+  * still a batch per transaction.
+  */
+ static void log_clean_foreground(void)
+ {
+     log_starved = 0;
+     int seg = log_pick_victim();
+     if (seg < 0)
+         return;
+     log_victim = seg;
+     int moved;
+     while ((moved = log_clean_segment(seg)) > 0 && handle_commit() == 0)
+         ;
+     if (moved < 0)
+         handle_abort();
+     log_victim = -1;
+ }
+ 
+ /* Readahead. Each recently read file has a window: a read that
+  * carries on where the last one stopped doubles it (starting from the
+  * larger of RA_MIN and the read's size, up to RA_MAX blocks), and any
+  * other read halves it, down to 0 (off). While it's open, the
+  * background thread reads the next 'window' blocks past the read into
+  * the buffer cache, so the next request finds them there.
+  */
+ #define RA_MIN   4
+ #define RA_MAX   64
+ #define RA_FILES 16
+ 
+ struct ra_state {
+     int inum;                   /* 0 = unused */
+     int next;                   /* block the next sequential read starts at */
+     int window;
+     int ra_end;                 /* blocks before this already requested */
+     int pf_first, pf_end;       /* range for the background thread */
+ };
+ static struct ra_state ra[RA_FILES];
+ static int ra_clock;            /* round-robin slot replacement */
+ static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+ 
+ /* note a read of blocks [first,end) of 'inum', and queue readahead */
+ static void readahead(int inum, int first, int end)
+ {
+     pthread_mutex_lock(&ra_lock);
+     struct ra_state *r = NULL;
+     for (int i = 0; i < RA_FILES && r == NULL; i++)
+         if (ra[i].inum == inum)
+             r = &ra[i];
+     if (r == NULL) {
+         r = &ra[ra_clock++ % RA_FILES];
+         memset(r, 0, sizeof(*r));
+         r->inum = inum;
+         r->next = -1;
+     }
+     if (first == r->next || (first == r->next - 1 && end > r->next)) {
+         int min = end - first > RA_MIN ? end - first : RA_MIN;
+         r->window = r->window < min ? min : r->window * 2;
+         if (r->window > RA_MAX)
+             r->window = RA_MAX;
+     } else {
+         r->window /= 2;
+     }
+     r->next = end;
+ 
+     int kick = 0;
+     if (r->window > 0) {
+         int from = r->ra_end > end ? r->ra_end : end;
+         if (from < end + r->window) {
+             r->pf_first = from;
+             r->pf_end = r->ra_end = end + r->window;
+             kick = 1;
+         }
+     } else {
+         r->ra_end = 0;
+     }
+     pthread_mutex_unlock(&ra_lock);
+     if (kick)
+         bg_kick(BG_READAHEAD);
+ }
+ 
+ /* background thread: do the queued readahead */
+ static void ra_run(void)
+ {
+     if (mem_over())
+         return;                 /* would only push out cached blocks */
+     char *buf = scratch_alloc(RA_MAX * FS_BLOCK_SIZE);
+     if (buf == NULL)
+         return;
+     for (int i = 0; i < RA_FILES; i++) {
+         pthread_mutex_lock(&ra_lock);
+         int inum = ra[i].inum, first = ra[i].pf_first, end = ra[i].pf_end;
+         ra[i].pf_first = ra[i].pf_end = 0;
+         pthread_mutex_unlock(&ra_lock);
+         if (first >= end)
+             continue;
+ 
+         pthread_rwlock_rdlock(&fs_lock);
+         struct fs_inode inode;
+         if (read_inode(inum, &inode) == 0 && S_ISREG(inode.mode)) {
+             int nblocks = DIV_ROUND_UP(inode.size, FS_BLOCK_SIZE);
+             if (end > nblocks)
+                 end = nblocks;
+             while (first < end) {
+                 int blk = inode.ptrs[first], n = 0;
+                 while (blk != 0 && !unwritten(blk) && first + n < end && n < RA_MAX &&
+                        inode.ptrs[first + n] == blk + n &&
+                        !cache_has(blk + n))
+                     n++;
+                 if (n == 0) {
+                     first++;
+                     continue;
+                 }
+                 if (data_read(buf, blk, n) < 0)
+                     break;
+                 for (int j = 0; j < n; j++)
+                     cache_put(blk + j, buf + j * FS_BLOCK_SIZE);
+                 first += n;
+             }
+         }
+         pthread_rwlock_unlock(&fs_lock);
+     }
+ }
+ 
+ static void ra_reset(void)
+ {
+     pthread_mutex_lock(&ra_lock);
+     memset(ra, 0, sizeof(ra));
+     pthread_mutex_unlock(&ra_lock);
+ }
+ 
+ /* Delayed allocation. fs_write doesn't pick blocks for the holes it
+  * fills (which includes anything appended): the data waits here,
+  * holding a reservation against free space, until it's flushed. By
+  * then each file's dirty range is known, so the file gets contiguous
+  * space however its writes were interleaved with other files'.
+  * Flushes happen on fsync and unmount, in the background once DA_HIGH
+  * blocks are waiting, in fs_write when there's no room left, and
+  * before anything that works on block maps directly (fallocate,
+  * snapshots, clones). Delayed blocks are holes on disk until then.
+  * Log mode doesn't delay: new blocks all go to the log head anyway,
+  * and it needs its free space for cleaning.
+  * Changes are made with fs_lock held exclusive; readers see them with
+  * it shared.
+  */
+ #define DA_MAX  256
+ #define DA_HIGH (DA_MAX / 2)
+ 
+ struct da_block {
+     int inum, index;
+     char *data;
+ };
+ static struct da_block da[DA_MAX];
+ static int da_count;
+ static char da_pool[DA_MAX][FS_BLOCK_SIZE];
+ 
+ static void da_reset(void)
+ {
+     da_count = 0;
+     for (int i = 0; i < DA_MAX; i++)
+         da[i].data = da_pool[i];
+ }
+ 
+ static struct da_block *da_find(int inum, int index)
+ {
+     for (int i = 0; i < da_count; i++)
+         if (da[i].inum == inum && da[i].index == index)
+             return &da[i];
+     return NULL;
+ }
+ 
+ /* copy block 'index' of 'inum' to 'buf' if it's waiting here */
+ static int da_get(int inum, int index, char *buf)
+ {
+     struct da_block *d = da_find(inum, index);
+     if (d != NULL)
+         memcpy(buf, d->data, FS_BLOCK_SIZE);
+     return d != NULL;
+ }
+ 
+ /* the caller has made sure there's room */
+ static void da_put(int inum, int index, const char *buf)
+ {
+     struct da_block *d = da_find(inum, index);
+     if (d == NULL) {
+         d = &da[da_count++];
+         d->inum = inum;
+         d->index = index;
+         if (da_count == DA_HIGH)
+             bg_kick(BG_FLUSH);
+     }
+     memcpy(d->data, buf, FS_BLOCK_SIZE);
+ }
+ 
+ static void da_remove(struct da_block *d)
+ {
+     struct da_block tmp = *d;
+     *d = da[--da_count];
+     da[da_count] = tmp;
+ }
+ 
+ /* copies of the delayed blocks 'first' to 'last' of a file, to put
+  * back if the write changing them fails
+  */
+ struct da_undo {
+     int inum, first, last, n;
+     int index[DA_MAX];
+     char *data;                 /* scratch */
+ };
+ 
+ static int da_save(struct da_undo *u, int inum, int first, int last)
+ {
+     u->inum = inum;
+     u->first = first;
+     u->last = last;
+     u->n = 0;
+     for (int i = 0; i < da_count; i++)
+         if (da[i].inum == inum && da[i].index >= first && da[i].index <= last)
+             u->index[u->n++] = i;
+     if (u->n == 0)
+         return 0;
+     if ((u->data = scratch_alloc(u->n * FS_BLOCK_SIZE)) == NULL)
+         return -ENOMEM;
+     for (int k = 0; k < u->n; k++) {
+         memcpy(u->data + k * FS_BLOCK_SIZE, da[u->index[k]].data, FS_BLOCK_SIZE);
+         u->index[k] = da[u->index[k]].index;
+     }
+     return 0;
+ }
+ 
+ static void da_restore(struct da_undo *u)
+ {
+     for (int i = 0; i < da_count; ) {
+         if (da[i].inum == u->inum && da[i].index >= u->first &&
+             da[i].index <= u->last) {
+             da_remove(&da[i]);
+             continue;
+         }
+         i++;
+     }
+     for (int k = 0; k < u->n; k++)
+         da_put(u->inum, u->index[k], u->data + k * FS_BLOCK_SIZE);
+ }
+ 
+ /* forget the delayed blocks of 'inum' past 'size' bytes. The part of
+  * a block past the end of the file is always zero, as on disk.
+  */
+ static void da_truncate(int inum, off_t size)
+ {
+     int end = DIV_ROUND_UP(size, FS_BLOCK_SIZE), tail = size % FS_BLOCK_SIZE;
+     for (int i = 0; i < da_count; ) {
+         if (da[i].inum == inum && da[i].index >= end) {
+             da_remove(&da[i]);
+             continue;
+         }
+         if (da[i].inum == inum && da[i].index == end - 1 && tail != 0)
+             memset(da[i].data + tail, 0, FS_BLOCK_SIZE - tail);
+         i++;
+     }
+ }
+ 
+ static int da_cmp(const void *a, const void *b)
+ {
+     return (*(struct da_block **)a)->index - (*(struct da_block **)b)->index;
+ }
+ 
+ /* allocate and write the delayed blocks of 'inum', a contiguous run
+  * of the file at a time, each following on from the block before it
+  * on disk. They stay here until the caller drops them, so if the
+  * operation fails (and its changes are undone) nothing is lost.
+  */
+ static int da_write_out(int inum)
+ {
+     struct da_block *blocks[DA_MAX];
+     int n = 0;
+     for (int i = 0; i < da_count; i++)
+         if (da[i].inum == inum)
+             blocks[n++] = &da[i];
+     if (n == 0)
+         return 0;
+     qsort(blocks, n, sizeof(blocks[0]), da_cmp);
+ 
+     struct fs_inode inode;
+     if (read_inode(inum, &inode) < 0)
+         return -EIO;
+     char *buf = scratch_alloc(n * FS_BLOCK_SIZE);
+     if (buf == NULL)
+         return -ENOMEM;
+     int ret = 0;
+     for (int i = 0; i < n && ret == 0; ) {
+         int index = blocks[i]->index, want = 1, got;
+         while (i + want < n && blocks[i + want]->index == index + want)
+             want++;
+         int blk = allocate_run(file_goal(inum, &inode, index), want, &got);
+         if (blk < 0) {
+             ret = blk;
+             break;
+         }
+         for (int j = 0; j < got; j++) {
+             memcpy(buf + j * FS_BLOCK_SIZE, blocks[i + j]->data, FS_BLOCK_SIZE);
+             inode.ptrs[index + j] = blk + j;
+             cache_put(blk + j, blocks[i + j]->data);
+         }
+         if (data_write(buf, blk, got) < 0)
+             ret = -EIO;
+         i += got;
+     }
+     if (ret == 0 && write_inode(inum, &inode) < 0)
+         ret = -EIO;
+     return ret;
+ }
+ 
+ /* flush the delayed blocks of one file */
+ static int da_flush(int inum)
+ {
+     int ret = da_write_out(inum);
+     if (ret == 0)
+         da_truncate(inum, 0);
+     return ret;
+ }
+ 
+ /* ...or of all of them, a file per transaction: DA_MAX blocks' worth
+  * of inodes might not fit in the journal at once
+  */
+ static int da_flush_all(void)
+ {
+     while (da_count > 0) {
+         int inum = da[0].inum, ret = da_write_out(inum);
+         if (ret == 0)
+             ret = handle_commit();
+         if (ret < 0)
+             return ret;
+         da_truncate(inum, 0);
+     }
+     return 0;
+ }
+ 
+ /* flush everything as an operation of its own. (Not through
+  * fs_begin_write: this is also how a snapshot mount starts, and the
+  * delayed writes belong to the live file system.)
+  */
+ static int da_sync(void)
+ {
+     pthread_rwlock_wrlock(&fs_lock);
+     if (da_count == 0)
+         return fs_end_read(0);
+     return fs_end_write(da_flush_all());
+ }
+ 
+ /* Deferred freeing. Removing a big file doesn't free its blocks on the
+  * spot: the transaction that unlinks it puts the inode on the orphan
+  * list instead, and the background thread frees ORPHAN_BATCH blocks
+  * per transaction (recording how far it got) and then the inode. A
+  * big truncate moves the pointers it drops to a new, nameless inode
+  * and orphans that. The list is in a block reserved along with the
+  * journal, so images without one (and COW images, where a snapshot may
+  * hold on to the blocks anyway) free everything as before. After a
+  * crash, mounting picks up where the background thread left off.
+  * Orphaned blocks count as free, in statfs until the transaction
+  * freeing them commits; if a write operation might need them, it
+  * finishes the job first.
+  */
+ #define ORPHAN_MIN   64         /* smaller files are freed on the spot */
+ #define ORPHAN_BATCH 64         /* blocks freed per transaction */
+ 
+ static struct fs_orphans *orphans;      /* NULL if the image has no list */
+ static int orphan_blocks;               /* blocks it still holds, inodes too */
+ static char orphan_buf[FS_BLOCK_SIZE];
+ 
+ /* (re)load the list and count its blocks */
+ static int orphan_load(void)
+ {
+     orphans = NULL;
+     orphan_blocks = 0;
+     if (super()->orphans == 0)
+         return 0;
+     if (meta_read(orphan_buf, super()->orphans) < 0)
+         return -EIO;
+     orphans = (struct fs_orphans *)orphan_buf;
+     for (int i = 0; i < orphans->count; i++) {
+         struct fs_inode inode;
+         if (read_inode(orphans->list[i].inum, &inode) < 0)
+             return -EIO;
+         orphan_blocks++;
+         for (int j = 0; j < orphans->list[i].next; j++)
+             if (inode.ptrs[j] != 0)
+                 orphan_blocks++;
+     }
+     return 0;
+ }
+ 
+ /* should 'nblocks' blocks be freed in the background? */
+ static int orphan_defer(int nblocks)
+ {
+     return orphans != NULL && !cow_mode() && nblocks >= ORPHAN_MIN &&
+         orphans->count < FS_MAX_ORPHANS;
+ }
+ 
+ /* put inode 'inum', holding 'nblocks' blocks, on the list */
+ static int orphan_add(int inum, int nblocks)
+ {
+     struct fs_orphan *o = &orphans->list[orphans->count++];
+     o->inum = inum;
+     o->next = MAX_FILE_BLOCKS;
+     orphan_blocks += nblocks + 1;
+     if (meta_write(orphans, super()->orphans) < 0)
          return -EIO;
+     bg_kick(BG_RECLAIM);
+     return 0;
+ }
+ 
+ /* move blocks 'first' on of file 'inum' to a new inode, and orphan it */
+ static int orphan_split(int inum, struct fs_inode *inode, int first,
+                         int nblocks)
+ {
+     int holder = alloc_inode(inum, 0);
+     if (holder < 0)
+         return holder;
+     struct fs_inode h;
+     memset(&h, 0, sizeof(h));
+     h.mode = S_IFREG;
+     for (int i = first; i < MAX_FILE_BLOCKS; i++) {
+         if (inode->ptrs[i] == 0)
+             continue;
+         if (log_mode() && owner_set(ptr_block(inode->ptrs[i]), holder, i) < 0)
+             return -EIO;
+         h.ptrs[i] = inode->ptrs[i];
+         inode->ptrs[i] = 0;
+     }
+     if (write_inode(holder, &h) < 0)
+         return -EIO;
+     return orphan_add(holder, nblocks);
+ }
+ 
+ /* orphaned block 'blkno' has been freed: if it's pinned until the
+  * transaction commits, statfs still counts it
+  */
+ static void reclaim_pinned(int blkno)
+ {
+     pthread_mutex_lock(&j_lock);
+     if (bit_test(pinned, blkno) && !bit_test(reclaimed, blkno)) {
+         bit_set(reclaimed, blkno);
+         nreclaimed++;
+     }
+     pthread_mutex_unlock(&j_lock);
+ }
+ 
+ /* free up to 'max' orphaned blocks, newest orphan first */
+ static int orphan_reclaim(int max)
+ {
+     while (orphans != NULL && orphans->count > 0 && max > 0) {
+         struct fs_orphan *o = &orphans->list[orphans->count - 1];
+         struct fs_inode inode;
+         if (read_inode(o->inum, &inode) < 0)
+             return -EIO;
+         for (; o->next > 0 && max > 0; o->next--) {
+             uint32_t ptr = inode.ptrs[o->next - 1];
+             if (ptr == 0)
+                 continue;
+             if (free_block(ptr_block(ptr)) < 0)
+                 return -EIO;
+             reclaim_pinned(ptr_block(ptr));
+             orphan_blocks--;
+             max--;
+         }
+         if (o->next == 0) {
+             int blkno = inode_block(o->inum);
+             if (blkno < 0 || free_inode(o->inum) < 0)
+                 return -EIO;
+             reclaim_pinned(blkno);
+             orphan_blocks--;
+             orphans->count--;
+         }
+         if (meta_write(orphans, super()->orphans) < 0)
+             return -EIO;
+     }
      return 0;
  }
  
+ /* background: a batch per transaction until the list is empty */
+ static void orphan_bg(void)
+ {
+     for (;;) {
+         pthread_rwlock_wrlock(&fs_lock);
+         if (orphans == NULL || orphans->count == 0) {
+             fs_end_read(0);
+             return;
+         }
+         if (fs_end_write(orphan_reclaim(ORPHAN_BATCH)) < 0)
+             return;
+     }
+ }
+ 
+ /* called as a write operation starts: if the free blocks alone might
+  * not be enough, free the rest as a transaction of its own (so they
+  * can be reused straight away)
+  */
+ static void orphan_foreground(void)
+ {
+     if (orphan_blocks == 0 || orphan_blocks <= free_blocks() - da_count)
+         return;
+     fs_end_write(orphan_reclaim(INT_MAX));
+     pthread_rwlock_wrlock(&fs_lock);
+ }
+ 
+ /* free everything now, for a write that ran out of space; returns 1
+  * if there was anything to free
+  */
+ static int orphan_flush(void)
+ {
+     pthread_rwlock_wrlock(&fs_lock);
+     if (orphans == NULL || orphans->count == 0)
+         return fs_end_read(0);
+     int ret = fs_end_write(orphan_reclaim(INT_MAX));
+     return ret < 0 ? ret : 1;
+ }
+ 
+ /* Background work (segment cleaning, readahead, flushing, freeing
+  * orphans) is done by a helper thread, started by fs_init and stopped
+  * by fs_destroy.
+  */
+ static pthread_t bg_thread;
+ static int bg_running, bg_stop, bg_kicked;
+ static pthread_mutex_t bg_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t bg_cond = PTHREAD_COND_INITIALIZER;
+ 
+ static void bg_kick(int work)
+ {
+     pthread_mutex_lock(&bg_lock);
+     bg_kicked |= work;
+     pthread_cond_signal(&bg_cond);
+     pthread_mutex_unlock(&bg_lock);
+ }
+ 
+ static void *bg_main(void *arg)
+ {
+     pthread_mutex_lock(&bg_lock);
+     while (!bg_stop) {
+         if (!bg_kicked) {
+             pthread_cond_wait(&bg_cond, &bg_lock);
+             continue;
+         }
+         int work = bg_kicked;
+         bg_kicked = 0;
+         pthread_mutex_unlock(&bg_lock);
+         if (work & BG_READAHEAD)
+             ra_run();
+         if (work & BG_CLEAN)
+             log_clean();
+         if (work & BG_FLUSH)
+             da_sync();
+         if (work & BG_RECLAIM)
+             orphan_bg();
+         scratch_reset();
+         if (mem_over())
+             mem_reclaim();
+         pthread_mutex_lock(&bg_lock);
+     }
+     pthread_mutex_unlock(&bg_lock);
+     return NULL;
+ }
+ 
+ static void bg_start(void)
+ {
+     bg_stop = bg_kicked = 0;
+     if (pthread_create(&bg_thread, NULL, bg_main, NULL) == 0)
+         bg_running = 1;
+ }
+ 
+ static void bg_shutdown(void)
+ {
+     if (!bg_running)
+         return;
+     pthread_mutex_lock(&bg_lock);
+     bg_stop = 1;
+     pthread_cond_signal(&bg_cond);
+     pthread_mutex_unlock(&bg_lock);
+     pthread_join(bg_thread, NULL);
+     bg_running = 0;
+ }
+ 
  /* if you don't understand why you can't use these system calls here, 
   * you need to read the assignment description another time
   */
@@ -100,13 +2889,66 @@
   */
  void* fs_init(struct fuse_conn_info *conn)
  {
+     bg_shutdown();
+     da_sync();                  /* remounting without fs_destroy */
+     txn_reset(&handle);
+     txn_reset(&running);
+     txn_reset(&committing);
+     committing_active = 0;
+     running_seq = 1;
+     committed_seq = 0;
+     failed_seq = 0;
+     commit_err = 0;
+     memset(pinned, 0, sizeof(pinned));
+     memset(reclaimed, 0, sizeof(reclaimed));
+     nreclaimed = 0;
+     if (image_file == NULL) {
+         fprintf(stderr, "No image file given (fs_set_image)\n");
+         exit(1);
+     }
+     if (block_flush_init() < 0) {
+         fprintf(stderr, "Cannot open image file '%s' to flush it: %s\n",
+                 image_file, strerror(errno));
+         exit(1);
+     }
      if (load_fs_metadata() < 0) {
          fprintf(stderr, "Failed to load file system metadata\n");
          exit(1);
      }
+     if (snap_view > 0 && !cow_mode()) {
+         fprintf(stderr, "Image has no snapshots\n");
+         exit(1);
+     }
+     if (journal_capacity() > 0 && journal_capacity() < journal_needed())
+         fprintf(stderr, "Journal holds %d blocks, operations may need %d: "
+                 "those fail with ENOSPC\n", journal_capacity(), journal_needed());
+     if (log_mode()) {
+         log_head = 0;
+         for (int seg = 0; seg < seg_count(); seg++)
+             if (seg_clean(seg)) {
+                 log_head = seg * super()->seg_size;
+                 break;
+             }
+     }
+     cache_clear();
+     ra_reset();
+     da_reset();
+     scratch_reset();            /* journal replay */
+     bg_start();
+     if (orphans != NULL && orphans->count > 0)
+         bg_kick(BG_RECLAIM);    /* finish what a crash interrupted */
      return NULL;
  }
  
+ /* destroy - called by FUSE at unmount. Flushes delayed writes and
+  * stops background work.
+  */
+ void fs_destroy(void *private_data)
+ {
+     da_sync();
+     bg_shutdown();
+ }
+ 
  /* Note on path translation errors:
   * In addition to the method-specific errors listed below, almost
   * every method can return one of the following errors if it fails to
@@ -117,16 +2959,10 @@
   *           /a/b/c) is not a directory
   */
  
- /* note on splitting the 'path' variable:
-  * the value passed in by the FUSE framework is declared as 'const',
-  * which means you can't modify it. The standard mechanisms for
-  * splitting strings in C (strtok, strsep) modify the string in place,
-  * so you have to copy the string and then free the copy when you're
-  * done. One way of doing this:
-  *
-  *    char *_path = strdup(path);
-  *    int inum = translate(_path);
-  *    free(_path);
+ /* note on the 'path' variable:
+  * the value passed in by the FUSE framework is declared as 'const'.
+  * path_walk scans it in place, component by component, rather than
+  * copying it and splitting the copy with strtok.
   */
  
  
@@ -144,7 +2980,21 @@
   * hint - factor out inode-to-struct stat conversion - you'll use it
   *        again in readdir
   */
- int fs_getattr(const char *path, struct stat *sb)
+ 
+ /* the blocks a file holds, for st_blocks: allocated ones (unwritten
+  * ones too, as ext4 counts them) and delayed ones that will be
+  */
+ static int file_blocks(int inum, struct fs_inode *inode)
+ {
+     int n = 0;
+     for (int i = 0; i < MAX_FILE_BLOCKS; i++)
+         n += inode->ptrs[i] != 0;
+     for (int i = 0; i < da_count; i++)
+         n += da[i].inum == inum && inode->ptrs[da[i].index] == 0;
+     return n;
+ }
+ 
+ static int do_getattr(const char *path, struct stat *sb)
  {
      int inum = translate(path);
      if (inum < 0)
@@ -163,9 +3013,17 @@
      sb->st_mtime = inode.mtime;
      sb->st_atime = inode.mtime;
      sb->st_ctime = inode.mtime;
-     sb->st_blocks = (inode.size + FS_BLOCK_SIZE) / FS_BLOCK_SIZE;
+     sb->st_blocks = file_blocks(inum, &inode) * (FS_BLOCK_SIZE / 512);
      return 0;
  }
+
+ int fs_getattr(const char *path, struct stat *sb)
+ {
+     if (stats_path(path))
+         return stats_getattr(path, sb);
+     fs_begin_read();
+     return fs_end_read(do_getattr(path, sb));
+ }
  
  /* readdir - get directory contents.
   *
@@ -179,7 +3037,7 @@
   * hint - check the testing instructions if you don't understand how
   *        to call the filler function
   */
- int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
+ static int do_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
                 off_t offset, struct fuse_file_info *fi)
  {
      int inum = translate(path);
@@ -194,7 +3052,7 @@
          return -ENOTDIR;
      
      char dir_block[FS_BLOCK_SIZE];
-     if (block_read(dir_block, inode.ptrs[0], 1) < 0)
+     if (meta_read(dir_block, inode.ptrs[0]) < 0)
          return -EIO;
      
      for (int i = 0; i < 128; i++) {
@@ -219,6 +3077,23 @@
      }
      return 0;
  }
+
+ int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
+                off_t offset, struct fuse_file_info *fi)
+ {
+     if (stats_path(path)) {
+         struct stat sb;
+         if (strcmp(path, STATS_DIR) != 0)
+             return stats_getattr(path, &sb) < 0 ? -ENOENT : -ENOTDIR;
+         stats_getattr(STATS_FILE, &sb);
+         filler(ptr, "stats", &sb, 0);
+         stats_getattr(TRACE_FILE, &sb);
+         filler(ptr, "trace", &sb, 0);
+         return 0;
+     }
+     fs_begin_read();
+     return fs_end_read(do_readdir(path, ptr, filler, offset, fi));
+ }
  
  /* create - create a new file with specified permissions
   *
@@ -234,43 +3109,25 @@
   * If there are already 128 entries in the directory (i.e. it's filled an
   * entire block), you are free to return -ENOSPC instead of expanding it.
   */
- int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+ static int do_create(const char *path, mode_t mode, struct fuse_file_info *fi)
  {
      int parent_inum;
-     char *leaf;
-     int ret = lookup_parent(path, &parent_inum, &leaf);
-     if (ret < 0)
-         return ret;
+     char leaf[MAX_NAME_LEN + 1];
+     int inum = lookup_parent(path, &parent_inum, leaf);
+     if (parent_inum < 0 || inum != -ENOENT)
+         return inum < 0 ? inum : -EEXIST;
      
      struct fs_inode parent_inode;
-     if (read_inode(parent_inum, &parent_inode) < 0) {
-         free(leaf);
+     if (read_inode(parent_inum, &parent_inode) < 0)
          return -EIO;
-     }
-     if ((parent_inode.mode & S_IFMT) != S_IFDIR) {
-         free(leaf);
-         return -ENOTDIR;
-     }
      
      char dir_block[FS_BLOCK_SIZE];
-     if (block_read(dir_block, parent_inode.ptrs[0], 1) < 0) {
-         free(leaf);
+     if (meta_read(dir_block, parent_inode.ptrs[0]) < 0)
          return -EIO;
-     }
-     
-     for (int i = 0; i < 128; i++) {
-         struct fs_dirent *d = (struct fs_dirent *)(dir_block + i*32);
-         if (d->valid && strcmp(d->name, leaf) == 0) {
-             free(leaf);
-             return -EEXIST;
-         }
-     }
      
-     int new_inum = allocate_block();
-     if (new_inum < 0) {
-         free(leaf);
+     int new_inum = alloc_inode(parent_inum, 0);
+     if (new_inum < 0)
          return new_inum;
-     }
      
      struct fs_inode new_inode;
      new_inode.uid = fuse_get_context()->uid;
@@ -281,10 +3138,9 @@
      new_inode.size = 0;
      memset(new_inode.ptrs, 0, sizeof(new_inode.ptrs));
      
-     if (write_inode(new_inum, &new_inode) < 0) {
-         free(leaf);
+     if (write_inode(new_inum, &new_inode) < 0)
          return -EIO;
-     }
+     op_inum = new_inum;
      
      int added = 0;
      for (int i = 0; i < 128; i++) {
@@ -298,15 +3154,22 @@
              break;
          }
      }
-     free(leaf);
      if (!added)
          return -ENOSPC;
      
-     if (block_write(dir_block, parent_inode.ptrs[0], 1) < 0)
+     if (write_dir_block(parent_inum, &parent_inode, dir_block) < 0)
          return -EIO;
      
      return 0;
  }
+
+ int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+ {
+     op_args(0, 0, mode);
+     if (fs_begin_write() < 0)
+         return -EROFS;
+     return fs_end_write(do_create(path, mode, fi));
+ }
  
  /* mkdir - create a directory with the given mode.
   *
@@ -317,43 +3180,25 @@
   * Errors - path resolution, EEXIST
   * Conditions for EEXIST are the same as for create. 
   */ 
- int fs_mkdir(const char *path, mode_t mode)
+ static int do_mkdir(const char *path, mode_t mode)
  {
      int parent_inum;
-     char *leaf;
-     int ret = lookup_parent(path, &parent_inum, &leaf);
-     if (ret < 0)
-         return ret;
+     char leaf[MAX_NAME_LEN + 1];
+     int inum = lookup_parent(path, &parent_inum, leaf);
+     if (parent_inum < 0 || inum != -ENOENT)
+         return inum < 0 ? inum : -EEXIST;
      
      struct fs_inode parent_inode;
-     if (read_inode(parent_inum, &parent_inode) < 0) {
-         free(leaf);
+     if (read_inode(parent_inum, &parent_inode) < 0)
          return -EIO;
-     }
-     if ((parent_inode.mode & S_IFMT) != S_IFDIR) {
-         free(leaf);
-         return -ENOTDIR;
-     }
      
      char dir_block[FS_BLOCK_SIZE];
-     if (block_read(dir_block, parent_inode.ptrs[0], 1) < 0) {
-         free(leaf);
+     if (meta_read(dir_block, parent_inode.ptrs[0]) < 0)
          return -EIO;
-     }
      
-     for (int i = 0; i < 128; i++) {
-         struct fs_dirent *d = (struct fs_dirent *)(dir_block + i*32);
-         if (d->valid && strcmp(d->name, leaf) == 0) {
-             free(leaf);
-             return -EEXIST;
-         }
-     }
-     
-     int new_inum = allocate_block();
-     if (new_inum < 0) {
-         free(leaf);
+     int new_inum = alloc_inode(parent_inum, 1);
+     if (new_inum < 0)
          return new_inum;
-     }
      struct fs_inode new_inode;
      new_inode.uid = fuse_get_context()->uid;
      new_inode.gid = fuse_get_context()->gid;
@@ -363,20 +3208,19 @@
      new_inode.size = FS_BLOCK_SIZE;
      memset(new_inode.ptrs, 0, sizeof(new_inode.ptrs));
      
-     int dblk = allocate_block();
-     if (dblk < 0) {
-         free(leaf);
+     int dblk = alloc_file_block(new_inum, 0, file_goal(new_inum, &new_inode, 0));
+     if (dblk < 0)
          return dblk;
-     }
      new_inode.ptrs[0] = dblk;
      
      char empty_block[FS_BLOCK_SIZE];
      memset(empty_block, 0, FS_BLOCK_SIZE);
-     if (block_write(empty_block, dblk, 1) < 0)
+     if (meta_write(empty_block, dblk) < 0)
          return -EIO;
      
      if (write_inode(new_inum, &new_inode) < 0)
          return -EIO;
+     op_inum = new_inum;
      
      int added = 0;
      for (int i = 0; i < 128; i++) {
@@ -390,45 +3234,68 @@
              break;
          }
      }
-     free(leaf);
      if (!added)
          return -ENOSPC;
      
-     if (block_write(dir_block, parent_inode.ptrs[0], 1) < 0)
+     if (write_dir_block(parent_inum, &parent_inode, dir_block) < 0)
          return -EIO;
      
      return 0;
  }
+
+ int fs_mkdir(const char *path, mode_t mode)
+ {
+     op_args(0, 0, mode);
+     if (fs_begin_write() < 0)
+         return -EROFS;
+     return fs_end_write(do_mkdir(path, mode));
+ }
  
  
+ /* free a file that's no longer in any directory: its inode and blocks
+  * (including any fallocate reserved past the end), in the background
+  * if there are a lot of them (see orphan_defer), and its delayed writes
+  */
+ static int release_file(int inum, struct fs_inode *inode)
+ {
+     int nblocks = 0;
+     for (int i = 0; i < MAX_FILE_BLOCKS; i++)
+         if (inode->ptrs[i] != 0)
+             nblocks++;
+     if (orphan_defer(nblocks)) {
+         if (orphan_add(inum, nblocks) < 0)
+             return -EIO;
+     } else {
+         if (free_inode(inum) < 0)
+             return -EIO;
+         for (int i = 0; i < MAX_FILE_BLOCKS; i++) {
+             if (inode->ptrs[i] != 0 && free_block(ptr_block(inode->ptrs[i])) < 0)
+                 return -EIO;
+         }
+     }
+     da_truncate(inum, 0);
+     return 0;
+ }
+
  /* unlink - delete a file
   *  success - return 0
   *  errors - path resolution, ENOENT, EISDIR
   */
- int fs_unlink(const char *path)
+ static int do_unlink(const char *path)
  {
      int parent_inum;
-     char *leaf;
-     int ret = lookup_parent(path, &parent_inum, &leaf);
-     if (ret < 0)
-         return ret;
+     char leaf[MAX_NAME_LEN + 1];
+     int inum = lookup_parent(path, &parent_inum, leaf);
+     if (inum < 0)
+         return inum;
      
      struct fs_inode parent_inode;
-     if (read_inode(parent_inum, &parent_inode) < 0) {
-         free(leaf);
+     if (read_inode(parent_inum, &parent_inode) < 0)
          return -EIO;
-     }
-
-     if ((parent_inode.mode & S_IFMT) != S_IFDIR) {
-        free(leaf);
-        return -ENOTDIR;
-    }
      
      char dir_block[FS_BLOCK_SIZE];
-     if (block_read(dir_block, parent_inode.ptrs[0], 1) < 0) {
-         free(leaf);
+     if (meta_read(dir_block, parent_inode.ptrs[0]) < 0)
          return -EIO;
-     }
      
      int entry_index = -1;
      for (int i = 0; i < 128; i++) {
@@ -438,65 +3305,49 @@
              break;
          }
      }
-     if (entry_index == -1) {
-         free(leaf);
+     if (entry_index == -1)
          return -ENOENT;
-     }
      
      struct fs_inode file_inode;
      struct fs_dirent *entry = (struct fs_dirent *)(dir_block + entry_index*32);
-     if (read_inode(entry->inode, &file_inode) < 0) {
-         free(leaf);
+     if (read_inode(entry->inode, &file_inode) < 0)
          return -EIO;
-     }
-     if ((file_inode.mode & S_IFMT) == S_IFDIR) {
-         free(leaf);
+     if ((file_inode.mode & S_IFMT) == S_IFDIR)
          return -EISDIR;
-     }
      
      ((struct fs_dirent *)(dir_block + entry_index*32))->valid = 0;
-     if (block_write(dir_block, parent_inode.ptrs[0], 1) < 0) {
-         free(leaf);
+     if (write_dir_block(parent_inum, &parent_inode, dir_block) < 0)
          return -EIO;
-     }
      
-     free_block(entry->inode);
-     int nblocks = (file_inode.size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
-     for (int i = 0; i < nblocks; i++) {
-         free_block(file_inode.ptrs[i]);
-     }
-     free(leaf);
-     return 0;
+     return release_file(entry->inode, &file_inode);
+ }
+
+ int fs_unlink(const char *path)
+ {
+     if (fs_begin_write() < 0)
+         return -EROFS;
+     return fs_end_write(do_unlink(path));
  }
  
  /* rmdir - remove a directory
   *  success - return 0
   *  Errors - path resolution, ENOENT, ENOTDIR, ENOTEMPTY
   */
- int fs_rmdir(const char *path)
+ static int do_rmdir(const char *path)
  {
      int parent_inum;
-     char *leaf;
-     int ret = lookup_parent(path, &parent_inum, &leaf);
-     if (ret < 0)
-         return ret;
+     char leaf[MAX_NAME_LEN + 1];
+     int inum = lookup_parent(path, &parent_inum, leaf);
+     if (inum < 0)
+         return inum;
      
      struct fs_inode parent_inode;
-     if (read_inode(parent_inum, &parent_inode) < 0) {
-         free(leaf);
+     if (read_inode(parent_inum, &parent_inode) < 0)
          return -EIO;
-     }
-     
-     if ((parent_inode.mode & S_IFMT) != S_IFDIR) {
-        free(leaf);
-        return -ENOTDIR;
-    }
 
      char dir_block[FS_BLOCK_SIZE];
-     if (block_read(dir_block, parent_inode.ptrs[0], 1) < 0) {
-         free(leaf);
+     if (meta_read(dir_block, parent_inode.ptrs[0]) < 0)
          return -EIO;
-     }
      
      int entry_index = -1;
      for (int i = 0; i < 128; i++) {
@@ -506,142 +3357,400 @@
              break;
          }
      }
-     if (entry_index == -1) {
-         free(leaf);
+     if (entry_index == -1)
          return -ENOENT;
-     }
      
      struct fs_inode dir_inode;
      struct fs_dirent *entry = (struct fs_dirent *)(dir_block + entry_index*32);
-     if (read_inode(entry->inode, &dir_inode) < 0) {
-         free(leaf);
+     if (read_inode(entry->inode, &dir_inode) < 0)
          return -EIO;
-     }
-     if ((dir_inode.mode & S_IFMT) != S_IFDIR) {
-         free(leaf);
+     if ((dir_inode.mode & S_IFMT) != S_IFDIR)
          return -ENOTDIR;
-     }
      
      char dblock[FS_BLOCK_SIZE];
-     if (block_read(dblock, dir_inode.ptrs[0], 1) < 0) {
-         free(leaf);
+     if (meta_read(dblock, dir_inode.ptrs[0]) < 0)
          return -EIO;
-     }
      for (int i = 0; i < 128; i++) {
          struct fs_dirent *d = (struct fs_dirent *)(dblock + i*32);
-         if (d->valid) {
-             free(leaf);
+         if (d->valid)
              return -ENOTEMPTY;
-         }
      }
      
      ((struct fs_dirent *)(dir_block + entry_index*32))->valid = 0;
-     if (block_write(dir_block, parent_inode.ptrs[0], 1) < 0) {
-         free(leaf);
+     if (write_dir_block(parent_inum, &parent_inode, dir_block) < 0)
          return -EIO;
-     }
      
-     free_block(entry->inode);
-     free_block(dir_inode.ptrs[0]);
-     free(leaf);
+     if (free_inode(entry->inode) < 0 || free_block(dir_inode.ptrs[0]) < 0)
+         return -EIO;
      return 0;
  }
+
+ int fs_rmdir(const char *path)
+ {
+     if (fs_begin_write() < 0)
+         return -EROFS;
+     return fs_end_write(do_rmdir(path));
+ }
  
- /* rename - rename a file or directory
+ /* entry 'leaf' in a directory block, or NULL */
+ static struct fs_dirent *dir_find(char *dir_block, const char *leaf)
+ {
+     for (int i = 0; i < 128; i++) {
+         struct fs_dirent *d = (struct fs_dirent *)(dir_block + i*32);
+         if (d->valid && strcmp(d->name, leaf) == 0)
+             return d;
+     }
+     return NULL;
+ }
+
+ /* 1 if directory 'inum' is empty, 0 if not */
+ static int dir_empty(int inum)
+ {
+     struct fs_inode dir;
+     char block[FS_BLOCK_SIZE];
+     if (read_inode(inum, &dir) < 0 || meta_read(block, dir.ptrs[0]) < 0)
+         return -EIO;
+     for (int i = 0; i < 128; i++)
+         if (((struct fs_dirent *)(block + i*32))->valid)
+             return 0;
+     return 1;
+ }
+
+ /* move entry 'src_leaf' of directory 'src_parent' to 'dst_leaf' in
+  * 'dst_parent', replacing what's there
+  */
+ static int move_entry(int src_parent, const char *src_leaf,
+                       int dst_parent, const char *dst_leaf)
+ {
+     struct fs_inode sdir, ddir, src, dst;
+     char sblock[FS_BLOCK_SIZE], dblock[FS_BLOCK_SIZE];
+     if (read_inode(src_parent, &sdir) < 0 || read_inode(dst_parent, &ddir) < 0)
+         return -EIO;
+     if (!S_ISDIR(sdir.mode) || !S_ISDIR(ddir.mode))
+         return -ENOTDIR;
+     int same_dir = src_parent == dst_parent;
+     if (meta_read(sblock, sdir.ptrs[0]) < 0 ||
+         (!same_dir && meta_read(dblock, ddir.ptrs[0]) < 0))
+         return -EIO;
+     char *dst_block = same_dir ? sblock : dblock;
+     
+     struct fs_dirent *s = dir_find(sblock, src_leaf);
+     struct fs_dirent *d = dir_find(dst_block, dst_leaf);
+     if (s == NULL)
+         return -ENOENT;
+     if (s == d)
+         return 0;
+     if (read_inode(s->inode, &src) < 0)
+         return -EIO;
+     
+     int old = 0;
+     if (d != NULL) {
+         old = d->inode;
+         if (read_inode(old, &dst) < 0)
+             return -EIO;
+         if (S_ISDIR(src.mode) && !S_ISDIR(dst.mode))
+             return -ENOTDIR;
+         if (!S_ISDIR(src.mode) && S_ISDIR(dst.mode))
+             return -EISDIR;
+         int empty = S_ISDIR(dst.mode) ? dir_empty(old) : 1;
+         if (empty <= 0)
+             return empty < 0 ? empty : -ENOTEMPTY;
+     } else if (same_dir) {
+         d = s;                  /* just rename the entry */
+     } else {
+         for (int i = 0; i < 128 && d == NULL; i++)
+             if (!((struct fs_dirent *)(dblock + i*32))->valid)
+                 d = (struct fs_dirent *)(dblock + i*32);
+         if (d == NULL)
+             return -ENOSPC;
+     }
+     
+     int inum = s->inode;
+     d->valid = 1;
+     d->inode = inum;
+     strncpy(d->name, dst_leaf, MAX_NAME_LEN);
+     d->name[MAX_NAME_LEN] = '\0';
+     if (!same_dir) {
+         if (write_dir_block(dst_parent, &ddir, dblock) < 0 ||
+             handle_write_home() < 0)
+             return -EIO;
+     }
+     if (s != d)
+         s->valid = 0;
+     if (write_dir_block(src_parent, &sdir, sblock) < 0)
+         return -EIO;
+     
+     if (old == 0)
+         return 0;
+     if (!S_ISDIR(dst.mode))
+         return release_file(old, &dst);
+     if (free_inode(old) < 0 || free_block(dst.ptrs[0]) < 0)
+         return -EIO;
+     return 0;
+ }
+
+ /* rename - rename a file or directory, possibly to another directory
   * success - return 0
-  * Errors - path resolution, ENOENT, EINVAL, EEXIST
+  * Errors - path resolution, ENOENT, ENOTDIR, EISDIR, ENOTEMPTY,
+  *   EINVAL, ENOSPC
   *
   * ENOENT - source does not exist
-  * EEXIST - destination already exists
-  * EINVAL - source and destination are not in the same directory
+  * ENOTDIR - source is a directory and destination a file
+  * EISDIR - source is a file and destination a directory
+  * ENOTEMPTY - destination is a directory that isn't empty
+  * EINVAL - destination is inside the source directory
+  * ENOSPC - destination directory is full
   *
-  * Note that this is a simplified version of the UNIX rename
-  * functionality - see 'man 2 rename' for full semantics. In
-  * particular, the full version can move across directories, replace a
-  * destination file, and replace an empty directory with a full one.
+  * An existing destination is replaced. Only directory entries change:
+  * the inode and its blocks stay where they are. Moving to another
+  * directory adds the new entry before removing the old one (on an
+  * image without a journal, it reaches the disk first) so a crash
+  * can't lose the file.
   */
- int fs_rename(const char *src_path, const char *dst_path)
+ static int do_rename(const char *src_path, const char *dst_path)
  {
-     int src_parent;
-     char *src_leaf;
-     int ret = lookup_parent(src_path, &src_parent, &src_leaf);
-     if (ret < 0)
+     int src_parent, dst_parent;
+     char src_leaf[MAX_NAME_LEN + 1], dst_leaf[MAX_NAME_LEN + 1];
+     int ret = lookup_parent(src_path, &src_parent, src_leaf);
+     if (src_parent < 0)
          return ret;
+     /* moving a directory below itself: caught by inode, not by name,
+      * since different strings ("/a", "//a/") can name the same one */
+     ret = path_walk(dst_path, &dst_parent, dst_leaf, ret >= 0 ? ret : -1);
+     if (dst_parent < 0)
+         return ret < 0 ? ret : -EINVAL;
+     return move_entry(src_parent, src_leaf, dst_parent, dst_leaf);
+ }
+
+ int fs_rename(const char *src_path, const char *dst_path)
+ {
+     if (fs_begin_write() < 0)
+         return -EROFS;
+     return fs_end_write(do_rename(src_path, dst_path));
+ }
+ 
+ /* chmod - change file permissions
+  * utime - change access and modification times
+  *         (for definition of 'struct utimebuf', see 'man utime')
+  *
+  * success - return 0
+  * Errors - path resolution, ENOENT.
+  */
+ static int do_chmod(const char *path, mode_t mode)
+ {
+     int inum = translate(path);
+     if (inum < 0)
+         return inum;
      
-     int dst_parent;
-     char *dst_leaf;
-     ret = lookup_parent(dst_path, &dst_parent, &dst_leaf);
-     if (ret < 0) {
-         free(src_leaf);
-         return ret;
-     }
-     if (src_parent != dst_parent) {
-         free(src_leaf);
-         free(dst_leaf);
-         return -EINVAL;
-     }
+     struct fs_inode inode;
+     if (read_inode(inum, &inode) < 0)
+         return -EIO;
      
-     struct fs_inode parent_inode;
-     if (read_inode(src_parent, &parent_inode) < 0) {
-         free(src_leaf);
-         free(dst_leaf);
+     inode.mode = (inode.mode & S_IFMT) | (mode & ~S_IFMT);
+     
+     if (write_inode(inum, &inode) < 0)
          return -EIO;
-     }
      
-     char dir_block[FS_BLOCK_SIZE];
-     if (block_read(dir_block, parent_inode.ptrs[0], 1) < 0) {
-         free(src_leaf);
-         free(dst_leaf);
+     return 0;
+ }
+
+ int fs_chmod(const char *path, mode_t mode)
+ {
+     op_args(0, 0, mode);
+     if (fs_begin_write() < 0)
+         return -EROFS;
+     return fs_end_write(do_chmod(path, mode));
+ }
+ 
+ static int do_utime(const char *path, struct utimbuf *ut)
+ {
+     int inum = translate(path);
+     if (inum < 0)
+         return inum;
+     
+     struct fs_inode inode;
+     if (read_inode(inum, &inode) < 0)
          return -EIO;
-     }
      
-     int found_src = 0;
-     for (int i = 0; i < 128; i++) {
-         struct fs_dirent *d = (struct fs_dirent *)(dir_block + i*32);
-         if (d->valid) {
-             if (strcmp(d->name, src_leaf) == 0) {
-                 found_src = 1;
-             }
-             if (strcmp(d->name, dst_leaf) == 0) {
-                 free(src_leaf);
-                 free(dst_leaf);
-                 return -EEXIST;
-             }
+     inode.mtime = ut->modtime;
+     inode.ctime = ut->modtime;
+     
+     if (write_inode(inum, &inode) < 0)
+         return -EIO;
+     return 0;
+ }
+
+ int fs_utime(const char *path, struct utimbuf *ut)
+ {
+     op_args(ut->modtime, 0, 0);
+     if (fs_begin_write() < 0)
+         return -EROFS;
+     return fs_end_write(do_utime(path, ut));
+ }
+ 
+ /* is a block all zeros? (comparing it with itself shifted by a byte
+  * lets memcmp do the work, a vector at a time)
+  */
+ static int block_is_zero(const char *data)
+ {
+     return data[0] == 0 && memcmp(data, data + 1, FS_BLOCK_SIZE - 1) == 0;
+ }
+ 
+ /* write 'len' bytes at 'offset' in file 'inum'. Parts in a hole
+  * (which includes everything past the end) are delayed if there's room
+  * (see da_put), or else get blocks now; blocks fallocate reserved are
+  * used as they are. Blocks that end up all zeros become holes instead.
+  * Updates the block map in 'inode', but the caller updates the size
+  * and writes it back.
+  */
+ static int write_blocks(int inum, struct fs_inode *inode, const char *buf,
+                         size_t len, off_t offset)
+ {
+     size_t end_offset = offset + len;
+     
+     /* first pick the block each part of the write goes to, and merge
+      * the partial blocks at either end with their old contents (if
+      * any) in 'head' and 'tail'
+      */
+     int first = offset / FS_BLOCK_SIZE;
+     int last = len > 0 ? (end_offset - 1) / FS_BLOCK_SIZE : first;
+     int head_partial = offset % FS_BLOCK_SIZE != 0;
+     int tail_partial = end_offset % FS_BLOCK_SIZE != 0;
+     char head[FS_BLOCK_SIZE], tail[FS_BLOCK_SIZE];
+     int delay = !log_mode() && last - first + 1 <= DA_MAX - da_count;
+     int reserve = 0;
+     unsigned char delayed[DA_MAX / 8] = {0};
+     
+     for (int i = first; len > 0 && i <= last; i++) {
+         int fresh = inode->ptrs[i] == 0, reserved = unwritten(inode->ptrs[i]);
+         int blk = ptr_block(inode->ptrs[i]);
+         const char *data = buf + ((off_t)i * FS_BLOCK_SIZE - offset);
+         struct da_block *d = fresh ? da_find(inum, i) : NULL;
+         
+         if ((i == first && head_partial) || (i == last && tail_partial)) {
+             char *edge = (i == first) ? head : tail;
+             off_t lo = (off_t)i * FS_BLOCK_SIZE, hi = lo + FS_BLOCK_SIZE;
+             if (lo < offset)
+                 lo = offset;
+             if (hi > end_offset)
+                 hi = end_offset;
+             if (d != NULL)
+                 memcpy(edge, d->data, FS_BLOCK_SIZE);   /* delayed */
+             else if (fresh || reserved)
+                 memset(edge, 0, FS_BLOCK_SIZE);
+             else if (data_read(edge, blk, 1) < 0)
+                 return -EIO;
+             memcpy(edge + lo % FS_BLOCK_SIZE, buf + (lo - offset), hi - lo);
+             data = edge;
+         }
+         
+         if (block_is_zero(data)) {
+             if (fresh || reserved)
+                 continue;
+             if (free_block(blk) < 0)
+                 return -EIO;
+             inode->ptrs[i] = 0;
+             continue;
+         }
+         
+         if (fresh && delay) {
+             reserve += d == NULL;
+             bit_set(delayed, i - first);
+             continue;
          }
+         
+         /* log mode never overwrites in place, and COW mode doesn't
+          * overwrite blocks shared with a snapshot or clone: the new
+          * version of the block goes to a new one
+          */
+         if (fresh || must_relocate(blk)) {
+             int new_blk = alloc_file_block(inum, i, file_goal(inum, inode, i));
+             if (new_blk < 0)
+                 return new_blk;
+             if (!fresh && free_block(blk) < 0)
+                 return -EIO;
+             blk = new_blk;
+         }
+         inode->ptrs[i] = blk;
      }
-     if (!found_src) {
-         free(src_leaf);
-         free(dst_leaf);
-         return -ENOENT;
+     if (reserve > 0 && reserve > free_blocks() - da_count)
+         return -ENOSPC;
+     
+     /* older delayed versions of blocks that weren't delayed again are
+      * out of date now
+      */
+     for (int i = first; len > 0 && i <= last && da_count > 0; i++) {
+         struct da_block *d = da_find(inum, i);
+         if (d != NULL && !(delay && bit_test(delayed, i - first)))
+             da_remove(d);
      }
      
-     for (int i = 0; i < 128; i++) {
-         struct fs_dirent *d = (struct fs_dirent *)(dir_block + i*32);
-         if (d->valid && strcmp(d->name, src_leaf) == 0) {
-             strncpy(d->name, dst_leaf, MAX_NAME_LEN);
-             d->name[MAX_NAME_LEN] = '\0';
-             break;
+     /* then write it out (or keep it for later): whole blocks straight
+      * from 'buf', a physically contiguous run at a time, and the
+      * partial ones from their own buffers
+      */
+     for (int i = first; len > 0 && i <= last; ) {
+         int blk = inode->ptrs[i], edge = 0;
+         const char *data = buf + ((off_t)i * FS_BLOCK_SIZE - offset);
+         if ((i == first && head_partial) || (i == last && tail_partial)) {
+             data = (i == first) ? head : tail;
+             edge = 1;
          }
+         if (blk == 0 || unwritten(blk)) {
+             if (blk == 0 && delay && bit_test(delayed, i - first))
+                 da_put(inum, i, data);
+             i++;
+             continue;
+         }
+         if (edge) {
+             if (data_write((void *)data, blk, 1) < 0)
+                 return -EIO;
+             cache_drop(blk);
+             i++;
+             continue;
+         }
+         int n = 1;
+         while (i + n <= last && !(i + n == last && tail_partial) &&
+                inode->ptrs[i + n] == blk + n)
+             n++;
+         if (data_write((void *)data, blk, n) < 0)
+             return -EIO;
+         for (int j = 0; j < n; j++)
+             cache_drop(blk + j);
+         i += n;
      }
-     if (block_write(dir_block, parent_inode.ptrs[0], 1) < 0) {
-         free(src_leaf);
-         free(dst_leaf);
-         return -EIO;
-     }
-     free(src_leaf);
-     free(dst_leaf);
-     return 0;
+     return len;
  }
  
- /* chmod - change file permissions
-  * utime - change access and modification times
-  *         (for definition of 'struct utimebuf', see 'man utime')
-  *
+ /* the part of a file's last block past the end may hold old data, so
+  * zero it (up to 'new_size') before the file grows over it
+  */
+ static int zero_tail(int inum, struct fs_inode *inode, off_t new_size)
+ {
+     static const char zeros[FS_BLOCK_SIZE];
+     int tail = inode->size % FS_BLOCK_SIZE;
+     uint32_t ptr = inode->ptrs[inode->size / FS_BLOCK_SIZE];
+     if (tail == 0 || ptr == 0 || unwritten(ptr))
+         return 0;
+     off_t end = inode->size - tail + FS_BLOCK_SIZE;
+     if (end > new_size)
+         end = new_size;
+     if (end <= inode->size)
+         return 0;
+     return write_blocks(inum, inode, zeros, end - inode->size, inode->size);
+ }
+ 
+ /* truncate - truncate file to exactly 'len' bytes
   * success - return 0
-  * Errors - path resolution, ENOENT.
+  * Errors - path resolution, ENOENT, EISDIR, EINVAL (len < 0), EFBIG
+  *    Growing a file leaves a hole at the end; no blocks are allocated.
   */
- int fs_chmod(const char *path, mode_t mode)
+ static int do_truncate(const char *path, off_t len)
  {
+     if (len < 0)
+         return -EINVAL;
+     if (DIV_ROUND_UP(len, FS_BLOCK_SIZE) > MAX_FILE_BLOCKS)
+         return -EFBIG;
      int inum = translate(path);
      if (inum < 0)
          return inum;
@@ -649,42 +3758,137 @@
      struct fs_inode inode;
      if (read_inode(inum, &inode) < 0)
          return -EIO;
-     
-     inode.mode = (inode.mode & S_IFMT) | (mode & ~S_IFMT);
-     
+     
+     if ((inode.mode & S_IFMT) != S_IFREG)
+         return -EISDIR;
+     
+     int first = DIV_ROUND_UP(len, FS_BLOCK_SIZE), nblocks = 0, ret;
+     for (int i = first; i < MAX_FILE_BLOCKS; i++)
+         if (inode.ptrs[i] != 0)
+             nblocks++;
+     if (orphan_defer(nblocks) &&
+         (ret = orphan_split(inum, &inode, first, nblocks)) < 0)
+         return ret;
+     for (int i = first; i < MAX_FILE_BLOCKS; i++) {
+         if (inode.ptrs[i] != 0 && free_block(ptr_block(inode.ptrs[i])) < 0)
+             return -EIO;
+         inode.ptrs[i] = 0;
+     }
+     if (len > inode.size && zero_tail(inum, &inode, len) < 0)
+         return -EIO;
+     inode.size = len;
+     inode.mtime = time(NULL);
      if (write_inode(inum, &inode) < 0)
          return -EIO;
-     
+     da_truncate(inum, len);
      return 0;
  }
+
+ int fs_truncate(const char *path, off_t len)
+ {
+     op_args(len, 0, 0);
+     if (fs_begin_write() < 0)
+         return -EROFS;
+     return fs_end_write(do_truncate(path, len));
+ }
  
- int fs_utime(const char *path, struct utimbuf *ut)
+ /* fsync - write out the file's delayed writes.
+  * Errors - path resolution, ENOENT, ENOSPC
+  */
+ static int do_fsync(const char *path)
  {
      int inum = translate(path);
      if (inum < 0)
          return inum;
+     return da_flush(inum);
+ }
+ 
+ int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+ {
+     if (stats_path(path))
+         return 0;
+     if (fs_begin_write() < 0)
+         return 0;               /* a snapshot has nothing to write */
+     return fs_end_write(do_fsync(path));
+ }
+ 
+ /* reserve blocks for the holes in [offset, offset+len), in as few
+  * contiguous runs as possible, each following on from the block
+  * before it (in log mode they come from the log head, which is
+  * contiguous anyway). They're flagged unwritten, so they read as
+  * zeros until something is written to them.
+  */
+ static int preallocate(int inum, struct fs_inode *inode, off_t offset, off_t len)
+ {
+     int first = offset / FS_BLOCK_SIZE;
+     int last = (offset + len - 1) / FS_BLOCK_SIZE;
      
-     struct fs_inode inode;
-     if (read_inode(inum, &inode) < 0)
-         return -EIO;
+     for (int i = first; i <= last; ) {
+         if (inode->ptrs[i] != 0) {
+             i++;
+             continue;
+         }
+         int want = 1, got;
+         while (i + want <= last && inode->ptrs[i + want] == 0)
+             want++;
+         int blk = log_mode() ? (got = 1, alloc_file_block(inum, i, 0)) :
+             allocate_run(file_goal(inum, inode, i), want, &got);
+         if (blk < 0)
+             return blk;
+         for (int j = 0; j < got; j++)
+             inode->ptrs[i + j] = (blk + j) | FS_PTR_UNWRITTEN;
+         i += got;
+     }
+     return 0;
+ }
+ 
+ /* free the blocks wholly inside [offset, offset+len) and zero the
+  * rest of the range (only the part before the end can hold data)
+  */
+ static int punch_hole(int inum, struct fs_inode *inode, off_t offset, off_t len)
+ {
+     static const char zeros[FS_BLOCK_SIZE];
+     off_t end = offset + len, data_end = end < inode->size ? end : inode->size;
+     int first = DIV_ROUND_UP(offset, FS_BLOCK_SIZE), last = end / FS_BLOCK_SIZE;
      
-     inode.mtime = ut->modtime;
-     inode.ctime = ut->modtime;
+     for (int i = first; i < last; i++) {
+         if (inode->ptrs[i] != 0 && free_block(ptr_block(inode->ptrs[i])) < 0)
+             return -EIO;
+         inode->ptrs[i] = 0;
+     }
      
-     if (write_inode(inum, &inode) < 0)
+     off_t head_end = (off_t)first * FS_BLOCK_SIZE;
+     if (head_end > data_end)
+         head_end = data_end;
+     if (offset < head_end &&
+         write_blocks(inum, inode, zeros, head_end - offset, offset) < 0)
+         return -EIO;
+     off_t tail_start = (off_t)last * FS_BLOCK_SIZE;
+     if (tail_start < offset)
+         tail_start = offset;
+     if (tail_start >= head_end && tail_start < data_end &&
+         write_blocks(inum, inode, zeros, data_end - tail_start, tail_start) < 0)
          return -EIO;
      return 0;
  }
  
- /* truncate - truncate file to exactly 'len' bytes
+ /* fallocate - mode 0 reserves space for [offset, offset+len),
+  * growing the file to cover it; FALLOC_FL_KEEP_SIZE reserves it
+  * without changing the size. FALLOC_FL_PUNCH_HOLE (which must come
+  * with KEEP_SIZE) frees the space and zeros the range instead.
   * success - return 0
-  * Errors - path resolution, ENOENT, EISDIR, EINVAL
-  *    return EINVAL if len > 0.
+  * Errors - path resolution, ENOENT, EISDIR, EINVAL (offset < 0 or
+  *   len <= 0), EFBIG, ENOSPC, EOPNOTSUPP (other modes)
   */
- int fs_truncate(const char *path, off_t len)
+ static int do_fallocate(const char *path, int mode, off_t offset, off_t len)
  {
-     if (len != 0)
+     if (offset < 0 || len <= 0)
          return -EINVAL;
+     if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0 ||
+         ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)))
+         return -EOPNOTSUPP;
+     if (DIV_ROUND_UP(offset + len, FS_BLOCK_SIZE) > MAX_FILE_BLOCKS)
+         return -EFBIG;
      int inum = translate(path);
      if (inum < 0)
          return inum;
@@ -692,22 +3896,59 @@
      struct fs_inode inode;
      if (read_inode(inum, &inode) < 0)
          return -EIO;
-     
-     if ((inode.mode & S_IFMT) != S_IFREG)
+     if (!S_ISREG(inode.mode))
          return -EISDIR;
      
-     int nblocks = (inode.size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
-     for (int i = 0; i < nblocks; i++) {
-         free_block(inode.ptrs[i]);
-         inode.ptrs[i] = 0;
+     int ret;
+     if (mode & FALLOC_FL_PUNCH_HOLE) {
+         ret = punch_hole(inum, &inode, offset, len);
+     } else {
+         ret = preallocate(inum, &inode, offset, len);
+         if (ret == 0 && !(mode & FALLOC_FL_KEEP_SIZE) &&
+             offset + len > inode.size) {
+             ret = zero_tail(inum, &inode, offset + len);
+             inode.size = offset + len;
+         }
      }
-     inode.size = 0;
+     if (ret < 0)
+         return ret;
      inode.mtime = time(NULL);
      if (write_inode(inum, &inode) < 0)
          return -EIO;
      return 0;
  }
  
+ int fs_fallocate(const char *path, int mode, off_t offset, off_t len,
+                  struct fuse_file_info *fi)
+ {
+     op_args(offset, len, mode);
+     int ret = fs_fsync(path, 0, fi);     /* works on the block map */
+     if (ret < 0)
+         return ret;
+     if (fs_begin_write() < 0)
+         return -EROFS;
+     ret = fs_end_write(do_fallocate(path, mode, offset, len));
+     if (ret == -ENOSPC && orphan_flush() > 0)
+         return fs_fallocate(path, mode, offset, len, fi);
+     return ret;
+ }
+ 
+ 
+ /* open, release - nothing to do, except for files under /.terrafs
+  */
+ int fs_open(const char *path, struct fuse_file_info *fi)
+ {
+     if (stats_path(path))
+         return stats_open(path, fi);
+     return 0;
+ }
+ 
+ int fs_release(const char *path, struct fuse_file_info *fi)
+ {
+     if (stats_path(path))
+         return stats_release(path, fi);
+     return 0;
+ }
  
  /* read - read data from an open file.
   * success: should return exactly the number of bytes requested, except:
@@ -716,7 +3957,7 @@
   *   - on error, return <0
   * Errors - path resolution, ENOENT, EISDIR
   */
- int fs_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+ static int do_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
  {
      int inum = translate(path);
      if (inum < 0)
@@ -738,12 +3979,50 @@
      int bytes_read = 0;
      int start_block = offset / FS_BLOCK_SIZE;
      int block_offset = offset % FS_BLOCK_SIZE;
+     readahead(inum, start_block, DIV_ROUND_UP(offset + len, FS_BLOCK_SIZE));
      
      while (len > 0) {
-         char block_data[FS_BLOCK_SIZE];
          int block_num = inode.ptrs[start_block];
-         if (block_read(block_data, block_num, 1) < 0)
-             return -EIO;
+         
+         /* whole blocks go straight into 'buf': from the cache, or a
+          * physically contiguous run of uncached ones in one read.
+          * Holes (block 0) and unwritten blocks read as zeros, unless
+          * there's a delayed write for them.
+          */
+         int zero = block_num == 0 || unwritten(block_num);
+         if (block_offset == 0 && len >= FS_BLOCK_SIZE) {
+             int n = 0, max = len / FS_BLOCK_SIZE;
+             if (zero) {
+                 if (!da_get(inum, start_block, buf + bytes_read))
+                     memset(buf + bytes_read, 0, FS_BLOCK_SIZE);
+                 n = 1;
+             } else if (cache_get(block_num, buf + bytes_read)) {
+                 n = 1;
+             } else {
+                 do {
+                     n++;
+                 } while (n < max && inode.ptrs[start_block + n] == block_num + n &&
+                          !cache_has(block_num + n));
+                 if (data_read(buf + bytes_read, block_num, n) < 0)
+                     return -EIO;
+                 for (int i = 0; i < n; i++)
+                     cache_put(block_num + i, buf + bytes_read + i * FS_BLOCK_SIZE);
+             }
+             bytes_read += n * FS_BLOCK_SIZE;
+             len -= n * FS_BLOCK_SIZE;
+             start_block += n;
+             continue;
+         }
+         
+         char block_data[FS_BLOCK_SIZE];
+         if (zero) {
+             if (!da_get(inum, start_block, block_data))
+                 memset(block_data, 0, FS_BLOCK_SIZE);
+         } else if (!cache_get(block_num, block_data)) {
+             if (data_read(block_data, block_num, 1) < 0)
+                 return -EIO;
+             cache_put(block_num, block_data);
+         }
          int bytes_to_copy = FS_BLOCK_SIZE - block_offset;
          if (bytes_to_copy > len)
              bytes_to_copy = len;
@@ -755,16 +4034,24 @@
      }
      return bytes_read;
  }
+
+ int fs_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+ {
+     op_args(offset, len, 0);
+     if (stats_path(path))
+         return stats_read(path, buf, len, offset, fi);
+     fs_begin_read();
+     return fs_end_read(do_read(path, buf, len, offset, fi));
+ }
  
  /* write - write data to a file
   * success - return number of bytes written. (this will be the same as
   *           the number requested, or else it's an error)
-  * Errors - path resolution, ENOENT, EISDIR
-  *  return EINVAL if 'offset' is greater than current file length.
-  *  (POSIX semantics support the creation of files with "holes" in them, 
-  *   but we don't)
+  * Errors - path resolution, ENOENT, EISDIR, EFBIG
+  *  Writing past the end of the file leaves a hole, which reads as
+  *  zeros and takes up no blocks.
   */
- int fs_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+ static int do_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
  {
      int inum = translate(path);
      if (inum < 0)
@@ -777,69 +4064,72 @@
      if ((inode.mode & S_IFMT) != S_IFREG)
          return -EISDIR;
      
-     if (offset > inode.size)
-         return -EINVAL;  
-     
      size_t end_offset = offset + len;
-     int cur_blocks = (inode.size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
-     int required_blocks = (end_offset + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
-     for (int i = cur_blocks; i < required_blocks; i++) {
-         int new_blk = allocate_block();
-         if (new_blk < 0)
-             return new_blk;
-         inode.ptrs[i] = new_blk;
-     }
-     
-     int bytes_written = 0;
-     int start_block = offset / FS_BLOCK_SIZE;
-     int block_offset = offset % FS_BLOCK_SIZE;
-     size_t remaining = len;
+     if (offset < 0)
+         return -EINVAL;
+     if (DIV_ROUND_UP(end_offset, FS_BLOCK_SIZE) > MAX_FILE_BLOCKS)
+         return -EFBIG;
      
-     while (remaining > 0) {
-         char block_data[FS_BLOCK_SIZE];
-         int blk = inode.ptrs[start_block];
-         if (block_read(block_data, blk, 1) < 0)
-             return -EIO;
-         
-         int can_write = FS_BLOCK_SIZE - block_offset;
-         if (can_write > remaining)
-             can_write = remaining;
-         memcpy(block_data + block_offset, buf + bytes_written, can_write);
-         
-         if (block_write(block_data, blk, 1) < 0)
-             return -EIO;
-         
-         bytes_written += can_write;
-         remaining -= can_write;
-         block_offset = 0;
-         start_block++;
+     /* a failed write mustn't leave any of its data in delayed blocks
+      * (zero_tail only zeroes what's past the end, which reads as zero
+      * anyway) */
+     struct da_undo undo;
+     int ret = da_save(&undo, inum, offset / FS_BLOCK_SIZE,
+                       len > 0 ? (end_offset - 1) / FS_BLOCK_SIZE : offset / FS_BLOCK_SIZE);
+     if (ret < 0)
+         return ret;
+     if (offset > inode.size && (ret = zero_tail(inum, &inode, offset)) < 0)
+         return ret;
+     if ((ret = write_blocks(inum, &inode, buf, len, offset)) < 0) {
+         da_restore(&undo);
+         return ret;
      }
      if (end_offset > inode.size)
          inode.size = end_offset;
      inode.mtime = time(NULL);
-     if (write_inode(inum, &inode) < 0)
+     if (write_inode(inum, &inode) < 0) {
+         da_restore(&undo);
          return -EIO;
-     return bytes_written;
+     }
+     return len;
+ }
+
+ int fs_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+ {
+     op_args(offset, len, 0);
+     if (fs_begin_write() < 0)
+         return -EROFS;
+     /* make room for the write's delayed blocks (writes too big to be
+      * delayed allocate as they go)
+      */
+     int nblocks = len == 0 ? 0 : (offset + len - 1) / FS_BLOCK_SIZE - offset / FS_BLOCK_SIZE + 1;
+     if (nblocks <= DA_MAX && da_count + nblocks > DA_MAX) {
+         int ret = fs_end_write(da_flush_all());
+         if (ret < 0)
+             return ret;
+         fs_begin_write();
+     }
+     int ret = fs_end_write(do_write(path, buf, len, offset, fi));
+     if (ret == -ENOSPC && orphan_flush() > 0)
+         return fs_write(path, buf, len, offset, fi);
+     return ret;
  }
+
  
  /* statfs - get file system statistics
   * see 'man 2 statfs' for description of 'struct statvfs'.
   * Errors - none. Needs to work.
   */
- int fs_statfs(const char *path, struct statvfs *st)
+ static int do_statfs(const char *path, struct statvfs *st)
  {
      struct fs_super *sb_ptr = (struct fs_super *)superblock;
      int total = sb_ptr->disk_size; 
-     int used = 0;
-     for (int i = 0; i < sb_ptr->disk_size; i++) {
-         if (bit_test(bitmap, i))
-             used++;
-     }
-     int free_blocks = sb_ptr->disk_size - used;
+     /* delayed writes have some, and orphans' blocks will be free */
+     int nfree = free_or_reclaimed() - da_count + orphan_blocks;
      st->f_bsize = FS_BLOCK_SIZE;
      st->f_blocks = total;
-     st->f_bfree = free_blocks;
-     st->f_bavail = free_blocks;
+     st->f_bfree = nfree;
+     st->f_bavail = nfree;
      st->f_namemax = MAX_NAME_LEN;
      st->f_frsize = 0;
      st->f_files = 0;
@@ -847,130 +4137,547 @@
      st->f_favail = 0;
      return 0;
  }
+
+ int fs_statfs(const char *path, struct statvfs *st)
+ {
+     fs_begin_read();
+     return fs_end_read(do_statfs(path, st));
+ }
+ 
+ /* clone - replace the contents of 'path' with those of 'src_path',
+  * sharing its blocks. Costs a reference count update per block; no
+  * data is copied.
+  * Errors - path resolution, ENOENT, EISDIR, EINVAL (same file)
+  */
+ static int do_clone(const char *path, const char *src_path)
+ {
+     int inum = translate(path);
+     if (inum < 0)
+         return inum;
+     int src_inum = translate(src_path);
+     if (src_inum < 0)
+         return src_inum;
+     if (inum == src_inum)
+         return -EINVAL;
+ 
+     struct fs_inode inode, src;
+     if (read_inode(inum, &inode) < 0 || read_inode(src_inum, &src) < 0)
+         return -EIO;
+     if (!S_ISREG(inode.mode) || !S_ISREG(src.mode))
+         return -EISDIR;
+ 
+     for (int i = 0; i < MAX_FILE_BLOCKS; i++)
+         if (inode.ptrs[i] != 0 && free_block(ptr_block(inode.ptrs[i])) < 0)
+             return -EIO;
+     for (int i = 0; i < MAX_FILE_BLOCKS; i++)
+         if (src.ptrs[i] != 0 && ref_add(ptr_block(src.ptrs[i]), 1) < 0)
+             return -EIO;
+     memcpy(inode.ptrs, src.ptrs, sizeof(inode.ptrs));
+     inode.size = src.size;
+     inode.mtime = time(NULL);
+     if (write_inode(inum, &inode) < 0)
+         return -EIO;
+     return 0;
+ }
+ 
+ /* mark in 'seen' every block reachable from the inode map in blocks
+  * 'ptrs': the map, the inodes and their blocks
+  */
+ static int snap_mark(unsigned char *seen, uint32_t *ptrs)
+ {
+     int disk_size = super()->disk_size;
+     uint32_t map[FS_BLOCK_SIZE / 4];
+     struct fs_inode inode;
+     for (int i = 0; i < super()->imap_len; i++) {
+         bit_set(seen, ptrs[i]);
+         if (meta_read(map, ptrs[i]) < 0)
+             return -EIO;
+         for (int j = 0; j < FS_BLOCK_SIZE / 4; j++) {
+             if (map[j] == 0 || map[j] >= disk_size)
+                 continue;
+             bit_set(seen, map[j]);
+             if (meta_read(&inode, map[j]) < 0)
+                 return -EIO;
+             for (int k = 0; k < MAX_FILE_BLOCKS; k++)
+                 if (inode.ptrs[k] != 0 && ptr_block(inode.ptrs[k]) < disk_size)
+                     bit_set(seen, ptr_block(inode.ptrs[k]));
+         }
+     }
+     return 0;
+ }
+ 
+ static void mark_range(unsigned char *seen, int start, int len)
+ {
+     for (int i = start; i < start + len; i++)
+         bit_set(seen, i);
+ }
+ 
+ /* delete snapshot 'id'. Blocks it shares stay allocated after the
+  * live file system drops them (see free_block), so the blocks it was
+  * the last to use are found by elimination: allocated ones born no
+  * later than it that the live file system and the other snapshots
+  * can't reach are freed.
+  */
+ static int snapshot_delete(int id)
+ {
+     struct fs_snap_root *r = root();
+     if (id < 1 || id > FS_MAX_SNAPSHOTS || r->snaps[id - 1].epoch == 0)
+         return -EINVAL;
+     uint32_t epoch = r->snaps[id - 1].epoch;
+     memset(&r->snaps[id - 1], 0, sizeof(r->snaps[id - 1]));
+     if (meta_write(snap_root, super()->snap_root) < 0)
+         return -EIO;
+     snap_epoch = 0;
+     for (int i = 0; i < FS_MAX_SNAPSHOTS; i++)
+         if (r->snaps[i].epoch > snap_epoch)
+             snap_epoch = r->snaps[i].epoch;
+ 
+     struct fs_super *sb = super();
+     unsigned char *seen = calloc(FS_BLOCK_SIZE, 1);
+     if (seen == NULL)
+         return -ENOMEM;
+     mark_range(seen, 0, 2);     /* superblock, bitmap */
+     mark_range(seen, sb->journal_start, sb->journal_len);
+     mark_range(seen, sb->orphans, sb->orphans != 0);
+     mark_range(seen, sb->birth_start, sb->birth_len);
+     mark_range(seen, sb->refs_start, sb->refs_len);
+     mark_range(seen, sb->snap_root, 1);
+     int ret = snap_mark(seen, r->imap);
+     for (int i = 0; i < FS_MAX_SNAPSHOTS && ret == 0; i++)
+         if (r->snaps[i].epoch != 0)
+             ret = snap_mark(seen, r->snaps[i].imap);
+ 
+     for (int b = 2; b < sb->disk_size && ret == 0; b++) {
+         if (!bit_test(bitmap, b) || bit_test(seen, b) || births[b] > epoch)
+             continue;
+         cache_drop(b);
+         if (refs[b] > 0)
+             ret = ref_add(b, -(int)refs[b]);
+         if (ret == 0)
+             ret = release_block(b);
+     }
+     free(seen);
+     return ret;
+ }
+ 
+ /* ioctl - FS_IOC_SNAPSHOT snapshots the whole file system, whichever
+  * file it's called on, and puts the snapshot number in 'data'.
+  * FS_IOC_SNAPDEL deletes the snapshot numbered in 'data'.
+  * FS_IOC_CLONE makes 'path' a clone of the file named in 'data'.
+  * Errors - ENOTTY (unknown command), EOPNOTSUPP (not a COW image),
+  *   ENOSPC (no free snapshot slots), EINVAL (no such snapshot),
+  *   clone errors
+  */
+ static int ioctl_check(int cmd)
+ {
+     if ((unsigned int)cmd != FS_IOC_SNAPSHOT &&
+         (unsigned int)cmd != FS_IOC_SNAPDEL &&
+         (unsigned int)cmd != FS_IOC_CLONE)
+         return -ENOTTY;
+     if (!cow_mode())
+         return -EOPNOTSUPP;
+     return 0;
+ }
+ 
+ static int do_ioctl(const char *path, int cmd, void *arg,
+                     struct fuse_file_info *fi, unsigned int flags, void *data)
+ {
+     if ((unsigned int)cmd == FS_IOC_CLONE) {
+         struct fs_clone_args *args = data;
+         args->src[sizeof(args->src) - 1] = '\0';
+         op_path2 = args->src;
+         return do_clone(path, args->src);
+     }
+     if ((unsigned int)cmd == FS_IOC_SNAPDEL) {
+         op_off = *(uint32_t *)data;
+         return snapshot_delete(*(uint32_t *)data);
+     }
+     int id = snapshot_create();
+     if (id < 0)
+         return id;
+     *(uint32_t *)data = id;
+     return 0;
+ }
+
+ int fs_ioctl(const char *path, int cmd, void *arg,
+              struct fuse_file_info *fi, unsigned int flags, void *data)
+ {
+     op_args(0, 0, cmd);
+     int ret = fs_begin_write();
+     if (ret < 0)
+         return ret;
+     ret = ioctl_check(cmd);
+     if (ret == 0)
+         ret = da_flush_all();   /* snapshots and clones see it all */
+     if (ret == 0)
+         ret = do_ioctl(path, cmd, arg, fi, flags, data);
+     return fs_end_write(ret);
+ }
+ 
+ /* fs_ops entries: each call is counted and timed (see 'struct
+  * counters'), and nothing under /.terrafs can be changed
+  */
+ #define RO_ENTRY(name, op, params, args)                        \
+     static int op_##name params                                 \
+     {                                                           \
+         uint64_t t = op_begin(op, path);                        \
+         return op_end(op, t, fs_##name args);                   \
+     }
+ #define RW_ENTRY(name, op, params, args)                        \
+     static int op_##name params                                 \
+     {                                                           \
+         uint64_t t = op_begin(op, path);                        \
+         if (stats_path(path))                                   \
+             return op_end(op, t, -EACCES);                      \
+         return op_end(op, t, fs_##name args);                   \
+     }
+ 
+ RO_ENTRY(getattr, OP_GETATTR, (const char *path, struct stat *sb), (path, sb))
+ RO_ENTRY(readdir, OP_READDIR, (const char *path, void *ptr, fuse_fill_dir_t filler,
+                                off_t offset, struct fuse_file_info *fi),
+          (path, ptr, filler, offset, fi))
+ RO_ENTRY(read, OP_READ, (const char *path, char *buf, size_t len, off_t offset,
+                          struct fuse_file_info *fi), (path, buf, len, offset, fi))
+ RO_ENTRY(statfs, OP_STATFS, (const char *path, struct statvfs *st), (path, st))
+ RO_ENTRY(fsync, OP_FSYNC, (const char *path, int datasync, struct fuse_file_info *fi),
+          (path, datasync, fi))
+ RW_ENTRY(create, OP_CREATE, (const char *path, mode_t mode, struct fuse_file_info *fi),
+          (path, mode, fi))
+ RW_ENTRY(mkdir, OP_MKDIR, (const char *path, mode_t mode), (path, mode))
+ RW_ENTRY(unlink, OP_UNLINK, (const char *path), (path))
+ RW_ENTRY(rmdir, OP_RMDIR, (const char *path), (path))
+ RW_ENTRY(chmod, OP_CHMOD, (const char *path, mode_t mode), (path, mode))
+ RW_ENTRY(utime, OP_UTIME, (const char *path, struct utimbuf *ut), (path, ut))
+ RW_ENTRY(truncate, OP_TRUNCATE, (const char *path, off_t len), (path, len))
+ RW_ENTRY(write, OP_WRITE, (const char *path, const char *buf, size_t len, off_t offset,
+                            struct fuse_file_info *fi), (path, buf, len, offset, fi))
+ RW_ENTRY(fallocate, OP_FALLOCATE, (const char *path, int mode, off_t offset, off_t len,
+                                    struct fuse_file_info *fi), (path, mode, offset, len, fi))
+ RW_ENTRY(ioctl, OP_IOCTL, (const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                            unsigned int flags, void *data), (path, cmd, arg, fi, flags, data))
+ 
+ static int op_rename(const char *src_path, const char *dst_path)
+ {
+     uint64_t t = op_begin(OP_RENAME, src_path);
+     op_path2 = dst_path;
+     if (stats_path(src_path) || stats_path(dst_path))
+         return op_end(OP_RENAME, t, -EACCES);
+     return op_end(OP_RENAME, t, fs_rename(src_path, dst_path));
+ }
  
  /* operations vector. Please don't rename it, or else you'll break things
   */
  struct fuse_operations fs_ops = {
      .init = fs_init,            /* read-mostly operations */
-     .getattr = fs_getattr,
-     .readdir = fs_readdir,
-     .rename = fs_rename,
-     .chmod = fs_chmod,
-     .read = fs_read,
-     .statfs = fs_statfs,
- 
-     .create = fs_create,        /* write operations */
-     .mkdir = fs_mkdir,
-     .unlink = fs_unlink,
-     .rmdir = fs_rmdir,
-     .utime = fs_utime,
-     .truncate = fs_truncate,
-     .write = fs_write,
- };
+     .destroy = fs_destroy,
+     .getattr = op_getattr,
+     .readdir = op_readdir,
+     .rename = op_rename,
+     .chmod = op_chmod,
+     .open = fs_open,
+     .release = fs_release,
+     .read = op_read,
+     .statfs = op_statfs,
  
- /* translate splits a path into components from the root to get the inode number. Returns inode number or a negative error. */
- static int translate(const char *path) {
-     if (strcmp(path, "/") == 0)
-         return 2;  
+     .create = op_create,        /* write operations */
+     .mkdir = op_mkdir,
+     .unlink = op_unlink,
+     .rmdir = op_rmdir,
+     .utime = op_utime,
+     .truncate = op_truncate,
+     .write = op_write,
+     .ioctl = op_ioctl,
+     .fallocate = op_fallocate,
+     .fsync = op_fsync,
+ };
  
-     char *path_copy = strdup(path);
-     if (!path_copy)
-         return -ENOMEM;
+ /* path_walk resolves 'path' a component at a time, scanning it in
+  * place: no copy, no depth limit. Returns the inode of the last
+  * component or a negative error. *parent (if not NULL) gets the
+  * directory holding the last component, or -1 if the walk failed
+  * before reaching it or the path is "/"; 'leaf' (if not NULL,
+  * MAX_NAME_LEN+1 bytes) gets its name, truncated as in a dirent.
+  * Going through directory 'avoid' (if not -1) on the way is -EINVAL.
+  */
+ static int path_walk(const char *path, int *parent, char *leaf, int avoid)
+ {
+     int cur_inum = 2;
+     if (parent)
+         *parent = -1;
+     const char *p = path;
+     while (*p == '/')
+         p++;
+     while (*p) {
+         size_t len = strcspn(p, "/");
+         const char *next = p + len;
+         while (*next == '/')
+             next++;
+         if (len > MAX_NAME_LEN)
+             len = MAX_NAME_LEN;
  
-     char *components[MAX_PATH_COMPONENTS];
-     int count = 0;
-     char *token = strtok(path_copy, "/");
-     while (token != NULL && count < MAX_PATH_COMPONENTS) {
-         if (strlen(token) > MAX_NAME_LEN)
-             token[MAX_NAME_LEN] = '\0';
-         components[count++] = token;
-         token = strtok(NULL, "/");
-     }
-     
-     int cur_inum = 2;  
-     struct fs_inode inode;
-     int ret;
-     for (int i = 0; i < count; i++) {
-         if ((ret = read_inode(cur_inum, &inode)) < 0) {
-             free(path_copy);
+         struct fs_inode inode;
+         int ret;
+         if ((ret = read_inode(cur_inum, &inode)) < 0)
              return ret;
-         }
-         if ((inode.mode & S_IFMT) != S_IFDIR) {
-             free(path_copy);
+         if ((inode.mode & S_IFMT) != S_IFDIR)
              return -ENOTDIR;
+         if (cur_inum == avoid)
+             return -EINVAL;
+         if (*next == '\0') {
+             if (parent)
+                 *parent = cur_inum;
+             if (leaf) {
+                 memcpy(leaf, p, len);
+                 leaf[len] = '\0';
+             }
          }
          char dir_block[FS_BLOCK_SIZE];
-         if (block_read(dir_block, inode.ptrs[0], 1) < 0) {
-             free(path_copy);
+         if (meta_read(dir_block, inode.ptrs[0]) < 0)
              return -EIO;
-         }
-         int found = 0;
+         int found = -ENOENT;
          for (int j = 0; j < 128; j++) {
              struct fs_dirent *d = (struct fs_dirent *)(dir_block + j * 32);
-             if (d->valid && strcmp(d->name, components[i]) == 0) {
-                 cur_inum = d->inode;
-                 found = 1;
+             if (d->valid && strncmp(d->name, p, len) == 0 && d->name[len] == '\0') {
+                 found = d->inode;
                  break;
              }
          }
-         if (!found) {
-             free(path_copy);
-             return -ENOENT;
-         }
+         if (found < 0)
+             return found;
+         cur_inum = found;
+         p = next;
      }
-     free(path_copy);
+     op_inum = cur_inum;
      return cur_inum;
  }
  
- /* lookup_parent return the inode number of "/a/b" in *parent_inum and a newly allocated string for the leaf name ("c") in *leaf */
- static int lookup_parent(const char *path, int *parent_inum, char **leaf) {
-     if (strcmp(path, "/") == 0)
-         return -EINVAL; 
-     
-     char *dup = strdup(path);
-     if (!dup)
-         return -ENOMEM;
-     
-     int len = strlen(dup);
-     if (dup[len - 1] == '/')
-         dup[len - 1] = '\0';
-     
-     char *dir_copy = strdup(dup);
-     if (!dir_copy) {
-         free(dup);
-         return -ENOMEM;
+ /* translate returns the inode number of 'path' or a negative error. */
+ static int translate(const char *path)
+ {
+     return path_walk(path, NULL, NULL, -1);
+ }
+
+ /* lookup_parent puts the inode number of "/a/b" in *parent_inum and
+  * the leaf name ("c") in 'leaf', in the same walk that looks up
+  * "/a/b/c" itself. Returns its inode, or -ENOENT with *parent_inum
+  * still valid if only the leaf is missing; on any other error
+  * *parent_inum is -1. "/" has no parent: -EINVAL.
+  */
+ static int lookup_parent(const char *path, int *parent_inum, char *leaf)
+ {
+     int inum = path_walk(path, parent_inum, leaf, -1);
+     if (*parent_inum < 0)
+         return inum < 0 ? inum : -EINVAL;
+     return inum;
+ }
+ 
+ /* Allocation groups. The disk is split into groups of AG_BLOCKS
+  * blocks, each with its own slice of the bitmap and a count of the
+  * free blocks in it (not counting pinned ones, which can't be used
+  * yet). Allocation starts from a goal: next to the file's previous
+  * block, or else its inode; a new file's inode goes next to its
+  * directory's, and a new directory in the emptiest group. Other
+  * groups are tried, skipping full ones by their counts, only when the
+  * goal's is full. (Allocating takes fs_lock exclusive, so the groups
+  * need no locks of their own; a commit unpinning blocks only adds to
+  * the counts.)
+  */
+ #define AG_BLOCKS 128
+ static int ag_free[FS_BLOCK_SIZE * 8 / AG_BLOCKS];
+ 
+ static int ag_count(void)
+ {
+     return DIV_ROUND_UP(super()->disk_size, AG_BLOCKS);
+ }
+ 
+ static int block_free(int i)
+ {
+     return !bit_test(bitmap, i) && !bit_test(pinned, i);
+ }
+ 
+ /* (j_lock keeps a commit from unpinning blocks in the middle) */
+ static void ag_recount(void)
+ {
+     pthread_mutex_lock(&j_lock);
+     memset(ag_free, 0, sizeof(ag_free));
+     for (int i = 0; i < super()->disk_size; i++)
+         if (block_free(i))
+             ag_free[i / AG_BLOCKS]++;
+     pthread_mutex_unlock(&j_lock);
+ }
+ 
+ /* mark block 'i' used or free in the bitmap and its group's count.
+  * (Commits unpin blocks without fs_lock, hence the atomics.)
+  */
+ static void mark_used(int i)
+ {
+     bit_set(bitmap, i);
+     __atomic_sub_fetch(&ag_free[i / AG_BLOCKS], 1, __ATOMIC_RELAXED);
+ }
+ 
+ static void mark_free(int i)
+ {
+     bit_clear(bitmap, i);
+     __atomic_add_fetch(&ag_free[i / AG_BLOCKS], 1, __ATOMIC_RELAXED);
+ }
+ 
+ /* free block 'i' once the transaction that freed it is on disk (or
+  * abandoned). Called with j_lock held.
+  */
+ static void unpin(int i)
+ {
+     if (!bit_test(pinned, i))
+         return;
+     bit_clear(pinned, i);
+     if (bit_test(reclaimed, i)) {
+         bit_clear(reclaimed, i);
+         nreclaimed--;
      }
-     char *base = basename(dup);
-     if (strlen(base) > MAX_NAME_LEN)
-         base[MAX_NAME_LEN] = '\0';
-     *leaf = strdup(base);
-     char *parent_path = dirname(dir_copy);
-     int ret = translate(parent_path);
-     *parent_inum = ret;
-     
-     free(dup);
-     free(dir_copy);
-     return (ret < 0) ? ret : 0;
+     if (!bit_test(bitmap, i))
+         __atomic_add_fetch(&ag_free[i / AG_BLOCKS], 1, __ATOMIC_RELAXED);
  }
  
- /* allocate_block allocates a free block. Blocks 0 and 1 are reserved. */
- static int allocate_block(void) {
-     struct fs_super *sb_ptr = (struct fs_super *)superblock;
-     for (int i = 2; i < sb_ptr->disk_size; i++) {
-         if (!bit_test(bitmap, i)) {
-             bit_set(bitmap, i);
-             if (block_write((char*)bitmap, 1, 1) < 0)
-                 return -EIO;
-             return i;
+ static int free_blocks(void)
+ {
+     int n = 0;
+     for (int g = 0; g < ag_count(); g++)
+         n += ag_free[g];
+     return n;
+ }
+ 
+ /* ...and the ones orphan_reclaim freed that are still pinned */
+ static int free_or_reclaimed(void)
+ {
+     pthread_mutex_lock(&j_lock);
+     int n = free_blocks() + nreclaimed;
+     pthread_mutex_unlock(&j_lock);
+     return n;
+ }
+ 
+ /* first block of the group with the most free blocks */
+ static int ag_emptiest(void)
+ {
+     int best = 0;
+     for (int g = 1; g < ag_count(); g++)
+         if (ag_free[g] > ag_free[best])
+             best = g;
+     return best * AG_BLOCKS;
+ }
+ 
+ /* where to put block 'index' of file 'inum' */
+ static int file_goal(int inum, struct fs_inode *inode, int index)
+ {
+     if (index > 0 && inode->ptrs[index - 1] != 0)
+         return ptr_block(inode->ptrs[index - 1]) + 1;
+     int blkno = inode_block(inum);
+     return blkno < 0 ? 0 : blkno + 1;
+ }
+ 
+ /* allocate_block allocates a free block, the first one from 'goal'
+  * on in its group, or else in the next group with any free. Blocks
+  * 0 and 1 are reserved.
+  */
+ static int allocate_block(int goal) {
+     int disk_size = super()->disk_size, n = ag_count();
+     if (goal < 2 || goal >= disk_size)
+         goal = 2;
+     int g0 = goal / AG_BLOCKS;
+     for (int k = 0; k <= n; k++) {
+         int g = (g0 + k) % n;
+         if (ag_free[g] == 0)
+             continue;
+         int first = g * AG_BLOCKS, end = first + AG_BLOCKS;
+         if (k == 0)
+             first = goal;       /* and k == n is the rest of the group */
+         else if (k == n)
+             end = goal;
+         if (first < 2)
+             first = 2;
+         if (end > disk_size)
+             end = disk_size;
+         for (int i = first; i < end; i++) {
+             if (block_free(i)) {
+                 mark_used(i);
+                 if (meta_write(bitmap, 1) < 0)
+                     return -EIO;
+                 if (cow_mode() && birth_set(i) < 0)
+                     return -EIO;
+                 return i;
+             }
          }
      }
      return -ENOSPC;
  }
  
- /* free_block frees a block and update the bitmap */
+ /* allocate up to 'want' contiguous blocks, looking from 'goal' on
+  * (then wrapping around) for a free run that long, or else taking the
+  * longest one there is. Returns the first block and sets '*got'.
+  */
+ static int allocate_run(int goal, int want, int *got)
+ {
+     int disk_size = super()->disk_size, best = -1, best_len = 0;
+     if (goal < 2 || goal >= disk_size)
+         goal = 2;
+     while (goal > 2 && block_free(goal) && block_free(goal - 1))
+         goal--;                 /* the start of the run it's in */
+     int from[2] = {goal, 2}, to[2] = {disk_size, goal};
+     
+     for (int pass = 0; pass < 2 && best_len < want; pass++) {
+         for (int b = from[pass]; b < to[pass] && best_len < want; ) {
+             if (b % AG_BLOCKS == 0 && ag_free[b / AG_BLOCKS] == 0) {
+                 b += AG_BLOCKS;
+                 continue;
+             }
+             int n = 0;
+             while (b + n < to[pass] && n < want && block_free(b + n))
+                 n++;
+             if (n > best_len) {
+                 best = b;
+                 best_len = n;
+             }
+             b += n + 1;
+         }
+     }
+     if (best < 0)
+         return -ENOSPC;
+     for (int i = best; i < best + best_len; i++) {
+         mark_used(i);
+         if (cow_mode() && birth_set(i) < 0)
+             return -EIO;
+     }
+     if (meta_write(bitmap, 1) < 0)
+         return -EIO;
+     *got = best_len;
+     return best;
+ }
+ 
+ /* free_block frees a block and update the bitmap. A block shared
+  * with another file just loses a reference, and blocks a snapshot may
+  * be using stay allocated.
+  */
  static int free_block(int block_num) {
-     bit_clear(bitmap, block_num);
-     if (block_write((char*)bitmap, 1, 1) < 0)
+     cache_drop(block_num);
+     if (cloned(block_num))
+         return ref_add(block_num, -1);
+     if (snap_shared(block_num))
+         return 0;
+     return release_block(block_num);
+ }
+ 
+ /* return a block nothing uses any more to the free space */
+ static int release_block(int block_num)
+ {
+     if (journal_capacity() > 0) {
+         if (txn_add_freed(&handle, block_num) < 0)
+             return -ENOMEM;
+         pthread_mutex_lock(&j_lock);
+         bit_set(pinned, block_num);
+         bit_clear(bitmap, block_num);   /* counted free by unpin */
+         pthread_mutex_unlock(&j_lock);
+     } else {
+         mark_free(block_num);
+     }
+     if (meta_write(bitmap, 1) < 0)
          return -EIO;
      return 0;
  }
\ No newline at end of file
@@ -13,6 +13,13 @@
 #include "fs5600.h"
 
 extern void block_init(char *file);
+extern void fs_set_image(const char *file);
+extern int block_read(char *buf, int lba, int nblks);
+extern void fs_mount_snapshot(int id);
+extern void fs_set_mem_budget(size_t bytes);
+extern void fs_trace_enable(int nrecs);
+extern int fs_trace_dump(FILE *fp);
+extern int fs_record(FILE *fp);
 
 /* All homework functions are accessed through the operations
  * structure.  
@@ -20,10 +27,17 @@ extern void block_init(char *file);
 extern struct fuse_operations fs_ops;
 
 struct data {
-    char *image_name;
-    int   part;
-    int   cmd_mode;
-} _data;
+    char  *image_name;
+    int    part;
+    int    cmd_mode;
+    double attr_timeout;        /* seconds, <0 = FUSE default */
+    double entry_timeout;       /* seconds, <0 = FUSE default */
+    int    kernel_cache;
+    int    snapshot;            /* mount this snapshot read-only, 0 = none */
+    int    mem_budget;          /* MB of memory for caches etc, 0 = no limit */
+    char  *trace;               /* write a trace here at unmount */
+    char  *record;              /* record calls here, for replay */
+} _data = { .attr_timeout = -1, .entry_timeout = -1 };
 
 /**************/
 
@@ -31,15 +45,76 @@ struct data {
  * See comments in /usr/include/fuse/fuse_opts.h for details of 
  * FUSE argument processing.
  * 
- *  usage: ./homework -image disk.img directory
+ *  usage: ./homework -image disk.img [options] directory
  *              disk.img  - name of the image file to mount
  *              directory - directory to mount it on
+ *
+ *  options:
+ *      -attr_timeout N   - let the kernel cache attributes for N seconds
+ *      -entry_timeout N  - let the kernel cache name lookups for N seconds
+ *      -kernel_cache     - keep file data in the page cache across opens
+ *      -snapshot N       - mount snapshot N (read-only) instead
+ *      -mem_budget N     - keep caches and buffers within N megabytes
+ *      -trace FILE       - trace all calls and block I/O, save it to FILE
+ *                          at unmount (decode with read-trace.py)
+ *      -record FILE      - record every call to FILE, to play back with
+ *                          'replay'
+ *
+ * The image is only ever modified through this mount, and the kernel
+ * drops its cached attributes, entries and data for the requests it
+ * sends us, so long timeouts and -kernel_cache are safe - except for
+ * FS_IOC_CLONE, which replaces a file's data and size without the
+ * kernel knowing. The FUSE 2.7 high-level API has no way to tell it to
+ * drop them, so these options are refused for a copy-on-write image
+ * (other than a read-only snapshot mount).
  */
 static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
+    {"-attr_timeout %lf", offsetof(struct data, attr_timeout), 0},
+    {"-entry_timeout %lf", offsetof(struct data, entry_timeout), 0},
+    {"-kernel_cache", offsetof(struct data, kernel_cache), 1},
+    {"-snapshot %d", offsetof(struct data, snapshot), 0},
+    {"-mem_budget %d", offsetof(struct data, mem_budget), 0},
+    {"-trace %s", offsetof(struct data, trace), 0},
+    {"-record %s", offsetof(struct data, record), 0},
     FUSE_OPT_END
 };
 
+/* kernel caching is refused where a clone could make it stale (see
+ * above)
+ */
+static void check_cache_opts(void)
+{
+    char buf[FS_BLOCK_SIZE];
+    struct fs_super *sb = (struct fs_super *)buf;
+    if (_data.attr_timeout < 0 && _data.entry_timeout < 0 && !_data.kernel_cache)
+        return;
+    if (_data.snapshot > 0 || block_read(buf, 0, 1) < 0 ||
+        !(sb->features & FS_FEAT_COW))
+        return;
+    fprintf(stderr, "-attr_timeout, -entry_timeout and -kernel_cache can't be "
+            "used on a copy-on-write image: clones would leave the kernel's "
+            "cache stale\n");
+    exit(1);
+}
+
+/* pass the cache settings on to FUSE as regular '-o' mount options
+ */
+static void add_cache_opts(struct fuse_args *args)
+{
+    char opt[64];
+    if (_data.attr_timeout >= 0) {
+        snprintf(opt, sizeof(opt), "-oattr_timeout=%g", _data.attr_timeout);
+        fuse_opt_add_arg(args, opt);
+    }
+    if (_data.entry_timeout >= 0) {
+        snprintf(opt, sizeof(opt), "-oentry_timeout=%g", _data.entry_timeout);
+        fuse_opt_add_arg(args, opt);
+    }
+    if (_data.kernel_cache)
+        fuse_opt_add_arg(args, "-okernel_cache");
+}
+
 int main(int argc, char **argv)
 {
     /* Argument processing and checking
@@ -49,6 +124,43 @@ int main(int argc, char **argv)
 	exit(1);
 
     block_init(_data.image_name);
+    fs_set_image(_data.image_name);
+    check_cache_opts();
+    add_cache_opts(&args);
+    if (_data.mem_budget > 0)
+        fs_set_mem_budget((size_t)_data.mem_budget << 20);
+    if (_data.snapshot > 0) {
+        fs_mount_snapshot(_data.snapshot);
+        fuse_opt_add_arg(&args, "-oro");
+    }
+
+    FILE *trace = NULL;
+    if (_data.trace != NULL) {
+        if ((trace = fopen(_data.trace, "wb")) == NULL) {
+            perror(_data.trace);
+            exit(1);
+        }
+        fs_trace_enable(65536);
+    }
+    FILE *record = NULL;
+    if (_data.record != NULL) {
+        if ((record = fopen(_data.record, "wb")) == NULL ||
+            fs_record(record) < 0) {
+            perror(_data.record);
+            exit(1);
+        }
+    }
 
-    return fuse_main(args.argc, args.argv, &fs_ops, NULL);
+    int ret = fuse_main(args.argc, args.argv, &fs_ops, NULL);
+    if (trace != NULL) {
+        if (fs_trace_dump(trace) < 0)
+            perror(_data.trace);
+        fclose(trace);
+    }
+    if (record != NULL) {
+        if (fs_record(NULL) < 0)
+            perror(_data.record);
+        fclose(record);
+    }
+    return ret;
 }
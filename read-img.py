@@ -16,6 +16,29 @@ print ('superblock: magic:  %08X%s' %
            (sb.magic, ' *BAD*' if sb.magic != fs.MAGIC else ''))
 print ('            blocks: %d%s' %
            (sb.disk_sz, (' *BAD* %d' % nblks) if sb.disk_sz != nblks else ''))
+if sb.features & fs.FEAT_JOURNAL:
+    print ('            journal: %d blocks at %d' %
+               (sb.journal_len, sb.journal_start))
+if sb.orphans:
+    orphans = fs.orphans.from_buffer_copy(blks[sb.orphans])
+    print ('            orphans: %d at %d%s' %
+               (orphans.count, sb.orphans,
+                ''.join(' %d(<%d)' % (orphans.list[i].inum, orphans.list[i].next)
+                        for i in range(orphans.count))))
+if sb.features & fs.FEAT_LOG:
+    print ('            log-structured: %d-block segments' % sb.seg_size)
+    print ('            inode map: %d blocks at %d, owners: %d blocks at %d' %
+               (sb.imap_len, sb.imap_start, sb.owner_len, sb.owner_start))
+if sb.features & fs.FEAT_COW:
+    root = fs.snap_root.from_buffer_copy(blks[sb.snap_root])
+    print ('            copy-on-write: epoch %d, births: %d blocks at %d' %
+               (root.epoch, sb.birth_len, sb.birth_start))
+    print ('            clone refs: %d blocks at %d' %
+               (sb.refs_len, sb.refs_start))
+    for i in range(fs.MAX_SNAPSHOTS):
+        if root.snaps[i].epoch:
+            print ('            snapshot %d: epoch %d, time %d' %
+                       (i + 1, root.snaps[i].epoch, root.snaps[i].ctime))
 print
 
 blkmap = fs.bitmap.from_buffer_copy(blks[1])
@@ -36,12 +59,23 @@ print ('\n')
 names = dict()
 names[2] = ''
 
+# on log-structured and COW images inodes move; find them through the
+# inode map
+def inode_blk(inum):
+    if sb.features & fs.FEAT_LOG:
+        i = sb.imap_start + inum // 1024
+    elif sb.features & fs.FEAT_COW:
+        i = root.imap[inum // 1024]
+    else:
+        return inum
+    return int.from_bytes(blks[i][(inum % 1024)*4:(inum % 1024)*4+4], 'little')
+
 def iter(name, inum, v):
     assert inum < nblks
     children = []
     inodes[inum] = 1
-    _in = fs.inode.from_buffer_copy(blks[inum])
-    alloc = '' if blkmap.get(inum) else 'NOT MARKED IN BITMAP '
+    _in = fs.inode.from_buffer_copy(blks[inode_blk(inum)])
+    alloc = '' if blkmap.get(inode_blk(inum)) else 'NOT MARKED IN BITMAP '
     s = '/' if name == '' else name
 
     if v:
@@ -53,10 +87,17 @@ def iter(name, inum, v):
     if fs.S_ISREG(_in.mode):
         if v:
             print ('  blocks: ', end='')
+        # fallocate may have reserved blocks past the end
+        xblks = max([i + 1 for i in range(len(_in.ptrs)) if _in.ptrs[i]] + [xblks])
         for i in range(xblks):
-            alloc = '' if blkmap.get(_in.ptrs[i]) else '(NOT ALLOCATED)'
+            blk = _in.ptrs[i] & ~fs.PTR_UNWRITTEN
+            alloc = '' if blkmap.get(blk) else '(NOT ALLOCATED)'
+            if _in.ptrs[i] == 0:
+                alloc = '(hole)'
+            elif _in.ptrs[i] & fs.PTR_UNWRITTEN:
+                alloc += '(unwritten)'
             if v:
-                print (str(_in.ptrs[i]) + alloc, end=' '),
+                print (str(blk) + alloc, end=' '),
         print("\n")
         if v:
             print
@@ -0,0 +1,51 @@
+#!/usr/bin/python
+# decode a trace from 'hw3fuse -trace FILE' or mnt/.terrafs/trace:
+#   read-trace.py FILE [-s]
+# prints one line per call and block I/O, in time order; -s prints a
+# per-call summary instead
+import sys
+import ctypes
+import diskfmt as fs
+
+data = open(sys.argv[1], 'rb').read()
+hdr = fs.trace_hdr.from_buffer_copy(data)
+if hdr.magic != fs.TRACE_MAGIC or hdr.rec_size != ctypes.sizeof(fs.trace_rec):
+    print ('BAD TRACE: magic %08X record size %d' % (hdr.magic, hdr.rec_size))
+    sys.exit(1)
+ops = [hdr.ops[i].value.decode() for i in range(hdr.nops)]
+
+def op_name(op):
+    return ops[op] if op < len(ops) else '-'
+
+recs = [fs.trace_rec.from_buffer_copy(data, ctypes.sizeof(hdr) + i * hdr.rec_size)
+        for i in range(hdr.nrecs)]
+t0 = recs[0].time if recs else 0
+
+if len(sys.argv) > 2 and sys.argv[2] == '-s':
+    calls = dict()
+    for r in recs:
+        if r.type == fs.TRACE_OP:
+            c = calls.setdefault(op_name(r.op), [0, 0, 0, [0] * 4])
+            c[0] += 1
+            c[1] += r.result < 0
+            c[2] += r.latency
+        else:
+            c = calls.setdefault(op_name(r.op), [0, 0, 0, [0] * 4])
+            c[3][r.kind] += r.len
+    print ('%-10s %8s %8s %10s %8s %8s %8s %8s' %
+           ('op', 'calls', 'errors', 'avg_us', *fs.TRACE_KINDS))
+    for name, c in sorted(calls.items()):
+        print ('%-10s %8d %8d %10.1f %8d %8d %8d %8d' %
+               (name, c[0], c[1], c[2] / 1000 / max(c[0], 1), *c[3]))
+    sys.exit(0)
+
+for r in recs:
+    t = (r.time - t0) / 1000
+    if r.type == fs.TRACE_OP:
+        print ('%12.1f %3d %-10s inode %d offset %d len %d -> %d (%.1f us)' %
+               (t, r.thread, op_name(r.op), r.inum, r.offset, r.len,
+                r.result, r.latency / 1000))
+    else:
+        print ('%12.1f %3d   %-10s %s block %d count %d%s (%.1f us)' %
+               (t, r.thread, op_name(r.op), fs.TRACE_KINDS[r.kind], r.offset,
+                r.len, ' FAILED' if r.result < 0 else '', r.latency / 1000))
@@ -0,0 +1,297 @@
+/*
+ * file:        replay.c
+ * description: play back a recording of fs_ops calls (hw3fuse -record)
+ *              against an image, calling fs_ops directly as the unit
+ *              tests do, and report how long the calls took
+ *
+ *  usage: ./replay [-t] [-f] image recording
+ *      -t  one thread per recorded thread, each making its calls in
+ *          order (default: one thread makes every call, in the order
+ *          they started)
+ *      -f  as fast as possible (default: start each call at the same
+ *          time after the start as in the recording)
+ *
+ * Writes write a fixed pattern, since recordings don't hold file data.
+ */
+#define FUSE_USE_VERSION 27
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/ioctl.h>
+#include <utime.h>
+#include <fuse.h>
+
+#include "fs5600.h"
+
+extern struct fuse_operations fs_ops;
+extern void block_init(char *file);
+extern void fs_set_image(const char *file);
+
+/* calls are made as this user */
+struct fuse_context ctx = { .uid = 500, .gid = 500 };
+struct fuse_context *fuse_get_context(void)
+{
+    return &ctx;
+}
+
+enum { GETATTR, READDIR, READ, STATFS, FSYNC, CREATE, MKDIR, UNLINK,
+       RMDIR, RENAME, CHMOD, UTIME, TRUNCATE, WRITE, FALLOCATE, IOCTL, NCALLS };
+static const char *call_names[NCALLS] = {
+    "getattr", "readdir", "read", "statfs", "fsync", "create", "mkdir",
+    "unlink", "rmdir", "rename", "chmod", "utime", "truncate", "write",
+    "fallocate", "ioctl" };
+
+struct call {
+    struct fs_record r;
+    int what;                   /* GETATTR etc, or -1 if unknown */
+    char *path, *path2;
+    uint64_t ns;                /* how long it took this time */
+    int result;
+};
+
+static struct call *calls;
+static int ncalls, fast;
+static char *wbuf;              /* what writes write */
+static size_t max_len;
+static uint64_t t0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int no_filler(void *ptr, const char *name, const struct stat *sb, off_t off)
+{
+    return 0;
+}
+
+static int make_call(struct call *c, char *rbuf)
+{
+    struct fs_record *r = &c->r;
+    struct stat sb;
+    struct statvfs sv;
+    struct utimbuf ut = { .actime = r->offset, .modtime = r->offset };
+
+    switch (c->what) {
+    case GETATTR:   return fs_ops.getattr(c->path, &sb);
+    case READDIR:   return fs_ops.readdir(c->path, NULL, no_filler, 0, NULL);
+    case READ:      return fs_ops.read(c->path, rbuf, r->len, r->offset, NULL);
+    case STATFS:    return fs_ops.statfs(c->path, &sv);
+    case FSYNC:     return fs_ops.fsync(c->path, 0, NULL);
+    case CREATE:    return fs_ops.create(c->path, r->mode, NULL);
+    case MKDIR:     return fs_ops.mkdir(c->path, r->mode);
+    case UNLINK:    return fs_ops.unlink(c->path);
+    case RMDIR:     return fs_ops.rmdir(c->path);
+    case RENAME:    return fs_ops.rename(c->path, c->path2);
+    case CHMOD:     return fs_ops.chmod(c->path, r->mode);
+    case UTIME:     return fs_ops.utime(c->path, &ut);
+    case TRUNCATE:  return fs_ops.truncate(c->path, r->offset);
+    case WRITE:     return fs_ops.write(c->path, wbuf, r->len, r->offset, NULL);
+    case FALLOCATE: return fs_ops.fallocate(c->path, r->mode, r->offset, r->len, NULL);
+    case IOCTL:
+        if (r->mode == FS_IOC_CLONE) {
+            struct fs_clone_args args;
+            snprintf(args.src, sizeof(args.src), "%s", c->path2);
+            return fs_ops.ioctl(c->path, r->mode, NULL, NULL, 0, &args);
+        } else {
+            uint32_t id = r->offset;        /* FS_IOC_SNAPDEL's */
+            return fs_ops.ioctl(c->path, r->mode, NULL, NULL, 0, &id);
+        }
+    }
+    return -ENOSYS;
+}
+
+/* make the calls in 'list' in order, keeping to the recorded timing
+ * unless 'fast'
+ */
+static void replay(struct call **list, int n)
+{
+    char *rbuf = malloc(max_len);
+    for (int i = 0; i < n; i++) {
+        struct call *c = list[i];
+        if (!fast) {
+            int64_t wait = (int64_t)(t0 + c->r.time - now_ns());
+            if (wait > 0) {
+                struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+        uint64_t start = now_ns();
+        c->result = make_call(c, rbuf);
+        c->ns = now_ns() - start;
+    }
+    free(rbuf);
+}
+
+struct thread {
+    pthread_t tid;
+    struct call **list;
+    int n;
+};
+
+static void *thread_main(void *arg)
+{
+    struct thread *t = arg;
+    replay(t->list, t->n);
+    return NULL;
+}
+
+static int cmp_start(const void *a, const void *b)
+{
+    const struct call *x = *(struct call **)a, *y = *(struct call **)b;
+    return x->r.time < y->r.time ? -1 : x->r.time > y->r.time;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* read a recording into 'calls' */
+static void load(char *file)
+{
+    FILE *fp = fopen(file, "rb");
+    struct fs_trace_hdr h;
+    if (fp == NULL || fread(&h, sizeof(h), 1, fp) != 1) {
+        perror(file);
+        exit(1);
+    }
+    if (h.magic != FS_RECORD_MAGIC || h.rec_size != sizeof(struct fs_record)) {
+        fprintf(stderr, "%s: not a recording\n", file);
+        exit(1);
+    }
+    int map[32];                /* recorded op -> GETATTR etc */
+    for (int i = 0; i < 32; i++) {
+        map[i] = -1;
+        for (int j = 0; j < NCALLS && i < h.nops; j++)
+            if (strncmp(h.ops[i], call_names[j], sizeof(h.ops[i])) == 0)
+                map[i] = j;
+    }
+
+    int max = 0;
+    struct fs_record r;
+    while (fread(&r, sizeof(r), 1, fp) == 1) {
+        if (ncalls == max) {
+            max = max ? max * 2 : 1024;
+            calls = realloc(calls, max * sizeof(*calls));
+        }
+        struct call *c = &calls[ncalls++];
+        c->r = r;
+        c->what = r.op < 32 ? map[r.op] : -1;
+        c->path = calloc(r.path_len + 1, 1);
+        c->path2 = calloc(r.path2_len + 1, 1);
+        if (fread(c->path, 1, r.path_len, fp) != r.path_len ||
+            fread(c->path2, 1, r.path2_len, fp) != r.path2_len) {
+            fprintf(stderr, "%s: truncated\n", file);
+            ncalls--;
+            break;
+        }
+        if (r.len > max_len)
+            max_len = r.len;
+    }
+    fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+    int threaded = 0, opt;
+    while ((opt = getopt(argc, argv, "tf")) != -1) {
+        if (opt == 't')
+            threaded = 1;
+        else if (opt == 'f')
+            fast = 1;
+        else
+            break;
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-t] [-f] image recording\n", argv[0]);
+        exit(1);
+    }
+    load(argv[optind + 1]);
+    wbuf = malloc(max_len + 1);
+    for (size_t i = 0; i < max_len; i++)
+        wbuf[i] = 'A' + i % 26;
+
+    block_init(argv[optind]);
+    fs_set_image(argv[optind]);
+    fs_ops.init(NULL);
+
+    /* split the calls by recorded thread, or put them all in one list
+     * in the order they started
+     */
+    struct call **order = malloc(ncalls * sizeof(*order));
+    for (int i = 0; i < ncalls; i++)
+        order[i] = &calls[i];
+    int nthreads = 0;
+    struct thread *threads = calloc(threaded ? 65536 : 1, sizeof(*threads));
+    if (threaded) {
+        int *count = calloc(65536, sizeof(int));
+        for (int i = 0; i < ncalls; i++)
+            count[calls[i].r.thread]++;
+        for (int t = 0, pos = 0; t < 65536; t++) {
+            if (count[t] == 0)
+                continue;
+            threads[nthreads].list = order + pos;
+            threads[nthreads++].n = 0;
+            pos += count[t];
+            count[t] = nthreads;    /* index + 1 */
+        }
+        for (int i = 0; i < ncalls; i++) {
+            struct thread *t = &threads[count[calls[i].r.thread] - 1];
+            t->list[t->n++] = &calls[i];
+        }
+        free(count);
+    } else {
+        qsort(order, ncalls, sizeof(*order), cmp_start);
+        threads[nthreads].list = order;
+        threads[nthreads++].n = ncalls;
+    }
+
+    t0 = now_ns();
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i].tid, NULL, thread_main, &threads[i]);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i].tid, NULL);
+    uint64_t elapsed = now_ns() - t0;
+    fs_ops.destroy(NULL);
+
+    /* per call: how many, how many came out differently from the
+     * recording, recorded and replayed average latency, and replayed
+     * percentiles
+     */
+    uint64_t *ns = malloc((ncalls + 1) * sizeof(*ns));
+    printf("%-10s %8s %8s %10s %10s %10s %10s %10s\n", "op", "calls", "differ",
+           "rec_us", "avg_us", "p50_us", "p99_us", "max_us");
+    for (int w = 0; w < NCALLS; w++) {
+        int n = 0, differ = 0;
+        uint64_t rec = 0, sum = 0;
+        for (int i = 0; i < ncalls; i++) {
+            if (calls[i].what != w)
+                continue;
+            differ += calls[i].result != calls[i].r.result;
+            rec += calls[i].r.latency;
+            sum += calls[i].ns;
+            ns[n++] = calls[i].ns;
+        }
+        if (n == 0)
+            continue;
+        qsort(ns, n, sizeof(*ns), cmp_u64);
+        printf("%-10s %8d %8d %10.1f %10.1f %10.1f %10.1f %10.1f\n", call_names[w],
+               n, differ, rec / 1000.0 / n, sum / 1000.0 / n, ns[n / 2] / 1000.0,
+               ns[(int)(n * 0.99)] / 1000.0, ns[n - 1] / 1000.0);
+    }
+    printf("%d calls in %.3f s (%d threads): %.0f calls/s\n", ncalls, elapsed / 1e9,
+           nthreads, ncalls / (elapsed / 1e9));
+    return 0;
+}
@@ -19,6 +19,7 @@
 
  extern struct fuse_operations fs_ops;
  extern void block_init(char *file);
+ extern void fs_set_image(const char *file);
 
  typedef struct {
     char *path;
@@ -54,6 +55,7 @@ ro_test_t ro_files[] = {
 void test_setup(void) {
     system("python gen-disk.py -q disk1.in test.img");
     block_init("test.img");
+    fs_set_image("test.img");
     fs_ops.init(NULL);
  }
  
@@ -311,17 +313,64 @@ END_TEST
 }
 END_TEST
 
+/* Test for fs_rename across directories - move "/file.10" into /dir2
+ * and "/dir3/subdir" (with its files) into /dir2 too */
+START_TEST(test_rename_cross_dir) {
+    struct stat st;
+    char buf[4095];
+    int ret = fs_ops.rename("/file.10", "/dir2/file.10");
+    ck_assert_int_eq(ret, 0);
+    ck_assert_int_eq(fs_ops.getattr("/file.10", &st), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/dir2/file.10", &st), 0);
+    ck_assert_int_eq(st.st_size, 10);
+    ret = fs_ops.read("/dir2/file.10", buf, 10, 0, NULL);
+    ck_assert_int_eq(ret, 10);
+    ck_assert_uint_eq(crc32(0, (const Bytef *)buf, 10), 3766980606);
+
+    ret = fs_ops.rename("/dir3/subdir", "/dir2/subdir");
+    ck_assert_int_eq(ret, 0);
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir", &st), -ENOENT);
+    ret = fs_ops.read("/dir2/subdir/file.4k-", buf, 4095, 0, NULL);
+    ck_assert_int_eq(ret, 4095);
+    ck_assert_uint_eq(crc32(0, (const Bytef *)buf, 4095), 2991486384);
+}
+END_TEST
+
+/* Test for fs_rename onto an existing file, which it replaces */
+START_TEST(test_rename_replace) {
+    struct stat st;
+    char buf[1000];
+    int ret = fs_ops.rename("/file.1k", "/file.8k+");
+    ck_assert_int_eq(ret, 0);
+    ck_assert_int_eq(fs_ops.getattr("/file.1k", &st), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/file.8k+", &st), 0);
+    ck_assert_int_eq(st.st_size, 1000);
+    ret = fs_ops.read("/file.8k+", buf, 1000, 0, NULL);
+    ck_assert_int_eq(ret, 1000);
+    ck_assert_uint_eq(crc32(0, (const Bytef *)buf, 1000), 1726121896);
+}
+END_TEST
+
 /* Test for fs_rename errors */
 START_TEST(test_fs_rename_errors)
 {
     int ret = fs_ops.rename("/does-not-exist", "/does-not-exist_new");
     ck_assert_int_eq(ret, -ENOENT);
 
-    ret = fs_ops.rename("/file.1k", "/file.8k+");
-    ck_assert_int_eq(ret, -EEXIST);
+    ret = fs_ops.rename("/file.1k", "/dir2");
+    ck_assert_int_eq(ret, -EISDIR);
 
-    ret = fs_ops.rename("/file.10", "/dir2/file.10");
+    ret = fs_ops.rename("/dir2", "/file.1k");
+    ck_assert_int_eq(ret, -ENOTDIR);
+
+    ret = fs_ops.rename("/dir2", "/dir3");
+    ck_assert_int_eq(ret, -ENOTEMPTY);
+
+    ret = fs_ops.rename("/dir3", "/dir3/subdir/dir3");
     ck_assert_int_eq(ret, -EINVAL);
+
+    ret = fs_ops.rename("/file.10", "/no-such-dir/file.10");
+    ck_assert_int_eq(ret, -ENOENT);
 }
 END_TEST
  
@@ -380,6 +429,8 @@ int main(int argc, char **argv) {
     tcase_add_test(tc, test_statfs);
     tcase_add_test(tc, test_rename);
     tcase_add_test(tc, test_rename_directory);
+    tcase_add_test(tc, test_rename_cross_dir);
+    tcase_add_test(tc, test_rename_replace);
     tcase_add_test(tc, test_fs_rename_errors);
     tcase_add_test(tc, test_chmod);
     tcase_add_test(tc, test_fs_chmod_directory);
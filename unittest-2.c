@@ -9,12 +9,17 @@
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
+ #include <unistd.h>
+ #include <fcntl.h>
  #include <check.h>
  #include <errno.h>
  #include <sys/stat.h>
+ #include <sys/ioctl.h>
+ #include <linux/falloc.h>
  #include <utime.h>
  #include <fuse.h>
  #include <zlib.h>
+#include <pthread.h>
  #include "fs5600.h"
  
 
@@ -24,16 +29,30 @@
      return &ctx;
  }
  
- extern struct fuse_operations fs_ops;
- extern void block_init(char *file);
+extern struct fuse_operations fs_ops;
+extern void block_init(char *file);
+extern void fs_set_image(const char *file);
+extern int block_read(char *buf, int lba, int nblks);
+extern int block_write(char *buf, int lba, int nblks);
+extern void fs_mount_snapshot(int id);
+extern void fs_mem_stats(struct fs_mem_stats *st);
+extern void fs_set_mem_budget(size_t bytes);
+extern int fs_io_profile(const char *op, struct fs_io_profile *p);
+extern void fs_trace_enable(int nrecs);
+extern int fs_trace_dump(FILE *fp);
+extern int fs_record(FILE *fp);
 
 void test_setup(void) {
    system("python gen-disk.py -q disk2.in test2.img");
    block_init("test2.img");
+   fs_set_image("test2.img");
    fs_ops.init(NULL);
 }
 
-void test_teardown(void) {}
+/* unmount, so delayed writes don't outlive the image */
+void test_teardown(void) {
+   fs_ops.destroy(NULL);
+}
 
 //Helper to generate pattern into buffer
 void generate_pattern(char *buf, size_t len, int start)
@@ -261,6 +280,7 @@ START_TEST(test_fs_mkdir_multiple)
 {
     system("python gen-disk.py -q disk2.in test2.img");
     block_init("test2.img");
+    fs_set_image("test2.img");
     fs_ops.init(NULL);
 
     const char *dir_paths[] = {"/dir1", "/dir2", "/dir3"};
@@ -522,15 +542,18 @@ START_TEST(test_trunc_eq_2blk) { test_truncate_values("/tD",  8192);  } END_TEST
 START_TEST(test_trunc_lt_3blk) { test_truncate_values("/tE", 10000);  } END_TEST
 START_TEST(test_trunc_eq_3blk) { test_truncate_values("/tF", 12288);  } END_TEST
 
-/* Test for fs_truncate errors (non-zero length, non existant parent, parent not a dir, file non existant, target is a dir) */
+/* Test for fs_truncate errors (negative or too large length, non existant parent, parent not a dir, file non existant, target is a dir) */
 START_TEST(test_truncate_errors)
 {
     int ret = fs_ops.create("/invalid_truncate", 0100777, NULL);
     ck_assert_int_eq(ret, 0);
 
-    ret = fs_ops.truncate("/invalid_truncate", 1000);
+    ret = fs_ops.truncate("/invalid_truncate", -1);
     ck_assert_int_eq(ret, -EINVAL);
 
+    ret = fs_ops.truncate("/invalid_truncate", 2000L * FS_BLOCK_SIZE);
+    ck_assert_int_eq(ret, -EFBIG);
+
     ret = fs_ops.unlink("/invalid_truncate");
     ck_assert_int_eq(ret, 0);
 
@@ -558,9 +581,12 @@ START_TEST(test_truncate_errors)
 }
 END_TEST
 
-/* Test for fs_truncate to length greater than current size */
-START_TEST(test_fs_truncate_invalid)
+/* Test for fs_truncate to length greater than current size: the new
+ * part reads as zeros, and takes no blocks */
+START_TEST(test_fs_truncate_extend)
 {
+    struct statvfs before, after;
+    ck_assert_int_eq(fs_ops.statfs("/", &before), 0);
     int ret = fs_ops.create("/trunc-file", 0100777, NULL);
     ck_assert_int_eq(ret, 0);
 
@@ -573,7 +599,19 @@ START_TEST(test_fs_truncate_invalid)
     free(buf);
 
     ret = fs_ops.truncate("/trunc-file", 3000);
-    ck_assert_int_eq(ret, -EINVAL);
+    ck_assert_int_eq(ret, 0);
+    ret = fs_ops.truncate("/trunc-file", 100 * FS_BLOCK_SIZE);
+    ck_assert_int_eq(ret, 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree - 2);   /* inode, block 0 */
+
+    char rbuf[FS_BLOCK_SIZE], zeros[FS_BLOCK_SIZE] = {0};
+    ret = fs_ops.read("/trunc-file", rbuf, FS_BLOCK_SIZE, 0, NULL);
+    ck_assert_int_eq(ret, FS_BLOCK_SIZE);
+    ck_assert(memcmp(rbuf + 1000, zeros, FS_BLOCK_SIZE - 1000) == 0);
+    ret = fs_ops.read("/trunc-file", rbuf, FS_BLOCK_SIZE, 50 * FS_BLOCK_SIZE, NULL);
+    ck_assert_int_eq(ret, FS_BLOCK_SIZE);
+    ck_assert(memcmp(rbuf, zeros, FS_BLOCK_SIZE) == 0);
 }
 END_TEST
  
@@ -1084,6 +1122,347 @@ START_TEST(test_write_overwrite_eq_2blk) { test_write_overwrite_values("/o4", 81
 START_TEST(test_write_overwrite_lt_3blk) { test_write_overwrite_values("/o5", 10000); } END_TEST
 START_TEST(test_write_overwrite_eq_3blk) { test_write_overwrite_values("/o6", 12288); } END_TEST
 
+ /* Test: an overwrite with a partial head block, whole blocks, and a
+  * partial tail, extending the file - whole and new blocks are written
+  * without reading them, partial ones merged with what's there.
+  */
+ START_TEST(test_write_overwrite_partial_edges) {
+     const int LEN = 4 * FS_BLOCK_SIZE, OFF = 1000, N = 4 * FS_BLOCK_SIZE;
+     char expect[OFF + N], buf[OFF + N];
+     generate_pattern(expect, LEN, 0);
+     ck_assert_int_eq(fs_ops.create("/o7", 0100666, NULL), 0);
+     ck_assert_int_eq(fs_ops.write("/o7", expect, LEN, 0, NULL), LEN);
+
+     generate_pattern(expect + OFF, N, 500);
+     ck_assert_int_eq(fs_ops.write("/o7", expect + OFF, N, OFF, NULL), N);
+     ck_assert_int_eq(fs_ops.read("/o7", buf, OFF + N, 0, NULL), OFF + N);
+     ck_assert(memcmp(buf, expect, OFF + N) == 0);
+ }
+ END_TEST
+
+ /* Test: a write that starts and ends inside the same block, and one
+  * that ends inside a freshly allocated block.
+  */
+ START_TEST(test_write_within_block) {
+     const int LEN = 3 * FS_BLOCK_SIZE + 10;
+     char expect[LEN], buf[LEN];
+     generate_pattern(expect, 2 * FS_BLOCK_SIZE, 9);
+     ck_assert_int_eq(fs_ops.create("/o8", 0100666, NULL), 0);
+     ck_assert_int_eq(fs_ops.write("/o8", expect, 2 * FS_BLOCK_SIZE, 0, NULL), 2 * FS_BLOCK_SIZE);
+
+     generate_pattern(expect + 5000, 50, 77);
+     ck_assert_int_eq(fs_ops.write("/o8", expect + 5000, 50, 5000, NULL), 50);
+     generate_pattern(expect + 8000, LEN - 8000, 99);
+     ck_assert_int_eq(fs_ops.write("/o8", expect + 8000, LEN - 8000, 8000, NULL), LEN - 8000);
+     ck_assert_int_eq(fs_ops.read("/o8", buf, LEN, 0, NULL), LEN);
+     ck_assert(memcmp(buf, expect, LEN) == 0);
+ }
+ END_TEST
+
+ /* Test: large reads, aligned and not, of a file whose blocks are
+  * partly contiguous on disk - whole blocks are read in runs straight
+  * into the caller's buffer, partial ones a block at a time.
+  */
+ START_TEST(test_read_multiblock) {
+     const int LEN = 24 * FS_BLOCK_SIZE;
+     char *expect = malloc(LEN), *buf = malloc(LEN);
+     generate_pattern(expect, LEN, 3);
+     ck_assert_int_eq(fs_ops.create("/r1", 0100666, NULL), 0);
+     ck_assert_int_eq(fs_ops.create("/r2", 0100666, NULL), 0);
+     for (int i = 0; i < LEN; i += 8 * FS_BLOCK_SIZE) {
+         ck_assert_int_eq(fs_ops.write("/r1", expect + i, 8 * FS_BLOCK_SIZE, i, NULL), 8 * FS_BLOCK_SIZE);
+         ck_assert_int_eq(fs_ops.write("/r2", expect, FS_BLOCK_SIZE, i / 8, NULL), FS_BLOCK_SIZE);
+     }
+     int offs[] = {0, 0, 100, 4096, 5000, 8 * FS_BLOCK_SIZE - 1};
+     int lens[] = {LEN, 8192, LEN, 20 * FS_BLOCK_SIZE, 40000, 2};
+     for (int i = 0; i < 6; i++) {
+         int n = lens[i];
+         if (offs[i] + n > LEN)
+             n = LEN - offs[i];
+         memset(buf, 0, LEN);
+         ck_assert_int_eq(fs_ops.read("/r1", buf, lens[i], offs[i], NULL), n);
+         ck_assert(memcmp(buf, expect + offs[i], n) == 0);
+     }
+     free(expect);
+     free(buf);
+ }
+ END_TEST
+
+ /* Test: cached and read-ahead blocks never go stale - not after the
+  * file is overwritten, nor after its blocks are freed and reused by
+  * another file.
+  */
+ START_TEST(test_read_cache_coherent) {
+     const int LEN = 40 * FS_BLOCK_SIZE, CHUNK = 8 * FS_BLOCK_SIZE;
+     char *expect = malloc(LEN), *buf = malloc(LEN);
+     generate_pattern(expect, LEN, 31);
+     ck_assert_int_eq(fs_ops.create("/c1", 0100666, NULL), 0);
+     ck_assert_int_eq(fs_ops.write("/c1", expect, LEN, 0, NULL), LEN);
+     for (int off = 0; off < LEN; off += CHUNK)
+         ck_assert_int_eq(fs_ops.read("/c1", buf + off, CHUNK, off, NULL), CHUNK);
+     ck_assert(memcmp(buf, expect, LEN) == 0);
+
+     generate_pattern(expect + 10000, 3 * CHUNK, 32);
+     ck_assert_int_eq(fs_ops.write("/c1", expect + 10000, 3 * CHUNK, 10000, NULL), 3 * CHUNK);
+     for (int off = 0; off < LEN; off += CHUNK)
+         ck_assert_int_eq(fs_ops.read("/c1", buf + off, CHUNK, off, NULL), CHUNK);
+     ck_assert(memcmp(buf, expect, LEN) == 0);
+
+     ck_assert_int_eq(fs_ops.unlink("/c1"), 0);
+     generate_pattern(expect, LEN, 33);
+     ck_assert_int_eq(fs_ops.create("/c2", 0100666, NULL), 0);
+     ck_assert_int_eq(fs_ops.write("/c2", expect, LEN, 0, NULL), LEN);
+     for (int off = 0; off < LEN; off += CHUNK)
+         ck_assert_int_eq(fs_ops.read("/c2", buf + off, CHUNK, off, NULL), CHUNK);
+     ck_assert(memcmp(buf, expect, LEN) == 0);
+     free(expect);
+     free(buf);
+ }
+ END_TEST
+
+ /* Test: writing past the end leaves a hole that reads as zeros and
+  * takes no blocks; writing into the hole later fills it in.
+  */
+ START_TEST(test_write_sparse) {
+     const int GAP = 10 * FS_BLOCK_SIZE + 123, LEN = 3 * FS_BLOCK_SIZE;
+     char *expect = calloc(1, GAP + LEN), *buf = malloc(GAP + LEN);
+     struct statvfs before, after;
+     struct stat sb;
+     ck_assert_int_eq(fs_ops.statfs("/", &before), 0);
+
+     generate_pattern(expect, 500, 41);
+     generate_pattern(expect + GAP, LEN, 42);
+     ck_assert_int_eq(fs_ops.create("/sparse", 0100666, NULL), 0);
+     ck_assert_int_eq(fs_ops.write("/sparse", expect, 500, 0, NULL), 500);
+     ck_assert_int_eq(fs_ops.write("/sparse", expect + GAP, LEN, GAP, NULL), LEN);
+     ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+     ck_assert_int_eq(after.f_bfree, before.f_bfree - 6);   /* inode, 0, 10-13 */
+     ck_assert_int_eq(fs_ops.getattr("/sparse", &sb), 0);
+     ck_assert_int_eq(sb.st_blocks, 5 * FS_BLOCK_SIZE / 512);
+     ck_assert_int_eq(fs_ops.read("/sparse", buf, GAP + LEN, 0, NULL), GAP + LEN);
+     ck_assert(memcmp(buf, expect, GAP + LEN) == 0);
+
+     generate_pattern(expect + 5 * FS_BLOCK_SIZE + 7, 100, 43);
+     ck_assert_int_eq(fs_ops.write("/sparse", expect + 5 * FS_BLOCK_SIZE + 7, 100, 5 * FS_BLOCK_SIZE + 7, NULL), 100);
+     ck_assert_int_eq(fs_ops.read("/sparse", buf, GAP + LEN, 0, NULL), GAP + LEN);
+     ck_assert(memcmp(buf, expect, GAP + LEN) == 0);
+
+     /* shrink into the middle of a block, then grow: the cut-off part
+      * comes back as zeros */
+     ck_assert_int_eq(fs_ops.truncate("/sparse", GAP + 10), 0);
+     ck_assert_int_eq(fs_ops.truncate("/sparse", GAP + LEN), 0);
+     memset(expect + GAP + 10, 0, LEN - 10);
+     ck_assert_int_eq(fs_ops.read("/sparse", buf, GAP + LEN, 0, NULL), GAP + LEN);
+     ck_assert(memcmp(buf, expect, GAP + LEN) == 0);
+     ck_assert_int_eq(fs_ops.fsync("/sparse", 0, NULL), 0);
+     ck_assert_int_eq(fs_ops.getattr("/sparse", &sb), 0);
+     ck_assert_int_eq(sb.st_blocks, 3 * FS_BLOCK_SIZE / 512);  /* 0, 5, 10 */
+
+     /* a whole number of blocks takes just those */
+     ck_assert_int_eq(fs_ops.truncate("/sparse", FS_BLOCK_SIZE), 0);
+     ck_assert_int_eq(fs_ops.getattr("/sparse", &sb), 0);
+     ck_assert_int_eq(sb.st_blocks, FS_BLOCK_SIZE / 512);
+
+     ck_assert_int_eq(fs_ops.unlink("/sparse"), 0);
+     ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+     ck_assert_int_eq(after.f_bfree, before.f_bfree);
+     free(expect);
+     free(buf);
+ }
+ END_TEST
+
+ START_TEST(test_write_zero_blocks) {
+     const int LEN = 8 * FS_BLOCK_SIZE;
+     char *expect = calloc(1, LEN), *buf = malloc(LEN);
+     struct statvfs before, after;
+     ck_assert_int_eq(fs_ops.statfs("/", &before), 0);
+
+     /* blocks 0, 3 and 7 have data, the rest are all zeros */
+     generate_pattern(expect, FS_BLOCK_SIZE, 51);
+     memset(expect + 3 * FS_BLOCK_SIZE + 100, 'x', 10);
+     expect[LEN - 1] = 'y';
+     ck_assert_int_eq(fs_ops.create("/zeros", 0100666, NULL), 0);
+     ck_assert_int_eq(fs_ops.write("/zeros", expect, LEN, 0, NULL), LEN);
+     ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+     ck_assert_int_eq(after.f_bfree, before.f_bfree - 4);   /* inode, 0, 3, 7 */
+     ck_assert_int_eq(fs_ops.read("/zeros", buf, LEN, 0, NULL), LEN);
+     ck_assert(memcmp(buf, expect, LEN) == 0);
+
+     /* zeroing out the data in a block frees it */
+     memset(expect + 3 * FS_BLOCK_SIZE + 100, 0, 10);
+     ck_assert_int_eq(fs_ops.write("/zeros", expect + 3 * FS_BLOCK_SIZE + 100, 10, 3 * FS_BLOCK_SIZE + 100, NULL), 10);
+     ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+     ck_assert_int_eq(after.f_bfree, before.f_bfree - 3);
+     ck_assert_int_eq(fs_ops.read("/zeros", buf, LEN, 0, NULL), LEN);
+     ck_assert(memcmp(buf, expect, LEN) == 0);
+
+     ck_assert_int_eq(fs_ops.unlink("/zeros"), 0);
+     ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+     ck_assert_int_eq(after.f_bfree, before.f_bfree);
+     free(expect);
+     free(buf);
+ }
+ END_TEST
+
+ START_TEST(test_fallocate) {
+     const int LEN = 8 * FS_BLOCK_SIZE;
+     char *expect = calloc(1, LEN), *buf = malloc(LEN);
+     struct statvfs before, after;
+     struct stat sb;
+     ck_assert_int_eq(fs_ops.statfs("/", &before), 0);
+     ck_assert_int_eq(fs_ops.create("/falloc", 0100666, NULL), 0);
+
+     /* reserved space reads as zeros, and writing into it doesn't
+      * allocate anything more */
+     ck_assert_int_eq(fs_ops.fallocate("/falloc", 0, 0, 4 * FS_BLOCK_SIZE, NULL), 0);
+     ck_assert_int_eq(fs_ops.getattr("/falloc", &sb), 0);
+     ck_assert_int_eq(sb.st_size, 4 * FS_BLOCK_SIZE);
+     ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+     ck_assert_int_eq(after.f_bfree, before.f_bfree - 5);   /* inode, 0-3 */
+     ck_assert_int_eq(fs_ops.read("/falloc", buf, LEN, 0, NULL), 4 * FS_BLOCK_SIZE);
+     ck_assert(memcmp(buf, expect, 4 * FS_BLOCK_SIZE) == 0);
+     generate_pattern(expect + FS_BLOCK_SIZE + 10, 1000, 61);
+     ck_assert_int_eq(fs_ops.write("/falloc", expect + FS_BLOCK_SIZE + 10, 1000, FS_BLOCK_SIZE + 10, NULL), 1000);
+
+     /* KEEP_SIZE reserves past the end; appends use it */
+     ck_assert_int_eq(fs_ops.fallocate("/falloc", FALLOC_FL_KEEP_SIZE, 4 * FS_BLOCK_SIZE, 4 * FS_BLOCK_SIZE, NULL), 0);
+     ck_assert_int_eq(fs_ops.getattr("/falloc", &sb), 0);
+     ck_assert_int_eq(sb.st_size, 4 * FS_BLOCK_SIZE);
+     generate_pattern(expect + 4 * FS_BLOCK_SIZE, 2 * FS_BLOCK_SIZE, 62);
+     ck_assert_int_eq(fs_ops.write("/falloc", expect + 4 * FS_BLOCK_SIZE, 2 * FS_BLOCK_SIZE, 4 * FS_BLOCK_SIZE, NULL), 2 * FS_BLOCK_SIZE);
+     ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+     ck_assert_int_eq(after.f_bfree, before.f_bfree - 9);
+     ck_assert_int_eq(fs_ops.read("/falloc", buf, LEN, 0, NULL), 6 * FS_BLOCK_SIZE);
+     ck_assert(memcmp(buf, expect, 6 * FS_BLOCK_SIZE) == 0);
+
+     /* punching frees the blocks it covers and zeros the edges */
+     ck_assert_int_eq(fs_ops.fallocate("/falloc", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                       FS_BLOCK_SIZE + 500, 4 * FS_BLOCK_SIZE, NULL), 0);
+     memset(expect + FS_BLOCK_SIZE + 500, 0, 4 * FS_BLOCK_SIZE);
+     ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+     ck_assert_int_eq(after.f_bfree, before.f_bfree - 6);   /* 2-4 are gone */
+     ck_assert_int_eq(fs_ops.read("/falloc", buf, LEN, 0, NULL), 6 * FS_BLOCK_SIZE);
+     ck_assert(memcmp(buf, expect, 6 * FS_BLOCK_SIZE) == 0);
+
+     ck_assert_int_eq(fs_ops.fallocate("/falloc", FALLOC_FL_PUNCH_HOLE, 0, 10, NULL), -EOPNOTSUPP);
+     ck_assert_int_eq(fs_ops.fallocate("/falloc", 0, 0, 0, NULL), -EINVAL);
+     ck_assert_int_eq(fs_ops.fallocate("/falloc", 0, -1, 10, NULL), -EINVAL);
+     ck_assert_int_eq(fs_ops.fallocate("/", 0, 0, 10, NULL), -EISDIR);
+     ck_assert_int_eq(fs_ops.fallocate("/falloc", 0, 0, 2000 * FS_BLOCK_SIZE, NULL), -EFBIG);
+
+     /* the blocks reserved past the end are freed too */
+     ck_assert_int_eq(fs_ops.unlink("/falloc"), 0);
+     ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+     ck_assert_int_eq(after.f_bfree, before.f_bfree);
+     free(expect);
+     free(buf);
+ }
+ END_TEST
+
+ /* read the on-disk inode of 'path', on an image without an inode map
+  * (inode number = block number). Returns the inode number, or -1. */
+ static int disk_inode(const char *path, struct fs_inode *inode)
+ {
+     char buf[FS_BLOCK_SIZE], name[32];
+     struct fs_super *sb = (struct fs_super *)buf;
+     block_read(buf, 0, 1);
+     if (sb->features & (FS_FEAT_LOG | FS_FEAT_COW))
+         return -1;
+     int inum = 2;
+     block_read((char *)inode, inum, 1);
+     while (*path == '/') {
+         int n = strcspn(path + 1, "/"), next = -1;
+         snprintf(name, sizeof(name), "%.*s", n, path + 1);
+         path += n + 1;
+         block_read(buf, inode->ptrs[0], 1);
+         struct fs_dirent *de = (struct fs_dirent *)buf;
+         for (int i = 0; i < FS_BLOCK_SIZE / sizeof(*de); i++)
+             if (de[i].valid && strcmp(de[i].name, name) == 0)
+                 next = de[i].inode;
+         if (next < 0)
+             return -1;
+         inum = next;
+         block_read((char *)inode, inum, 1);
+     }
+     return inum;
+ }
+
+ /* Test: appends to two files, interleaved, wait in memory (but count
+  * as used space) until fsync, which gives each file one contiguous
+  * run of blocks */
+ START_TEST(test_delayed_alloc) {
+     const int NBLKS = 8;
+     char data[2][NBLKS * FS_BLOCK_SIZE], buf[NBLKS * FS_BLOCK_SIZE];
+     const char *paths[2] = {"/da0", "/da1"};
+     struct statvfs before, after;
+     struct fs_inode inode;
+     ck_assert_int_eq(fs_ops.statfs("/", &before), 0);
+
+     for (int f = 0; f < 2; f++) {
+         generate_pattern(data[f], sizeof(data[f]), 70 + f);
+         ck_assert_int_eq(fs_ops.create(paths[f], 0100666, NULL), 0);
+     }
+     for (int i = 0; i < NBLKS; i++)
+         for (int f = 0; f < 2; f++)
+             ck_assert_int_eq(fs_ops.write(paths[f], data[f] + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE,
+                                           i * FS_BLOCK_SIZE, NULL), FS_BLOCK_SIZE);
+     ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+     ck_assert_int_eq(after.f_bfree, before.f_bfree - 2 - 2 * NBLKS);
+     if (disk_inode("/da0", &inode) > 0) {
+         ck_assert_int_eq(inode.size, NBLKS * FS_BLOCK_SIZE);
+         ck_assert_int_eq(inode.ptrs[0], 0);
+     }
+     for (int f = 0; f < 2; f++) {
+         ck_assert_int_eq(fs_ops.read(paths[f], buf, sizeof(buf), 0, NULL), sizeof(buf));
+         ck_assert(memcmp(buf, data[f], sizeof(buf)) == 0);
+     }
+
+     for (int f = 0; f < 2; f++) {
+         ck_assert_int_eq(fs_ops.fsync(paths[f], 0, NULL), 0);
+         if (disk_inode(paths[f], &inode) > 0)
+             for (int i = 1; i < NBLKS; i++)
+                 ck_assert_int_eq(inode.ptrs[i], inode.ptrs[0] + i);
+         ck_assert_int_eq(fs_ops.read(paths[f], buf, sizeof(buf), 0, NULL), sizeof(buf));
+         ck_assert(memcmp(buf, data[f], sizeof(buf)) == 0);
+     }
+     ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+     ck_assert_int_eq(after.f_bfree, before.f_bfree - 2 - 2 * NBLKS);
+
+     for (int f = 0; f < 2; f++)
+         ck_assert_int_eq(fs_ops.unlink(paths[f]), 0);
+     ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+     ck_assert_int_eq(after.f_bfree, before.f_bfree);
+ }
+ END_TEST
+
+ /* Test: a new directory's block follows its inode, a new file's inode
+  * follows its directory's (even if other files were allocated since),
+  * and the file's data follows its inode */
+ START_TEST(test_alloc_locality) {
+     char data[3 * FS_BLOCK_SIZE];
+     struct fs_inode dir, file;
+     generate_pattern(data, sizeof(data), 80);
+     ck_assert_int_eq(fs_ops.mkdir("/agdir", 0777), 0);
+     ck_assert_int_eq(fs_ops.create("/other", 0100666, NULL), 0);
+     ck_assert_int_eq(fs_ops.write("/other", data, sizeof(data), 0, NULL), sizeof(data));
+     ck_assert_int_eq(fs_ops.fsync("/other", 0, NULL), 0);
+     ck_assert_int_eq(fs_ops.create("/agdir/f", 0100666, NULL), 0);
+     ck_assert_int_eq(fs_ops.write("/agdir/f", data, sizeof(data), 0, NULL), sizeof(data));
+     ck_assert_int_eq(fs_ops.fsync("/agdir/f", 0, NULL), 0);
+
+     int dinum = disk_inode("/agdir", &dir), finum = disk_inode("/agdir/f", &file);
+     if (dinum > 0) {
+         ck_assert_int_eq(dir.ptrs[0], dinum + 1);
+         ck_assert_int_eq(finum, dinum + 2);
+         for (int i = 0; i < 3; i++)
+             ck_assert_int_eq(file.ptrs[i], finum + 1 + i);
+     }
+     char buf[sizeof(data)];
+     ck_assert_int_eq(fs_ops.read("/agdir/f", buf, sizeof(buf), 0, NULL), sizeof(buf));
+     ck_assert(memcmp(buf, data, sizeof(data)) == 0);
+ }
+ END_TEST
+
  /* Test for fs_utime to update access and modification times - file*/
  START_TEST(test_utime_file) {
      int ret = fs_ops.create("/utimefile", 0100666, NULL);
@@ -1179,6 +1558,1010 @@ START_TEST(test_fs_utime_metadata)
 }
 END_TEST
 
+/* Test: rename moves entries between directories and replaces files
+ * and empty directories, freeing what they held; the moved file's
+ * blocks stay put */
+START_TEST(test_rename_move)
+{
+    char a[3 * FS_BLOCK_SIZE], b[2 * FS_BLOCK_SIZE], buf[3 * FS_BLOCK_SIZE];
+    struct statvfs before, after;
+    struct stat st;
+    memset(a, 'a', sizeof(a));
+    memset(b, 'b', sizeof(b));
+    ck_assert_int_eq(fs_ops.statfs("/", &before), 0);
+
+    ck_assert_int_eq(fs_ops.mkdir("/mv", 0777), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/mv/empty", 0777), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/empty2", 0777), 0);
+    ck_assert_int_eq(fs_ops.create("/mv/a", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/mv/a", a, sizeof(a), 0, NULL), sizeof(a));
+    ck_assert_int_eq(fs_ops.create("/b", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/b", b, sizeof(b), 0, NULL), sizeof(b));
+    ck_assert_int_eq(fs_ops.fsync("/b", 0, NULL), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree - 13);
+
+    ck_assert_int_eq(fs_ops.rename("/b", "/mv/a"), 0);
+    ck_assert_int_eq(fs_ops.rename("/empty2", "/mv/empty"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree - 7);   /* a, empty2 gone */
+    ck_assert_int_eq(fs_ops.getattr("/b", &st), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/empty2", &st), -ENOENT);
+    ck_assert_int_eq(fs_ops.rename("/mv/empty", "/mv/a"), -ENOTDIR);
+    ck_assert_int_eq(fs_ops.rename("/mv", "/mv/empty/mv"), -EINVAL);
+    ck_assert_int_eq(fs_ops.rename("/mv", "//mv/empty"), -EINVAL);
+    ck_assert_int_eq(fs_ops.rename("/mv/", "/mv//empty/x"), -EINVAL);
+    ck_assert_int_eq(fs_ops.rename("/mv/empty", "/mv/empty/x"), -EINVAL);
+
+    ck_assert_int_eq(fs_ops.rename("/mv/a", "/mv/empty/b"), 0);
+    ck_assert_int_eq(fs_ops.rename("/mv", "/moved"), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/moved/empty/b", &st), 0);
+    ck_assert_int_eq(st.st_size, sizeof(b));
+    ck_assert_int_eq(fs_ops.read("/moved/empty/b", buf, sizeof(buf), 0, NULL),
+                     sizeof(b));
+    ck_assert(memcmp(buf, b, sizeof(b)) == 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree - 7);
+}
+END_TEST
+
+/* Test for paths deeper than the old 10-component limit, and paths
+ * with repeated or trailing slashes
+ */
+START_TEST(test_deep_path)
+{
+    char path[256] = "", data[] = "deep", buf[16];
+    struct stat st;
+    int depth = 16;
+
+    for (int i = 0; i < depth; i++) {
+        sprintf(path + strlen(path), "/d%d", i);
+        ck_assert_int_eq(fs_ops.mkdir(path, 0777), 0);
+    }
+    ck_assert_int_eq(fs_ops.mkdir(path, 0777), -EEXIST);
+    strcat(path, "/file");
+    ck_assert_int_eq(fs_ops.create(path, 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write(path, data, 4, 0, NULL), 4);
+    ck_assert_int_eq(fs_ops.getattr(path, &st), 0);
+    ck_assert_int_eq(st.st_size, 4);
+    ck_assert_int_eq(fs_ops.mkdir("/d0/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/x/y", 0777),
+                     -ENOENT);
+
+    ck_assert_int_eq(fs_ops.getattr("//d0//d1/", &st), 0);
+    ck_assert(S_ISDIR(st.st_mode));
+    ck_assert_int_eq(fs_ops.read(path, buf, sizeof(buf), 0, NULL), 4);
+    ck_assert(memcmp(buf, data, 4) == 0);
+    strcat(path, "/x");
+    ck_assert_int_eq(fs_ops.getattr(path, &st), -ENOTDIR);
+
+    *strrchr(path, '/') = 0;
+    ck_assert_int_eq(fs_ops.unlink(path), 0);
+    for (int i = depth; i > 0; i--) {
+        *strrchr(path, '/') = 0;
+        ck_assert_int_eq(fs_ops.rmdir(path), 0);
+    }
+    ck_assert_int_eq(fs_ops.getattr("/d0", &st), -ENOENT);
+}
+END_TEST
+
+/* Test the memory stats: cache entries come from a slab and go back
+ * when dropped; a big flush borrows scratch memory only while it runs
+ */
+START_TEST(test_mem_stats)
+{
+    int n = 40, len = n * FS_BLOCK_SIZE;
+    char *buf = malloc(len), *rbuf = malloc(len);
+    struct fs_mem_stats before, st;
+    generate_pattern(buf, len, 43);
+
+    fs_mem_stats(&before);
+    ck_assert_int_eq(fs_ops.create("/memfile", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/memfile", buf, len, 0, NULL), len);
+    ck_assert_int_eq(fs_ops.fsync("/memfile", 0, NULL), 0);
+    ck_assert_int_eq(fs_ops.read("/memfile", rbuf, len, 0, NULL), len);
+    ck_assert(memcmp(buf, rbuf, len) == 0);
+
+    fs_mem_stats(&st);
+    ck_assert(st.slab_objects >= before.slab_objects + n);
+    ck_assert(st.slab_bytes >= st.slab_objects * FS_BLOCK_SIZE);
+    ck_assert(st.scratch_peak >= (uint64_t)len);
+    ck_assert(st.scratch_bytes <= 2 * 65536 + 256);  /* this thread + helper */
+
+    ck_assert_int_eq(fs_ops.unlink("/memfile"), 0);
+    fs_mem_stats(&st);
+    ck_assert(st.slab_objects <= before.slab_objects);
+    free(buf);
+    free(rbuf);
+}
+END_TEST
+
+/* Test the memory budget: once it's lowered, the end of the next
+ * operation shrinks the block cache to fit, and the cache stays within
+ * it while reading more
+ */
+START_TEST(test_mem_budget)
+{
+    int n = 100, len = n * FS_BLOCK_SIZE, budget = 256 * 1024;
+    char *buf = malloc(len), *rbuf = malloc(len);
+    struct fs_mem_stats st;
+    struct stat sb;
+    generate_pattern(buf, len, 44);
+
+    ck_assert_int_eq(fs_ops.create("/budget", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/budget", buf, len, 0, NULL), len);
+    ck_assert_int_eq(fs_ops.fsync("/budget", 0, NULL), 0);
+    ck_assert_int_eq(fs_ops.read("/budget", rbuf, len, 0, NULL), len);
+    fs_mem_stats(&st);
+    ck_assert(st.slab_bytes >= (uint64_t)len);
+
+    fs_set_mem_budget(budget);
+    ck_assert_int_eq(fs_ops.getattr("/budget", &sb), 0);
+    fs_mem_stats(&st);
+    ck_assert_int_eq(st.budget, budget);
+    ck_assert(st.slab_bytes <= (uint64_t)budget);
+    ck_assert(st.reclaimed >= (uint64_t)len - budget);
+
+    for (int i = 0; i < 3; i++) {
+        ck_assert_int_eq(fs_ops.read("/budget", rbuf, len, 0, NULL), len);
+        ck_assert(memcmp(buf, rbuf, len) == 0);
+        fs_mem_stats(&st);
+        ck_assert(st.slab_bytes <= (uint64_t)budget);
+    }
+    fs_set_mem_budget(0);
+    free(buf);
+    free(rbuf);
+}
+END_TEST
+
+/* Helper: the number after 'key' on the line starting with 'line' in
+ * the stats file
+ */
+long long stats_value(const char *line, const char *key)
+{
+    struct stat sb;
+    ck_assert_int_eq(fs_ops.getattr("/.terrafs/stats", &sb), 0);
+    char *buf = calloc(1, sb.st_size + 1), *p, *q;
+    ck_assert_int_eq(fs_ops.read("/.terrafs/stats", buf, sb.st_size, 0, NULL), sb.st_size);
+    long long val = -1;
+    for (p = buf; p != NULL && *p; p = (q = strchr(p, '\n')) ? q + 1 : NULL)
+        if (strncmp(p, line, strlen(line)) == 0 && p[strlen(line)] == ' ') {
+            char *k = key ? strstr(p, key) : p + strlen(line);
+            ck_assert_ptr_nonnull(k);
+            val = strtoll(k + (key ? strlen(key) : 0), NULL, 10);
+            break;
+        }
+    free(buf);
+    return val;
+}
+
+/* Helper: readdir filler counting the entries called 'name' */
+struct name_count {
+    const char *name;
+    int found;
+};
+
+static int name_filler(void *ptr, const char *name, const struct stat *st, off_t off)
+{
+    struct name_count *nc = ptr;
+    if (strcmp(name, nc->name) == 0)
+        nc->found++;
+    return 0;
+}
+
+/* Test the stats file: it counts calls and block I/O, and can't be
+ * changed
+ */
+START_TEST(test_stats_file)
+{
+    struct stat sb;
+    ck_assert_int_eq(fs_ops.getattr("/.terrafs", &sb), 0);
+    ck_assert(S_ISDIR(sb.st_mode));
+    ck_assert_int_eq(fs_ops.getattr("/.terrafs/stats", &sb), 0);
+    ck_assert_int_eq(sb.st_mode, S_IFREG | 0444);
+    ck_assert(sb.st_size > 0);
+    ck_assert_int_eq(fs_ops.getattr("/.terrafs/nothing", &sb), -ENOENT);
+
+    struct name_count nc = { .name = "stats" };
+    ck_assert_int_eq(fs_ops.readdir("/.terrafs", &nc, name_filler, 0, NULL), 0);
+    ck_assert_int_eq(nc.found, 1);
+    nc = (struct name_count){ .name = ".terrafs" };
+    ck_assert_int_eq(fs_ops.readdir("/", &nc, name_filler, 0, NULL), 0);
+    ck_assert_int_eq(nc.found, 0);
+
+    long long getattrs = stats_value("getattr", NULL);
+    long long unlinks = stats_value("unlink", NULL);
+    long long writes = stats_value("block", "writes ");
+    ck_assert(getattrs > 0);
+    for (int i = 0; i < 5; i++)
+        fs_ops.getattr("/", &sb);
+    ck_assert_int_eq(fs_ops.create("/counted", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.unlink("/counted"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/counted"), -ENOENT);
+    ck_assert(stats_value("getattr", NULL) >= getattrs + 5);
+    ck_assert_int_eq(stats_value("unlink", NULL), unlinks + 2);
+    ck_assert(stats_value("block", "writes ") > writes);
+    ck_assert(stats_value("cache", "hits ") >= 0);
+
+    ck_assert_int_eq(fs_ops.write("/.terrafs/stats", "x", 1, 0, NULL), -EACCES);
+    ck_assert_int_eq(fs_ops.unlink("/.terrafs/stats"), -EACCES);
+    ck_assert_int_eq(fs_ops.create("/.terrafs/x", 0100666, NULL), -EACCES);
+    ck_assert_int_eq(fs_ops.rename("/.terrafs/stats", "/stats"), -EACCES);
+
+    struct fuse_file_info fi = { .flags = O_WRONLY };
+    ck_assert_int_eq(fs_ops.open("/.terrafs/stats", &fi), -EACCES);
+    fi.flags = O_RDONLY;
+    ck_assert_int_eq(fs_ops.open("/.terrafs/stats", &fi), 0);
+    ck_assert(fi.direct_io);        /* the size can change under the page cache */
+}
+END_TEST
+
+/* Helper: calls in an I/O histogram */
+uint64_t hist_calls(uint64_t *hist)
+{
+    uint64_t n = 0;
+    for (int i = 0; i < FS_IO_BUCKETS; i++)
+        n += hist[i];
+    return n;
+}
+
+/* Test the I/O profile: block I/O is charged to the call that did it,
+ * metadata and file data apart
+ */
+START_TEST(test_io_profile)
+{
+    struct fs_io_profile mk0, mk1, w0, w1, f0, f1, b0, b1, r0, r1;
+    int len = 8 * FS_BLOCK_SIZE;
+    char *buf = malloc(len), *rbuf = malloc(len);
+    generate_pattern(buf, len, 46);
+    ck_assert_int_eq(fs_io_profile("nothing", &mk0), -ENOENT);
+
+    ck_assert_int_eq(fs_io_profile("mkdir", &mk0), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/amp", 0777), 0);
+    ck_assert_int_eq(fs_io_profile("mkdir", &mk1), 0);
+    ck_assert_int_eq(mk1.calls, mk0.calls + 1);
+    ck_assert(mk1.meta_writes > mk0.meta_writes);
+    ck_assert_int_eq(mk1.data_writes, mk0.data_writes);
+    ck_assert_int_eq(hist_calls(mk1.meta_hist), hist_calls(mk0.meta_hist) + 1);
+    ck_assert_int_eq(mk1.data_hist[0], mk0.data_hist[0] + 1);
+
+    fs_io_profile("write", &w0);
+    fs_io_profile("fsync", &f0);
+    fs_io_profile("background", &b0);
+    ck_assert_int_eq(fs_ops.create("/amp/f", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/amp/f", buf, len, 0, NULL), len);
+    ck_assert_int_eq(fs_ops.fsync("/amp/f", 0, NULL), 0);
+    fs_io_profile("write", &w1);
+    fs_io_profile("fsync", &f1);
+    fs_io_profile("background", &b1);
+    ck_assert(w1.data_writes - w0.data_writes + f1.data_writes - f0.data_writes +
+              b1.data_writes - b0.data_writes >= 8);
+    ck_assert_int_eq(w1.data_reads, w0.data_reads);
+
+    fs_ops.init(NULL);          /* empty the cache */
+    fs_io_profile("read", &r0);
+    ck_assert_int_eq(fs_ops.read("/amp/f", rbuf, len, 0, NULL), len);
+    ck_assert(memcmp(buf, rbuf, len) == 0);
+    fs_io_profile("read", &r1);
+    ck_assert_int_eq(r1.calls, r0.calls + 1);
+    ck_assert_int_eq(r1.data_reads, r0.data_reads + 8);
+    ck_assert(r1.meta_reads > r0.meta_reads);
+    ck_assert_int_eq(r1.data_hist[4], r0.data_hist[4] + 1);    /* 5-8 blocks */
+    free(buf);
+    free(rbuf);
+}
+END_TEST
+
+/* with tracing on, calls and their block I/O show up in
+ * /.terrafs/trace with the right inode, offset and length
+ */
+START_TEST(test_trace)
+{
+    int len = 2 * FS_BLOCK_SIZE;
+    char *buf = malloc(len);
+    generate_pattern(buf, len, 47);
+    fs_trace_enable(1024);
+    ck_assert_int_eq(fs_ops.mkdir("/tr", 0777), 0);
+    ck_assert_int_eq(fs_ops.create("/tr/f", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/tr/f", buf, len, 4096, NULL), len);
+    ck_assert_int_eq(fs_ops.fsync("/tr/f", 0, NULL), 0);
+    ck_assert_int_eq(fs_ops.unlink("/tr/nope"), -ENOENT);
+
+    struct fuse_file_info fi = { .flags = O_RDONLY };
+    ck_assert_int_eq(fs_ops.open("/.terrafs/trace", &fi), 0);
+    fs_trace_enable(0);
+    struct fs_trace_hdr h;
+    ck_assert_int_eq(fs_ops.read("/.terrafs/trace", (char *)&h, sizeof(h), 0, &fi),
+                     sizeof(h));
+    ck_assert_int_eq(h.magic, FS_TRACE_MAGIC);
+    ck_assert_int_eq(h.rec_size, sizeof(struct fs_trace_rec));
+    ck_assert(h.nrecs > 5);
+    int size = h.nrecs * sizeof(struct fs_trace_rec);
+    struct fs_trace_rec *recs = malloc(size);
+    ck_assert_int_eq(fs_ops.read("/.terrafs/trace", (char *)recs, size, sizeof(h), &fi),
+                     size);
+    ck_assert_int_eq(fs_ops.release("/.terrafs/trace", &fi), 0);
+
+    int create = -1, write = -1, unlink = -1, io = 0;
+    for (int i = 0; i < h.nrecs; i++) {
+        struct fs_trace_rec *r = &recs[i];
+        if (i > 0)
+            ck_assert(r->time >= recs[i-1].time);
+        if (r->type == FS_TRACE_IO) {
+            ck_assert(r->op == FS_TRACE_NOOP || r->op < h.nops);
+            io += r->kind == 1 || r->kind == 3;     /* writes */
+            continue;
+        }
+        ck_assert_int_eq(r->type, FS_TRACE_OP);
+        if (strcmp(h.ops[r->op], "create") == 0)
+            create = i;
+        else if (strcmp(h.ops[r->op], "write") == 0)
+            write = i;
+        else if (strcmp(h.ops[r->op], "unlink") == 0)
+            unlink = i;
+    }
+    ck_assert(create >= 0 && write > create && unlink > write);
+    ck_assert(recs[create].inum != 0);
+    ck_assert_int_eq(recs[write].inum, recs[create].inum);
+    ck_assert_int_eq(recs[write].offset, 4096);
+    ck_assert_int_eq(recs[write].len, len);
+    ck_assert_int_eq(recs[write].result, len);
+    ck_assert_int_eq(recs[unlink].result, -ENOENT);
+    ck_assert(io > 0);
+    free(recs);
+    free(buf);
+}
+END_TEST
+
+static void *getattr_thread(void *arg)
+{
+    struct stat sb;
+    for (int i = 0; i < 10; i++)
+        fs_ops.getattr("/", &sb);
+    return NULL;
+}
+
+/* the counts and trace records of threads that have exited are kept */
+START_TEST(test_thread_exit)
+{
+    pthread_t t;
+    fs_trace_enable(1024);
+    long long getattrs = stats_value("getattr", NULL);
+    for (int i = 0; i < 3; i++) {
+        ck_assert_int_eq(pthread_create(&t, NULL, getattr_thread, NULL), 0);
+        ck_assert_int_eq(pthread_join(t, NULL), 0);
+    }
+    ck_assert(stats_value("getattr", NULL) >= getattrs + 30);
+    FILE *fp = tmpfile();
+    ck_assert(fs_trace_dump(fp) >= 30);
+    fclose(fp);
+    fs_trace_enable(0);
+}
+END_TEST
+
+/* a recording has each call with its paths and arguments, in order */
+START_TEST(test_record)
+{
+    char buf[100] = "";
+    FILE *fp = tmpfile();
+    ck_assert_int_eq(fs_record(fp), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/rec", 0750), 0);
+    ck_assert_int_eq(fs_ops.create("/rec/f", 0100640, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/rec/f", buf, sizeof(buf), 1000, NULL), sizeof(buf));
+    ck_assert_int_eq(fs_ops.rename("/rec/f", "/rec/g"), 0);
+    ck_assert_int_eq(fs_ops.read("/rec/f", buf, 10, 0, NULL), -ENOENT);
+    ck_assert_int_eq(fs_record(NULL), 0);
+    ck_assert_int_eq(fs_ops.unlink("/rec/g"), 0);      /* not recorded */
+
+    rewind(fp);
+    struct fs_trace_hdr h;
+    ck_assert_int_eq(fread(&h, sizeof(h), 1, fp), 1);
+    ck_assert_int_eq(h.magic, FS_RECORD_MAGIC);
+    ck_assert_int_eq(h.rec_size, sizeof(struct fs_record));
+    struct { const char *op, *path, *path2; int mode, offset, len, result; } want[] = {
+        {"mkdir", "/rec", "", 0750, 0, 0, 0},
+        {"create", "/rec/f", "", 0100640, 0, 0, 0},
+        {"write", "/rec/f", "", 0, 1000, sizeof(buf), sizeof(buf)},
+        {"rename", "/rec/f", "/rec/g", 0, 0, 0, 0},
+        {"read", "/rec/f", "", 0, 0, 10, -ENOENT},
+    };
+    uint64_t last = 0;
+    for (int i = 0; i < 5; i++) {
+        struct fs_record r;
+        char path[64] = "", path2[64] = "";
+        ck_assert_int_eq(fread(&r, sizeof(r), 1, fp), 1);
+        ck_assert(r.path_len < sizeof(path) && r.path2_len < sizeof(path2));
+        ck_assert_int_eq(fread(path, 1, r.path_len, fp), r.path_len);
+        ck_assert_int_eq(fread(path2, 1, r.path2_len, fp), r.path2_len);
+        ck_assert_str_eq(h.ops[r.op], want[i].op);
+        ck_assert_str_eq(path, want[i].path);
+        ck_assert_str_eq(path2, want[i].path2);
+        ck_assert_int_eq(r.mode, want[i].mode);
+        ck_assert_int_eq(r.offset, want[i].offset);
+        ck_assert_int_eq(r.len, want[i].len);
+        ck_assert_int_eq(r.result, want[i].result);
+        ck_assert(r.time >= last);
+        last = r.time;
+    }
+    struct fs_record r;
+    ck_assert_int_eq(fread(&r, sizeof(r), 1, fp), 0);
+    fclose(fp);
+}
+END_TEST
+
+/* Setup for the journal tests: same contents as test2.img, with a
+ * 16-block metadata journal.
+ */
+void test_journal_setup(void) {
+   system("python gen-disk.py -q -j 16 disk2.in test3.img");
+   block_init("test3.img");
+   fs_set_image("test3.img");
+   fs_ops.init(NULL);
+}
+
+/* Helper: hand-craft a one-block transaction in the journal, as if the
+ * file system crashed after committing it. If 'torn' is 1 the data
+ * doesn't match the checksum, if 2 the header's home address doesn't.
+ */
+void journal_inject(int blkno, char *data, int torn)
+{
+    char sb_buf[FS_BLOCK_SIZE];
+    ck_assert_int_eq(block_read(sb_buf, 0, 1), 0);
+    struct fs_super *sb = (struct fs_super *)sb_buf;
+    ck_assert(sb->features & FS_FEAT_JOURNAL);
+
+    char hdr_buf[FS_BLOCK_SIZE] = {0};
+    struct fs_journal_hdr *hdr = (struct fs_journal_hdr *)hdr_buf;
+    hdr->magic = FS_JOURNAL_MAGIC;
+    hdr->seq = 1;
+    hdr->nblocks = 1;
+    hdr->blocks[0] = blkno;
+    unsigned crc = crc32(0, (const Bytef *)hdr_buf, FS_BLOCK_SIZE);
+    hdr->crc = crc32(crc, (const Bytef *)data, FS_BLOCK_SIZE) + (torn == 1);
+    if (torn == 2)
+        hdr->blocks[0] = blkno + 1;
+    ck_assert_int_eq(block_write(hdr_buf, sb->journal_start, 1), 0);
+    ck_assert_int_eq(block_write(data, sb->journal_start + 1, 1), 0);
+}
+
+/* Test: operations on a journaled image survive a remount, and leave
+ * the journal clean.
+ */
+START_TEST(test_journal_ops)
+{
+    char buf[10000], rbuf[10000];
+    generate_pattern(buf, sizeof(buf), 0);
+
+    ck_assert_int_eq(fs_ops.mkdir("/jdir", 0777), 0);
+    ck_assert_int_eq(fs_ops.create("/jdir/file", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/jdir/file", buf, sizeof(buf), 0, NULL),
+                     sizeof(buf));
+    ck_assert_int_eq(fs_ops.create("/gone", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.unlink("/gone"), 0);
+
+    char sb_buf[FS_BLOCK_SIZE], hdr_buf[FS_BLOCK_SIZE];
+    ck_assert_int_eq(block_read(sb_buf, 0, 1), 0);
+    struct fs_super *sb = (struct fs_super *)sb_buf;
+    ck_assert_int_eq(block_read(hdr_buf, sb->journal_start, 1), 0);
+    ck_assert_int_eq(((struct fs_journal_hdr *)hdr_buf)->nblocks, 0);
+
+    fs_ops.init(NULL);
+    struct stat st;
+    ck_assert_int_eq(fs_ops.getattr("/gone", &st), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/jdir/file", &st), 0);
+    ck_assert_int_eq(st.st_size, sizeof(buf));
+    ck_assert_int_eq(fs_ops.read("/jdir/file", rbuf, sizeof(rbuf), 0, NULL),
+                     sizeof(rbuf));
+    ck_assert(memcmp(buf, rbuf, sizeof(buf)) == 0);
+}
+END_TEST
+
+/* Test: a committed transaction left in the journal is replayed at
+ * mount time.
+ */
+START_TEST(test_journal_replay)
+{
+    struct fs_inode root;
+    ck_assert_int_eq(block_read((char *)&root, 2, 1), 0);
+    root.mode = S_IFDIR | 0700;
+    journal_inject(2, (char *)&root, 0);
+
+    fs_ops.init(NULL);
+    struct stat st;
+    ck_assert_int_eq(fs_ops.getattr("/", &st), 0);
+    ck_assert_int_eq(st.st_mode, S_IFDIR | 0700);
+}
+END_TEST
+
+/* Test: a torn (partially written) transaction is ignored at replay,
+ * whether it's the data or the header that didn't make it
+ */
+START_TEST(test_journal_torn)
+{
+    struct fs_inode root;
+    char next[FS_BLOCK_SIZE], rbuf[FS_BLOCK_SIZE];
+    ck_assert_int_eq(block_read((char *)&root, 2, 1), 0);
+    ck_assert_int_eq(block_read(next, 3, 1), 0);
+    int mode = root.mode;
+    root.mode = S_IFDIR | 0700;
+    journal_inject(2, (char *)&root, 1);
+
+    fs_ops.init(NULL);
+    struct stat st;
+    ck_assert_int_eq(fs_ops.getattr("/", &st), 0);
+    ck_assert_int_eq(st.st_mode, mode);
+
+    journal_inject(2, (char *)&root, 2);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/", &st), 0);
+    ck_assert_int_eq(st.st_mode, mode);
+    ck_assert_int_eq(block_read(rbuf, 3, 1), 0);
+    ck_assert(memcmp(next, rbuf, FS_BLOCK_SIZE) == 0);
+}
+END_TEST
+
+/* Test: flushing more files' delayed writes than fit in the journal
+ * at once commits them a file at a time, and all of them get there.
+ */
+START_TEST(test_journal_split)
+{
+    const int NFILES = 40;
+    char path[32], buf[FS_BLOCK_SIZE], rbuf[FS_BLOCK_SIZE];
+    ck_assert_int_eq(fs_ops.mkdir("/many", 0777), 0);
+    for (int i = 0; i < NFILES; i++) {
+        sprintf(path, "/many/f%d", i);
+        generate_pattern(buf, sizeof(buf), i);
+        ck_assert_int_eq(fs_ops.create(path, 0100666, NULL), 0);
+        ck_assert_int_eq(fs_ops.write(path, buf, sizeof(buf), 0, NULL),
+                         sizeof(buf));
+    }
+    fs_ops.destroy(NULL);
+
+    fs_ops.init(NULL);
+    for (int i = 0; i < NFILES; i++) {
+        sprintf(path, "/many/f%d", i);
+        generate_pattern(buf, sizeof(buf), i);
+        ck_assert_int_eq(fs_ops.read(path, rbuf, sizeof(rbuf), 0, NULL),
+                         sizeof(rbuf));
+        ck_assert(memcmp(buf, rbuf, sizeof(buf)) == 0);
+    }
+}
+END_TEST
+
+/* Test: with a journal too small for an operation (gen-disk.py won't
+ * make one, so shrink it by hand), the operation fails with ENOSPC
+ * and changes nothing, rather than being written unlogged; smaller
+ * ones still work.
+ */
+START_TEST(test_journal_too_small)
+{
+    char sb_buf[FS_BLOCK_SIZE];
+    fs_ops.destroy(NULL);
+    ck_assert_int_eq(block_read(sb_buf, 0, 1), 0);
+    ((struct fs_super *)sb_buf)->journal_len = 3;
+    int fd = open("test3.img", O_WRONLY);
+    ck_assert(fd >= 0);
+    ck_assert_int_eq(pwrite(fd, sb_buf, FS_BLOCK_SIZE, 0), FS_BLOCK_SIZE);
+    close(fd);
+    fs_ops.init(NULL);
+
+    struct stat sb;
+    ck_assert_int_eq(fs_ops.mkdir("/toobig", 0777), -ENOSPC);
+    ck_assert_int_eq(fs_ops.getattr("/toobig", &sb), -ENOENT);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/toobig", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.chmod("/", 0700), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/", &sb), 0);
+    ck_assert_int_eq(sb.st_mode, S_IFDIR | 0700);
+}
+END_TEST
+
+/* Helper: the block holding the orphan list */
+static int orphans_blkno(void)
+{
+    char buf[FS_BLOCK_SIZE];
+    ck_assert_int_eq(block_read(buf, 0, 1), 0);
+    int blkno = ((struct fs_super *)buf)->orphans;
+    ck_assert(blkno != 0);
+    return blkno;
+}
+
+/* Helper: read the on-disk orphan list into 'buf' */
+static struct fs_orphans *disk_orphans(char *buf)
+{
+    ck_assert_int_eq(block_read(buf, orphans_blkno(), 1), 0);
+    return (struct fs_orphans *)buf;
+}
+
+/* Helper: wait (up to 5s) for the background thread to empty it */
+static void orphans_wait(void)
+{
+    char buf[FS_BLOCK_SIZE];
+    for (int i = 0; i < 5000 && disk_orphans(buf)->count > 0; i++)
+        usleep(1000);
+    ck_assert_int_eq(disk_orphans(buf)->count, 0);
+}
+
+/* Test: removing or truncating a big file frees its blocks in the
+ * background, but statfs counts them as free straight away; an orphan
+ * left on the list by a crash is freed after the next mount.
+ */
+START_TEST(test_orphan_reclaim)
+{
+    const int NBLKS = 100;
+    int len = NBLKS * FS_BLOCK_SIZE;
+    char *buf = malloc(len), rbuf[FS_BLOCK_SIZE], zeros[FS_BLOCK_SIZE] = {0};
+    struct statvfs s0, st;
+    struct fs_inode inode;
+    generate_pattern(buf, len, 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &s0), 0);
+
+    ck_assert_int_eq(fs_ops.create("/big", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/big", buf, len, 0, NULL), len);
+    ck_assert_int_eq(fs_ops.fsync("/big", 0, NULL), 0);
+    ck_assert_int_eq(fs_ops.unlink("/big"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, s0.f_bfree);
+
+    /* the truncated blocks go to another inode; the file can grow
+     * again straight away */
+    ck_assert_int_eq(fs_ops.create("/trunc", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/trunc", buf, len, 0, NULL), len);
+    ck_assert_int_eq(fs_ops.fsync("/trunc", 0, NULL), 0);
+    ck_assert_int_eq(fs_ops.truncate("/trunc", 1000), 0);
+    ck_assert_int_eq(fs_ops.write("/trunc", buf, FS_BLOCK_SIZE,
+                                  50 * FS_BLOCK_SIZE, NULL), FS_BLOCK_SIZE);
+    ck_assert_int_eq(fs_ops.fsync("/trunc", 0, NULL), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, s0.f_bfree - 3);   /* inode, 0, 50 */
+    ck_assert_int_eq(fs_ops.read("/trunc", rbuf, 1000, 0, NULL), 1000);
+    ck_assert(memcmp(rbuf, buf, 1000) == 0);
+    ck_assert_int_eq(fs_ops.read("/trunc", rbuf, FS_BLOCK_SIZE,
+                                 10 * FS_BLOCK_SIZE, NULL), FS_BLOCK_SIZE);
+    ck_assert(memcmp(rbuf, zeros, FS_BLOCK_SIZE) == 0);
+    ck_assert_int_eq(fs_ops.read("/trunc", rbuf, FS_BLOCK_SIZE,
+                                 50 * FS_BLOCK_SIZE, NULL), FS_BLOCK_SIZE);
+    ck_assert(memcmp(rbuf, buf, FS_BLOCK_SIZE) == 0);
+    orphans_wait();
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, s0.f_bfree - 3);
+
+    /* crash just after unlinking /crash: its entry is gone, the inode
+     * is on the list */
+    ck_assert_int_eq(fs_ops.create("/crash", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/crash", buf, len, 0, NULL), len);
+    fs_ops.destroy(NULL);
+    int inum = disk_inode("/crash", &inode);
+    ck_assert(inum > 0);
+
+    char dbuf[FS_BLOCK_SIZE], obuf[FS_BLOCK_SIZE];
+    struct fs_inode root;
+    ck_assert_int_eq(block_read((char *)&root, 2, 1), 0);
+    ck_assert_int_eq(block_read(dbuf, root.ptrs[0], 1), 0);
+    struct fs_dirent *de = (struct fs_dirent *)dbuf;
+    for (int i = 0; i < FS_BLOCK_SIZE / sizeof(*de); i++)
+        if (de[i].valid && de[i].inode == inum)
+            de[i].valid = 0;
+    ck_assert_int_eq(block_write(dbuf, root.ptrs[0], 1), 0);
+    struct fs_orphans *o = disk_orphans(obuf);
+    o->count = 1;
+    o->list[0].inum = inum;
+    o->list[0].next = NBLKS;
+    ck_assert_int_eq(block_write(obuf, orphans_blkno(), 1), 0);
+
+    fs_ops.init(NULL);
+    struct stat sb;
+    ck_assert_int_eq(fs_ops.getattr("/crash", &sb), -ENOENT);
+    orphans_wait();
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, s0.f_bfree - 3);
+    free(buf);
+}
+END_TEST
+
+/* Setup for the log-structured tests: test2.img contents, 16-block
+ * segments.
+ */
+void test_log_setup(void) {
+   system("python gen-disk.py -q -l 16 disk2.in test3.img");
+   block_init("test3.img");
+   fs_set_image("test3.img");
+   fs_ops.init(NULL);
+}
+
+/* stop the segment cleaner before the next test replaces the image */
+void test_log_teardown(void) {
+   fs_ops.destroy(NULL);
+}
+
+/* Test: random overwrites on a log-structured image cycle through the
+ * disk several times over, so segments have to be cleaned and reused.
+ * Contents and free space must come out right, including after a
+ * remount.
+ */
+START_TEST(test_log_overwrite_churn)
+{
+    const int NBLKS = 250, LEN = NBLKS * FS_BLOCK_SIZE;
+    struct statvfs before, after;
+    ck_assert_int_eq(fs_ops.statfs("/", &before), 0);
+
+    char *expect = malloc(LEN), *rbuf = malloc(LEN);
+    ck_assert_ptr_ne(expect, NULL);
+    ck_assert_ptr_ne(rbuf, NULL);
+    generate_pattern(expect, LEN, 0);
+
+    ck_assert_int_eq(fs_ops.mkdir("/logdir", 0777), 0);
+    ck_assert_int_eq(fs_ops.create("/logdir/churn", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/logdir/churn", expect, LEN, 0, NULL), LEN);
+
+    srandom(5600);
+    for (int i = 0; i < 2000; i++) {
+        int off = random() % (LEN - 100), n = 1 + random() % 6000;
+        if (off + n > LEN)
+            n = LEN - off;
+        generate_pattern(expect + off, n, i);
+        ck_assert_int_eq(fs_ops.write("/logdir/churn", expect + off, n, off, NULL), n);
+        if (i % 100 == 0) {
+            char name[32];
+            sprintf(name, "/logdir/f%d", i);
+            ck_assert_int_eq(fs_ops.create(name, 0100666, NULL), 0);
+        }
+    }
+    ck_assert_int_eq(fs_ops.read("/logdir/churn", rbuf, LEN, 0, NULL), LEN);
+    ck_assert(memcmp(expect, rbuf, LEN) == 0);
+
+    fs_ops.init(NULL);
+    memset(rbuf, 0, LEN);
+    ck_assert_int_eq(fs_ops.read("/logdir/churn", rbuf, LEN, 0, NULL), LEN);
+    ck_assert(memcmp(expect, rbuf, LEN) == 0);
+
+    ck_assert_int_eq(fs_ops.unlink("/logdir/churn"), 0);
+    for (int i = 0; i < 2000; i += 100) {
+        char name[32];
+        sprintf(name, "/logdir/f%d", i);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+    ck_assert_int_eq(fs_ops.rmdir("/logdir"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree);
+    free(expect);
+    free(rbuf);
+}
+END_TEST
+
+void test_snap_setup(void) {
+   system("python gen-disk.py -q -s disk2.in test3.img");
+   block_init("test3.img");
+   fs_set_image("test3.img");
+   fs_mount_snapshot(0);
+   fs_ops.init(NULL);
+}
+
+void test_snap_teardown(void) {
+   fs_ops.destroy(NULL);
+   fs_mount_snapshot(0);
+}
+
+static int take_snapshot(void) {
+    uint32_t id = 0;
+    ck_assert_int_eq(fs_ops.ioctl("/", FS_IOC_SNAPSHOT, NULL, NULL, 0, &id), 0);
+    return id;
+}
+
+static void check_contents(const char *path, const char *expect, int len) {
+    char buf[len];
+    ck_assert_int_eq(fs_ops.read(path, buf, len, 0, NULL), len);
+    ck_assert(memcmp(buf, expect, len) == 0);
+}
+
+/* Test: each snapshot keeps the file system as it was when it was
+ * taken, and is mounted read-only; taking one allocates nothing.
+ */
+START_TEST(test_snapshot_view)
+{
+    const int LEN = 3 * FS_BLOCK_SIZE;
+    char v1[LEN], v2[LEN], v3[LEN];
+    generate_pattern(v1, LEN, 1);
+    memcpy(v2, v1, LEN);
+    generate_pattern(v2 + 5000, 100, 2);
+    memcpy(v3, v2, LEN);
+    generate_pattern(v3, 10000, 3);
+
+    ck_assert_int_eq(fs_ops.mkdir("/snapdir", 0777), 0);
+    ck_assert_int_eq(fs_ops.create("/snapdir/f", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/snapdir/f", v1, LEN, 0, NULL), LEN);
+
+    struct statvfs before, after;
+    ck_assert_int_eq(fs_ops.statfs("/", &before), 0);
+    int id1 = take_snapshot();
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree);
+
+    ck_assert_int_eq(fs_ops.write("/snapdir/f", v2 + 5000, 100, 5000, NULL), 100);
+    ck_assert_int_eq(fs_ops.create("/snapdir/g", 0100666, NULL), 0);
+    int id2 = take_snapshot();
+    ck_assert_int_ne(id1, id2);
+    ck_assert_int_eq(fs_ops.write("/snapdir/f", v3, 10000, 0, NULL), 10000);
+    ck_assert_int_eq(fs_ops.unlink("/snapdir/g"), 0);
+    check_contents("/snapdir/f", v3, LEN);
+
+    struct stat sb;
+    fs_mount_snapshot(id1);
+    fs_ops.init(NULL);
+    check_contents("/snapdir/f", v1, LEN);
+    ck_assert_int_eq(fs_ops.getattr("/snapdir/g", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.write("/snapdir/f", v3, 10, 0, NULL), -EROFS);
+    ck_assert_int_eq(fs_ops.create("/snapdir/h", 0100666, NULL), -EROFS);
+    ck_assert_int_eq(fs_ops.unlink("/snapdir/f"), -EROFS);
+
+    fs_mount_snapshot(id2);
+    fs_ops.init(NULL);
+    check_contents("/snapdir/f", v2, LEN);
+    ck_assert_int_eq(fs_ops.getattr("/snapdir/g", &sb), 0);
+
+    fs_mount_snapshot(0);
+    fs_ops.init(NULL);
+    check_contents("/snapdir/f", v3, LEN);
+    ck_assert_int_eq(fs_ops.getattr("/snapdir/g", &sb), -ENOENT);
+}
+END_TEST
+
+/* Test: blocks a snapshot still uses aren't freed by unlink or
+ * truncate; blocks written since the snapshot are.
+ */
+START_TEST(test_snapshot_retain)
+{
+    const int LEN = 4 * FS_BLOCK_SIZE;
+    char data[LEN];
+    generate_pattern(data, LEN, 7);
+    ck_assert_int_eq(fs_ops.create("/old", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/old", data, LEN, 0, NULL), LEN);
+    ck_assert_int_eq(fs_ops.create("/old2", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/old2", data, LEN, 0, NULL), LEN);
+    int id = take_snapshot();
+
+    struct statvfs s0, s1, s2;
+    ck_assert_int_eq(fs_ops.statfs("/", &s0), 0);
+    ck_assert_int_eq(fs_ops.unlink("/old"), 0);
+    ck_assert_int_eq(fs_ops.truncate("/old2", 0), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &s1), 0);
+    ck_assert(s1.f_bfree <= s0.f_bfree);
+
+    ck_assert_int_eq(fs_ops.create("/new", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/new", data, LEN, 0, NULL), LEN);
+    ck_assert_int_eq(fs_ops.unlink("/new"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &s2), 0);
+    ck_assert_int_eq(s2.f_bfree, s1.f_bfree);
+
+    fs_mount_snapshot(id);
+    fs_ops.init(NULL);
+    check_contents("/old", data, LEN);
+    check_contents("/old2", data, LEN);
+}
+END_TEST
+
+/* Test: deleting a snapshot frees the blocks only it was using, and
+ * keeps the ones an older snapshot still uses; once both are gone all
+ * the space is back. A deleted snapshot's slot is reused.
+ */
+START_TEST(test_snapshot_delete)
+{
+    const int LEN = 8 * FS_BLOCK_SIZE;
+    char data[LEN];
+    generate_pattern(data, LEN, 21);
+    struct statvfs s0, s1, s2;
+    ck_assert_int_eq(fs_ops.statfs("/", &s0), 0);
+
+    ck_assert_int_eq(fs_ops.create("/a", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/a", data, LEN, 0, NULL), LEN);
+    uint32_t id1 = take_snapshot();
+    ck_assert_int_eq(fs_ops.create("/b", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/b", data, LEN, 0, NULL), LEN);
+    uint32_t id2 = take_snapshot();
+    ck_assert_int_eq(fs_ops.unlink("/a"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/b"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &s1), 0);
+    ck_assert(s1.f_bfree <= s0.f_bfree - 18);      /* data and inodes */
+
+    /* /b was only in snapshot 2, /a is in both */
+    ck_assert_int_eq(fs_ops.ioctl("/", FS_IOC_SNAPDEL, NULL, NULL, 0, &id2), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &s2), 0);
+    ck_assert(s2.f_bfree >= s1.f_bfree + 9);
+    ck_assert(s2.f_bfree <= s0.f_bfree - 9);
+    ck_assert_int_eq(fs_ops.ioctl("/", FS_IOC_SNAPDEL, NULL, NULL, 0, &id2), -EINVAL);
+    fs_mount_snapshot(id1);
+    fs_ops.init(NULL);
+    check_contents("/a", data, LEN);
+    fs_mount_snapshot(0);
+    fs_ops.init(NULL);
+
+    ck_assert_int_eq(fs_ops.ioctl("/", FS_IOC_SNAPDEL, NULL, NULL, 0, &id1), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &s2), 0);
+    ck_assert_int_eq(s2.f_bfree, s0.f_bfree);
+    ck_assert_int_eq(take_snapshot(), id1);
+}
+END_TEST
+
+static int clone_file(const char *dst, const char *src) {
+    struct fs_clone_args args;
+    memset(&args, 0, sizeof(args));
+    strcpy(args.src, src);
+    return fs_ops.ioctl(dst, FS_IOC_CLONE, NULL, NULL, 0, &args);
+}
+
+/* Test: a clone shares its source's blocks - cloning allocates
+ * nothing - and writes to either file don't show through to the
+ * other. Once both are gone their blocks are free again.
+ */
+START_TEST(test_clone_cow)
+{
+    const int LEN = 5 * FS_BLOCK_SIZE;
+    char orig[LEN], a[LEN], b[LEN];
+    generate_pattern(orig, LEN, 11);
+    memcpy(a, orig, LEN);
+    generate_pattern(a + 6000, 3000, 12);
+    memcpy(b, orig, LEN);
+    generate_pattern(b + 100, 10, 13);
+
+    struct statvfs s0, s1, s2;
+    ck_assert_int_eq(fs_ops.statfs("/", &s0), 0);
+    ck_assert_int_eq(fs_ops.create("/src", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/src", orig, LEN, 0, NULL), LEN);
+    ck_assert_int_eq(fs_ops.create("/dst", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/dst", b, 100, 0, NULL), 100);
+
+    ck_assert_int_eq(fs_ops.statfs("/", &s1), 0);
+    ck_assert_int_eq(clone_file("/dst", "/src"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &s2), 0);
+    ck_assert_int_eq(s2.f_bfree, s1.f_bfree + 1);   /* dst's old block */
+    check_contents("/dst", orig, LEN);
+
+    ck_assert_int_eq(fs_ops.write("/src", a + 6000, 3000, 6000, NULL), 3000);
+    ck_assert_int_eq(fs_ops.write("/dst", b + 100, 10, 100, NULL), 10);
+    check_contents("/src", a, LEN);
+    check_contents("/dst", b, LEN);
+
+    fs_ops.init(NULL);
+    check_contents("/src", a, LEN);
+    check_contents("/dst", b, LEN);
+
+    ck_assert_int_eq(fs_ops.unlink("/src"), 0);
+    check_contents("/dst", b, LEN);
+    ck_assert_int_eq(fs_ops.unlink("/dst"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &s2), 0);
+    ck_assert_int_eq(s2.f_bfree, s0.f_bfree);
+}
+END_TEST
+
+/* Test: truncating a clone leaves the source alone; clone errors.
+ */
+START_TEST(test_clone_truncate)
+{
+    const int LEN = 3 * FS_BLOCK_SIZE;
+    char data[LEN];
+    generate_pattern(data, LEN, 21);
+    ck_assert_int_eq(fs_ops.create("/src", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/src", data, LEN, 0, NULL), LEN);
+    ck_assert_int_eq(fs_ops.create("/dst", 0100666, NULL), 0);
+    ck_assert_int_eq(clone_file("/dst", "/src"), 0);
+    ck_assert_int_eq(fs_ops.truncate("/dst", 0), 0);
+    check_contents("/src", data, LEN);
+    ck_assert_int_eq(clone_file("/dst", "/src"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/src"), 0);
+    check_contents("/dst", data, LEN);
+
+    ck_assert_int_eq(clone_file("/dst", "/nonexistent"), -ENOENT);
+    ck_assert_int_eq(fs_ops.mkdir("/cdir", 0777), 0);
+    ck_assert_int_eq(clone_file("/dst", "/cdir"), -EISDIR);
+    ck_assert_int_eq(clone_file("/cdir", "/dst"), -EISDIR);
+    ck_assert_int_eq(clone_file("/dst", "/dst"), -EINVAL);
+}
+END_TEST
+
 /* Main: add tests to the suite */
 int main(int argc, char **argv) {
     Suite *s = suite_create("fs5600-Write");
@@ -1214,7 +2597,7 @@ int main(int argc, char **argv) {
     tcase_add_test(tc, test_trunc_lt_3blk);
     tcase_add_test(tc, test_trunc_eq_3blk);
     tcase_add_test(tc, test_truncate_errors);
-    tcase_add_test(tc, test_fs_truncate_invalid);
+    tcase_add_test(tc, test_fs_truncate_extend);
     
     /* unlink tests */
     tcase_add_test(tc, test_unlink);
@@ -1246,6 +2629,24 @@ int main(int argc, char **argv) {
     tcase_add_test(tc, test_write_overwrite_eq_2blk);
     tcase_add_test(tc, test_write_overwrite_lt_3blk);
     tcase_add_test(tc, test_write_overwrite_eq_3blk);
+    tcase_add_test(tc, test_write_overwrite_partial_edges);
+    tcase_add_test(tc, test_write_within_block);
+    tcase_add_test(tc, test_read_multiblock);
+    tcase_add_test(tc, test_read_cache_coherent);
+    tcase_add_test(tc, test_write_sparse);
+    tcase_add_test(tc, test_write_zero_blocks);
+    tcase_add_test(tc, test_fallocate);
+    tcase_add_test(tc, test_delayed_alloc);
+    tcase_add_test(tc, test_alloc_locality);
+    tcase_add_test(tc, test_rename_move);
+    tcase_add_test(tc, test_deep_path);
+    tcase_add_test(tc, test_mem_stats);
+    tcase_add_test(tc, test_mem_budget);
+    tcase_add_test(tc, test_stats_file);
+    tcase_add_test(tc, test_io_profile);
+    tcase_add_test(tc, test_trace);
+    tcase_add_test(tc, test_thread_exit);
+    tcase_add_test(tc, test_record);
     
     /* utime tests */
     tcase_add_test(tc, test_utime_file);
@@ -1255,6 +2656,38 @@ int main(int argc, char **argv) {
     tcase_add_test(tc, test_fs_utime_metadata);
     
     suite_add_tcase(s, tc);
+
+    /* journal tests */
+    TCase *tc_journal = tcase_create("journal");
+    tcase_add_checked_fixture(tc_journal, test_journal_setup, test_teardown);
+    tcase_add_test(tc_journal, test_journal_ops);
+    tcase_add_test(tc_journal, test_journal_replay);
+    tcase_add_test(tc_journal, test_journal_torn);
+    tcase_add_test(tc_journal, test_journal_split);
+    tcase_add_test(tc_journal, test_journal_too_small);
+    tcase_add_test(tc_journal, test_orphan_reclaim);
+    suite_add_tcase(s, tc_journal);
+
+    /* log-structured tests */
+    TCase *tc_log = tcase_create("log");
+    tcase_add_checked_fixture(tc_log, test_log_setup, test_log_teardown);
+    tcase_add_test(tc_log, test_log_overwrite_churn);
+    suite_add_tcase(s, tc_log);
+
+    /* snapshot tests */
+    TCase *tc_snap = tcase_create("snapshot");
+    tcase_add_checked_fixture(tc_snap, test_snap_setup, test_snap_teardown);
+    tcase_add_test(tc_snap, test_snapshot_view);
+    tcase_add_test(tc_snap, test_snapshot_retain);
+    tcase_add_test(tc_snap, test_snapshot_delete);
+    suite_add_tcase(s, tc_snap);
+
+    /* clone tests */
+    TCase *tc_clone = tcase_create("clone");
+    tcase_add_checked_fixture(tc_clone, test_snap_setup, test_snap_teardown);
+    tcase_add_test(tc_clone, test_clone_cow);
+    tcase_add_test(tc_clone, test_clone_truncate);
+    suite_add_tcase(s, tc_clone);
  
     SRunner *sr = srunner_create(s);
     srunner_set_fork_status(sr, CK_NOFORK);